@@ -0,0 +1,359 @@
+"""Which sources of nondeterminism does each record/replay tool neutralize, and at what cost?
+
+This is reproducibility_tests/test.sh as a benchmark. The probe
+(test_determinism.cxx) prints one "field: value" line per source of
+nondeterminism. Each backend records the probe under one setting of the
+perturbations and replays it under another; a field is neutralized if it
+differs between two native runs but not between record and replay.
+
+Record and replay both go through run_exec and land in the results store, as
+workloads "determinism record" and "determinism replay", so they show up in
+the same DataFrame as the other experiments.
+
+"""
+
+import math
+import pathlib
+import shutil
+import subprocess
+import pandas  # type: ignore
+import typer
+from collections.abc import Mapping, Sequence
+from typing_extensions import Annotated
+from run_exec_wrapper import run_exec, DirMode, RunexecStats
+from results_store import ResultsStore, cell_id
+from prov_collectors import prov_tracer_lib
+from util import CmdArg, SubprocessError, delete_children, to_str
+
+
+result_bin = pathlib.Path("result").resolve() / "bin"
+result_lib = result_bin.parent / "lib"
+probe_source = pathlib.Path(__file__).resolve().parent.parent / "reproducibility_tests/test_determinism.cxx"
+
+# The settings of the perturbations for record and for replay, as in test.sh
+RECORD_ID = 0
+REPLAY_ID = 2
+
+
+class ReplayBackend:
+    name = "native"
+    method = "none"
+    submethod = "none"
+
+    def record(self, probe: pathlib.Path, package: pathlib.Path) -> Sequence[Sequence[CmdArg]]:
+        """Commands to record probe into package; all of them are timed."""
+        return [(probe,)]
+
+    def prepare(self, package: pathlib.Path) -> None:
+        """Untimed work between record and replay (e.g., unpacking)."""
+
+    def replay(self, probe: pathlib.Path, package: pathlib.Path) -> Sequence[CmdArg]:
+        return (probe,)
+
+
+class RR(ReplayBackend):
+    name = "rr"
+    method = "ptrace"
+    submethod = "syscalls"
+
+    def record(self, probe: pathlib.Path, package: pathlib.Path) -> Sequence[Sequence[CmdArg]]:
+        return [(result_bin / "rr", "record", f"--output-trace-dir={package / 'trace'}", probe)]
+
+    def replay(self, probe: pathlib.Path, package: pathlib.Path) -> Sequence[CmdArg]:
+        # --autopilot replays without a debugger prompt, writing the tracee's output
+        return (result_bin / "rr", "replay", "--autopilot", package / "trace")
+
+
+class ProvTracer(ReplayBackend):
+    """The tracer records which files were used, but has no replayer of its own.
+
+    Replay is a plain re-execution, so this row is the cost of recording with
+    nothing neutralized.
+
+    """
+
+    name = "prov-tracer"
+    method = "library interposition"
+    submethod = "libc I/O"
+
+    def __init__(self, lib: pathlib.Path) -> None:
+        self.lib = lib
+
+    def record(self, probe: pathlib.Path, package: pathlib.Path) -> Sequence[Sequence[CmdArg]]:
+        return [(
+            result_bin / "env",
+            f"LD_PRELOAD={self.lib}",
+            f"PROV_TRACER_FILE={package}/%p.%t.prov_trace",
+            probe,
+        )]
+
+
+class CDE(ReplayBackend):
+    name = "cde"
+    method = "ptrace"
+    submethod = "syscalls"
+
+    def record(self, probe: pathlib.Path, package: pathlib.Path) -> Sequence[Sequence[CmdArg]]:
+        return [(result_bin / "cde", "-o", package / "cde-package", probe)]
+
+    def replay(self, probe: pathlib.Path, package: pathlib.Path) -> Sequence[CmdArg]:
+        # CDE writes a wrapper per recorded program, which enters cde-root and runs cde-exec
+        return (package / "cde-package" / f"{probe.name}.cde",)
+
+
+class ReproZip(ReplayBackend):
+    name = "reprozip"
+    method = "ptrace"
+    submethod = "syscalls"
+
+    def record(self, probe: pathlib.Path, package: pathlib.Path) -> Sequence[Sequence[CmdArg]]:
+        return [
+            (result_bin / "reprozip", "trace", "--dir", package / "trace", probe),
+            (result_bin / "reprozip", "pack", "--dir", package / "trace", package / "probe.rpz"),
+        ]
+
+    def prepare(self, package: pathlib.Path) -> None:
+        # Unpacking is a one-time cost per package, so it is not part of replay overhead.
+        shutil.rmtree(package / "trace")
+        subprocess.run(
+            [result_bin / "reprounzip", "directory", "setup", package / "probe.rpz", package / "unpacked"],
+            check=True,
+            capture_output=True,
+        )
+
+    def replay(self, probe: pathlib.Path, package: pathlib.Path) -> Sequence[CmdArg]:
+        return (result_bin / "reprounzip", "directory", "run", package / "unpacked")
+
+
+def build_probe(work_dir: pathlib.Path) -> pathlib.Path:
+    probe = work_dir / "test_files/test_determinism"
+    subprocess.run(
+        [result_bin / "g++", "-mrdrnd", "-Wall", "-Wextra", probe_source, "-o", probe],
+        check=True,
+    )
+    return probe
+
+
+def setup_test_files(work_dir: pathlib.Path) -> None:
+    disorderfs_source = work_dir / "test_files/disorderfs_source"
+    if not disorderfs_source.exists():
+        disorderfs_source.mkdir(parents=True)
+        for i in range(1, 21):
+            (disorderfs_source / str(i)).touch()
+
+
+def unmount_disorderfs(work_dir: pathlib.Path) -> None:
+    mount_point = work_dir / "test_files/disorderfs"
+    if mount_point.is_mount():
+        subprocess.run(["umount", mount_point], check=True)
+    if mount_point.exists():
+        mount_point.rmdir()
+
+
+def perturb(work_dir: pathlib.Path, perturbation: int) -> Mapping[str, str]:
+    """Apply setting perturbation of the file system perturbations; returns the env perturbation."""
+    (work_dir / "test_files/contents").write_text(str(perturbation))
+    # A new file gets a new inode
+    (work_dir / "test_files/inode").unlink(missing_ok=True)
+    (work_dir / "test_files/inode").write_text("hi\n")
+    unmount_disorderfs(work_dir)
+    (work_dir / "test_files/disorderfs").mkdir()
+    subprocess.run(
+        [
+            result_bin / "disorderfs", "--shuffle-dirents=yes",
+            work_dir / "test_files/disorderfs_source", work_dir / "test_files/disorderfs",
+        ],
+        check=True,
+        capture_output=True,
+    )
+    return {"test_env_var": str(perturbation)}
+
+
+def run_perturbed(
+        cmd: Sequence[CmdArg],
+        work_dir: pathlib.Path,
+        package: pathlib.Path,
+        perturbation: int,
+) -> RunexecStats:
+    env = perturb(work_dir, perturbation)
+    # run_exec has no umask option, so set it in a shell which execs cmd
+    cmd = (result_bin / "sh", "-c", 'umask "$0"; exec "$@"', f"00{perturbation}", *cmd)
+    full_env = {
+        "LD_LIBRARY_PATH": str(result_lib),
+        "PATH": str(result_bin),
+        **env,
+    }
+    stats = run_exec(
+        cmd=cmd,
+        cwd=work_dir,
+        env=full_env,
+        dir_modes={
+            work_dir: DirMode.FULL_ACCESS,
+            package: DirMode.FULL_ACCESS,
+            pathlib.Path("/nix/store"): DirMode.READ_ONLY,
+        },
+        network_access=True,
+    )
+    if not stats.success:
+        raise SubprocessError(
+            cmd=cmd,
+            env=full_env,
+            cwd=work_dir,
+            returncode=stats.exitcode,
+            stdout=to_str(stats.stdout),
+            stderr=to_str(stats.stderr),
+        )
+    return stats
+
+
+def parse_probe_output(stdout: bytes) -> Mapping[str, str]:
+    fields = {}
+    for line in to_str(stdout).splitlines():
+        field, sep, value = line.partition(": ")
+        # The leading note has no ": "
+        if sep:
+            fields[field.strip()] = value.strip()
+    return fields
+
+
+def directory_size(path: pathlib.Path) -> int:
+    return sum(child.stat().st_size for child in path.glob("**/*") if child.is_file() and not child.is_symlink())
+
+
+def run_backend(
+        store: ResultsStore,
+        backend: ReplayBackend,
+        iteration: int,
+        probe: pathlib.Path,
+        work_dir: pathlib.Path,
+        package: pathlib.Path,
+        nondeterministic: frozenset[str],
+) -> tuple[str, str]:
+    if package.exists():
+        shutil.rmtree(package)
+    package.mkdir(parents=True)
+
+    record_stats = [
+        run_perturbed(cmd, work_dir, package, RECORD_ID)
+        for cmd in backend.record(probe, package)
+    ]
+    record_output = parse_probe_output(record_stats[0].stdout)
+    package_size = directory_size(package)
+    backend.prepare(package)
+    replay_stats = run_perturbed(backend.replay(probe, package), work_dir, package, REPLAY_ID)
+    replay_output = parse_probe_output(replay_stats.stdout)
+
+    record_cell = cell_id(backend.name, "determinism record", iteration)
+    store.append(
+        record_cell,
+        collector=backend.name,
+        collector_method=backend.method,
+        collector_submethod=backend.submethod,
+        workload="determinism record",
+        workload_kind="determinism",
+        iteration=iteration,
+        cputime=sum(stats.cputime for stats in record_stats),
+        walltime=sum(stats.walltime for stats in record_stats),
+        memory=max(stats.memory for stats in record_stats),
+        provenance_size=package_size,
+        operations=(),
+        counters={},
+    )
+    replay_cell = cell_id(backend.name, "determinism replay", iteration)
+    store.append(
+        replay_cell,
+        collector=backend.name,
+        collector_method=backend.method,
+        collector_submethod=backend.submethod,
+        workload="determinism replay",
+        workload_kind="determinism",
+        iteration=iteration,
+        cputime=replay_stats.cputime,
+        walltime=replay_stats.walltime,
+        memory=replay_stats.memory,
+        provenance_size=package_size,
+        operations=(),
+        counters={
+            # 1 if replay reproduced the recorded value; NaN if the field is deterministic natively anyway
+            f"neutralized {field}": (
+                float(replay_output.get(field) == value)
+                if field in nondeterministic else
+                math.nan
+            )
+            for field, value in record_output.items()
+        },
+    )
+    return record_cell, replay_cell
+
+
+def summarize(cells: pandas.DataFrame) -> pandas.DataFrame:
+    cells = cells.assign(counters=lambda df: df["counters"].map(dict))
+    medians = cells.groupby(["collector", "workload"])[["walltime", "storage"]].median()
+    native_walltime = medians.loc[("native", "determinism record"), "walltime"]
+    replays = cells[cells["workload"] == "determinism replay"]
+    neutralized = replays.groupby("collector")["counters"].agg(lambda counters: sorted(
+        key.removeprefix("neutralized ")
+        for key in set().union(*counters)
+        if all(counter.get(key) == 1.0 for counter in counters)
+    ))
+    return pandas.DataFrame({
+        "record_overhead": medians.xs("determinism record", level="workload")["walltime"] / native_walltime,
+        "replay_overhead": medians.xs("determinism replay", level="workload")["walltime"] / native_walltime,
+        "package_size": medians.xs("determinism record", level="workload")["storage"],
+        "neutralized": neutralized,
+    })
+
+
+def main(
+        backend_names: Annotated[list[str], typer.Option("--backend", "-b")] = ["rr", "prov-tracer", "cde", "reprozip"],
+        iterations: int = 1,
+        prov_tracer: pathlib.Path = prov_tracer_lib,
+) -> None:
+    """Record and replay the determinism probe under each backend.
+
+    Prints, per backend, the median record and replay walltime relative to a
+    native run, the package size, and the probe fields which every replay
+    reproduced.
+
+    """
+    backends = {
+        backend.name: backend
+        for backend in [RR(), ProvTracer(prov_tracer), CDE(), ReproZip()]
+    }
+    store = ResultsStore(pathlib.Path(".cache/results"))
+    big_temp_dir = pathlib.Path(".workdir/determinism").resolve()
+    work_dir = big_temp_dir / "work"
+    package_dir = big_temp_dir / "package"
+    work_dir.mkdir(exist_ok=True, parents=True)
+    package_dir.mkdir(exist_ok=True, parents=True)
+    unmount_disorderfs(work_dir)
+    delete_children(work_dir)
+    setup_test_files(work_dir)
+    probe = build_probe(work_dir)
+    native = ReplayBackend()
+    cell_ids = []
+    try:
+        for iteration in range(iterations):
+            # Two native runs under different perturbations find the fields which are nondeterministic here.
+            outputs = [
+                parse_probe_output(run_perturbed((probe,), work_dir, package_dir, perturbation).stdout)
+                for perturbation in [RECORD_ID, REPLAY_ID]
+            ]
+            nondeterministic = frozenset(
+                field
+                for field in outputs[0].keys() | outputs[1].keys()
+                if outputs[0].get(field) != outputs[1].get(field)
+            )
+            for backend in [native, *(backends[name] for name in backend_names)]:
+                cell_ids.extend(run_backend(
+                    store, backend, iteration, probe, work_dir, package_dir / backend.name, nondeterministic,
+                ))
+    finally:
+        unmount_disorderfs(work_dir)
+    store.compact()
+    with pandas.option_context("display.max_colwidth", None, "display.width", None):
+        print(summarize(store.cells(cell_ids)))
+
+
+if __name__ == "__main__":
+    typer.run(main)
@@ -1,25 +1,29 @@
 import os
+import fcntl
 import dataclasses
-import hashlib
+import datetime
 import urllib.parse
 import sys
+import time
 import itertools
+import math
 import random
 import pathlib
+import pickle
 import collections
 import tqdm  # type: ignore
-import pickle
 import pandas  # type: ignore
-import psutil
-import charmonium.time_block as ch_time_block
-from collections.abc import Sequence
+import timeline
+from collections.abc import Sequence, Mapping
 from workloads import Workload
 from prov_collectors import ProvCollector, ProvOperation
-from run_exec_wrapper import run_exec, DirMode
+from run_exec_wrapper import run_exec, DirMode, cpu_assignment, namespace_setup_walltime
+from results_store import ResultsStore, cell_id
+from work_queue import WorkQueue, QueuedCell, machine_class
 from util import (
     delete_children, move_children,
     hardlink_children, shuffle, expect_type, to_str, merge_env_vars,
-    SubprocessError, n_unique
+    SubprocessError,
 )
 
 
@@ -35,39 +39,30 @@ def get_results(
         ignore_failures: bool,
         rerun: bool,
         parallelism: int,
+        queue: WorkQueue | None = None,
+        queue_machine_class: str | None = None,
+        pin_cores: bool = False,
+        use_namespaces: bool = False,
+        cache_dir: pathlib.Path = pathlib.Path(".cache"),
 ) -> pandas.DataFrame:
-    cache_dir = pathlib.Path(".cache")
     big_temp_dir = pathlib.Path(".workdir")
     size = 256
-    key = (cache_dir / ("results_" + "_".join([
-        *[prov_collector.name for prov_collector in prov_collectors],
-        hashlib.sha256("".join(workload.name for workload in workloads).encode()).hexdigest()[:10],
-        str(iterations),
-        str(size),
-        str(seed),
-    ]) + ".pkl"))
-    # If we are rerunning anything, then we can't trust the aggregated results
-    if rerun:
-        for file in cache_dir.iterdir():
-            if file.name.startswith("results_"):
-                file.unlink()
-    if key.exists():
-        return expect_type(pandas.DataFrame, pickle.loads(key.read_bytes()))
-    else:
-        results_df = run_experiments(
-            prov_collectors,
-            workloads,
-            cache_dir,
-            big_temp_dir,
-            iterations,
-            size,
-            seed,
-            ignore_failures,
-            rerun,
-            parallelism,
-        )
-        key.write_bytes(pickle.dumps(results_df))
-        return results_df
+    return run_experiments(
+        prov_collectors,
+        workloads,
+        cache_dir,
+        big_temp_dir,
+        iterations,
+        size,
+        seed,
+        ignore_failures,
+        rerun,
+        parallelism,
+        queue,
+        queue_machine_class,
+        parallelism if pin_cores else None,
+        use_namespaces,
+    )
 
 
 def run_experiments(
@@ -81,6 +76,10 @@ def run_experiments(
         ignore_failures: bool,
         rerun: bool,
         parallelism: int,
+        queue: WorkQueue | None = None,
+        queue_machine_class: str | None = None,
+        cpu_slots: int | None = None,
+        use_namespaces: bool = False,
 ) -> pandas.DataFrame:
     prng = random.Random(seed)
     # Shuffle within each iteration
@@ -93,6 +92,8 @@ def run_experiments(
         for iteration in range(iterations)
     ))
     big_temp_dir.mkdir(exist_ok=True, parents=True)
+    timeline_dir = big_temp_dir / "timeline" / datetime.datetime.now().strftime("%Y-%m-%dT%H-%M-%S")
+    timeline.start(timeline_dir)
     temp_dir = big_temp_dir / "temp"
     log_dir = big_temp_dir / "log"
     artifacts_dir = big_temp_dir / "artifacts"
@@ -101,64 +102,73 @@ def run_experiments(
     log_dir.mkdir(exist_ok=True)
     work_dir.mkdir(exist_ok=True)
     assert list(inputs)
-    if parallelism == 1:
-        result_list = (
-            (prov_collector, workload, run_one_experiment_cached(
-                cache_dir, iteration, prov_collector, workload,
+    store = ResultsStore(cache_dir / "results")
+    if queue is not None:
+        cell_ids = run_experiments_on_queue(
+            store, queue, queue_machine_class or machine_class(), inputs, ignore_failures, rerun,
+        )
+    elif parallelism == 1:
+        cell_ids = [
+            run_one_experiment_cached(
+                store, iteration, prov_collector, workload,
                 work_dir, log_dir, temp_dir, artifacts_dir, size, ignore_failures,
-                rerun,
-            ))
+                rerun, cpu_slots, use_namespaces,
+            )
             for iteration, prov_collector, workload in tqdm.tqdm(inputs)
-        )
+        ]
     else:
         import dask
         import dask.diagnostics
         dask.diagnostics.ProgressBar().register()
-        result_list = dask.compute(
+        cell_ids = dask.compute(
             [
-                (prov_collector, workload, dask.delayed(run_one_experiment_cached)(
-                    cache_dir, iteration, prov_collector, workload,
+                dask.delayed(run_one_experiment_cached)(
+                    store, iteration, prov_collector, workload,
                     work_dir, log_dir, temp_dir, artifacts_dir, size, ignore_failures,
-                    rerun,
-                ))
+                    rerun, cpu_slots, use_namespaces,
+                )
                 for iteration, prov_collector, workload in tqdm.tqdm(inputs)
             ],
             scheduler="processes",
             num_workers=parallelism,
         )[0]
-    with ch_time_block.ctx("Construct DataFrame"):
+    with timeline.span("Compact results", "store"):
+        store.compact()
+    with timeline.span("Construct DataFrame", "aggregate"):
         results_df = (
-            pandas.DataFrame.from_records(
-                {
-                    "collector": prov_collector.name,
-                    "collector_method": prov_collector.method,
-                    "collector_submethod": prov_collector.submethod,
-                    "workload": workload.name,
-                    "workload_kind": workload.kind,
-                    "cputime": stats.cputime,
-                    "walltime": stats.walltime,
-                    "memory": stats.memory,
-                    "storage": stats.provenance_size,
-                    "n_ops": len(stats.operations),
-                    "n_unique_files": n_unique(itertools.chain(
-                        (op.target0 for op in stats.operations),
-                        (op.target1 for op in stats.operations),
-                    )),
-                    "op_type_counts": collections.Counter(
-                        op.type for op in stats.operations
-                    ),
-                }
-                for prov_collector, workload, stats in result_list
-                if stats is not None
-            )
+            store.cells([this_cell_id for this_cell_id in cell_ids if this_cell_id is not None])
             .assign(**{
                 "collector": lambda df: df["collector"].astype("category"),
                 "collector_method": lambda df: df["collector_method"].astype("category"),
                 "collector_submethod": lambda df: df["collector_submethod"].astype("category"),
                 "workload": lambda df: df["workload"].astype("category"),
                 "workload_kind": lambda df: df["workload_kind"].astype("category"),
+                # Arrow maps come back as lists of pairs
+                "op_type_counts": lambda df: df["op_type_counts"].map(lambda pairs: collections.Counter(dict(pairs))),
+                "counters": lambda df: df["counters"].map(dict),
+            })
+            .assign(**{
+                "syscalls": lambda df: df["counters"].map(lambda counters: counters.get("syscalls", math.nan)),
+                "io_syscalls": lambda df: df["counters"].map(lambda counters: counters.get("syscr", math.nan) + counters.get("syscw", math.nan)),
+                "io_bytes": lambda df: df["counters"].map(lambda counters: counters.get("rchar", math.nan) + counters.get("wchar", math.nan)),
             })
         )
+    with timeline.span("Operational intensity", "aggregate"):
+        # Only io-counters runs collect counters (see IOCounters), but the intensity
+        # of a workload is a feature of every row (to predict collector overhead from it).
+        baseline = results_df[results_df["collector"] == "io-counters"]
+        intensity = pandas.DataFrame({
+            "syscalls_per_cpu_sec": baseline["syscalls"] / baseline["cputime"],
+            "io_syscalls_per_cpu_sec": baseline["io_syscalls"] / baseline["cputime"],
+            "io_bytes_per_cpu_sec": baseline["io_bytes"] / baseline["cputime"],
+            "workload": baseline["workload"],
+        }).groupby("workload", observed=True).median()
+        results_df = results_df.join(intensity, on="workload")
+    timeline.export_chrome_trace(timeline_dir, timeline_dir / "trace.json")
+    summary = timeline.summarize(timeline_dir)
+    (timeline_dir / "summary.txt").write_text(summary + "\n")
+    print(f"Timeline in {timeline_dir / 'trace.json'}")
+    print(summary)
     return results_df
 
 
@@ -169,10 +179,11 @@ class ExperimentStats:
     memory: int
     provenance_size: int
     operations: tuple[ProvOperation, ...]
+    counters: Mapping[str, float]
 
 
 def run_one_experiment_cached(
-    cache_dir: pathlib.Path,
+    store: ResultsStore,
     iteration: int,
     prov_collector: ProvCollector,
     workload: Workload,
@@ -183,24 +194,171 @@ def run_one_experiment_cached(
     size: int,
     ignore_failures: bool,
     rerun: bool,
-) -> ExperimentStats | None:
-    key = (cache_dir / ("_".join([
-        urllib.parse.quote(prov_collector.name, safe=''),
-        urllib.parse.quote(workload.name, safe=''),
-        str(iteration)
-    ]))).with_suffix(".pkl")
-    if (not rerun) and key.exists():
-        return expect_type(ExperimentStats, pickle.loads(key.read_bytes()))
-    else:
-        delete_children(temp_dir)
+    cpu_slots: int | None = None,
+    use_namespaces: bool = False,
+) -> str | None:
+    this_cell_id = cell_id(prov_collector.name, workload.name, iteration)
+    if (not rerun) and (store.has(this_cell_id) or import_pickled_cell(store, this_cell_id, iteration, prov_collector, workload)):
+        return this_cell_id
+    slot = worker_slot(temp_dir.parent, cpu_slots)
+    with timeline.context(
+            worker=slot,
+            cell=this_cell_id,
+            collector=prov_collector.name,
+            workload=workload.name,
+    ):
+        with timeline.span(f"clean {temp_dir / str(slot)}", "cleanup"):
+            delete_children(temp_dir / str(slot))
         stats = run_one_experiment(
             iteration, prov_collector, workload, work_dir, log_dir,
-            temp_dir, artifacts_dir, size, ignore_failures,
+            temp_dir, artifacts_dir, size, ignore_failures, cpu_slots,
+            use_namespaces,
         )
-        if stats is not None:
-            cache_dir.mkdir(exist_ok=True, parents=True)
-            key.write_bytes(pickle.dumps(stats))
-        return stats
+        if stats is None:
+            return None
+        store_stats(store, this_cell_id, iteration, prov_collector, workload, stats)
+        return this_cell_id
+
+
+def store_stats(
+        store: ResultsStore,
+        this_cell_id: str,
+        iteration: int,
+        prov_collector: ProvCollector,
+        workload: Workload,
+        stats: ExperimentStats,
+) -> None:
+    with timeline.span(f"store {prov_collector} {workload}", "store"):
+        store.append(
+            this_cell_id,
+            collector=prov_collector.name,
+            collector_method=prov_collector.method,
+            collector_submethod=prov_collector.submethod,
+            workload=workload.name,
+            workload_kind=workload.kind,
+            iteration=iteration,
+            cputime=stats.cputime,
+            walltime=stats.walltime,
+            memory=stats.memory,
+            provenance_size=stats.provenance_size,
+            operations=stats.operations,
+            counters=stats.counters,
+        )
+
+
+def import_pickled_cell(
+        store: ResultsStore,
+        this_cell_id: str,
+        iteration: int,
+        prov_collector: ProvCollector,
+        workload: Workload,
+) -> bool:
+    """Move this cell from the per-cell pickle cache which preceded ResultsStore into store, if it is there.
+
+    That cache kept each cell's ExperimentStats in .cache/{cell_id}.pkl; cells
+    pickled before counters were collected get none.
+
+    """
+    pickled = store.root.parent / f"{this_cell_id}.pkl"
+    if not pickled.exists():
+        return False
+    old_stats = pickle.loads(pickled.read_bytes())
+    store_stats(store, this_cell_id, iteration, prov_collector, workload, ExperimentStats(
+        cputime=old_stats.cputime,
+        walltime=old_stats.walltime,
+        memory=old_stats.memory,
+        provenance_size=old_stats.provenance_size,
+        operations=old_stats.operations,
+        counters=getattr(old_stats, "counters", {}),
+    ))
+    pickled.unlink()
+    return True
+
+
+def run_experiments_on_queue(
+        store: ResultsStore,
+        queue: WorkQueue,
+        this_machine_class: str,
+        inputs: Sequence[tuple[int, ProvCollector, Workload]],
+        ignore_failures: bool,
+        rerun: bool,
+        poll_interval: float = 5,
+        heartbeat_timeout: float = 600,
+        max_attempts: int = 3,
+) -> list[str | None]:
+    """Hand out cells to workers (see worker.py) through the queue, and store what they push back.
+
+    Workers must be started separately, on machines of this_machine_class.
+
+    """
+    cells = {
+        cell_id(prov_collector.name, workload.name, iteration): (iteration, prov_collector, workload)
+        for iteration, prov_collector, workload in inputs
+    }
+    cell_ids: dict[str, str | None] = {
+        this_cell_id: this_cell_id
+        for this_cell_id, (iteration, prov_collector, workload) in cells.items()
+        if (not rerun) and (store.has(this_cell_id) or import_pickled_cell(store, this_cell_id, iteration, prov_collector, workload))
+    }
+    queue.enqueue([
+        QueuedCell(this_cell_id, iteration, prov_collector.name, workload.name, this_machine_class)
+        for this_cell_id, (iteration, prov_collector, workload) in cells.items()
+        if this_cell_id not in cell_ids
+    ])
+    print(f"Queued {len(cells) - len(cell_ids)} cells for machine class {this_machine_class!r} in {queue.path}")
+    with tqdm.tqdm(total=len(cells), initial=len(cell_ids)) as progress_bar:
+        while len(cell_ids) < len(cells):
+            if n_requeued := queue.requeue_stale(heartbeat_timeout, max_attempts):
+                print(f"Requeued {n_requeued} cells from workers which stopped heartbeating")
+            for this_cell_id, stats in queue.take_finished([
+                    this_cell_id for this_cell_id in cells if this_cell_id not in cell_ids
+            ]):
+                if stats is not None:
+                    iteration, prov_collector, workload = cells[this_cell_id]
+                    store_stats(store, this_cell_id, iteration, prov_collector, workload, expect_type(ExperimentStats, stats))
+                    cell_ids[this_cell_id] = this_cell_id
+                elif ignore_failures:
+                    cell_ids[this_cell_id] = None
+                else:
+                    raise RuntimeError(f"{this_cell_id} failed on a worker; see its output")
+                progress_bar.update(1)
+            if len(cell_ids) < len(cells):
+                time.sleep(poll_interval)
+    return list(cell_ids.values())
+
+
+# This process's slot, and the open lock file that holds it
+_worker_slot: tuple[int, int] | None = None
+
+
+def worker_slot(big_temp_dir: pathlib.Path, n_slots: int | None = None) -> int:
+    """This process's slot among the workers sharing big_temp_dir, held for its lifetime.
+
+    Each slot is an exclusive lock on a file in big_temp_dir/slots, so no two
+    live workers hold the same slot, even if a worker was restarted or the
+    workers were started separately (worker.py). The slot names the worker's
+    own work, log and temp directories and its timeline lane, and with
+    n_slots (workers pinned to cores), picks its cores.
+
+    """
+    global _worker_slot
+    if _worker_slot is None:
+        slots_dir = big_temp_dir / "slots"
+        slots_dir.mkdir(exist_ok=True, parents=True)
+        for slot in itertools.count() if n_slots is None else range(n_slots):
+            lock_fd = os.open(slots_dir / str(slot), os.O_CREAT | os.O_RDWR, 0o644)
+            try:
+                fcntl.flock(lock_fd, fcntl.LOCK_EX | fcntl.LOCK_NB)
+            except BlockingIOError:
+                os.close(lock_fd)
+            else:
+                _worker_slot = (slot, lock_fd)
+                break
+        else:
+            raise RuntimeError(f"All {n_slots} slots in {slots_dir} are taken; are more workers running than --pin-cores says?")
+    if n_slots is not None and _worker_slot[0] >= n_slots:
+        raise RuntimeError(f"This worker holds slot {_worker_slot[0]}, but only {n_slots} have cores")
+    return _worker_slot[0]
 
 
 def run_one_experiment(
@@ -213,19 +371,26 @@ def run_one_experiment(
     artifacts_dir: pathlib.Path,
     size: int,
     ignore_failures: bool,
+    cpu_slots: int | None = None,
+    use_namespaces: bool = False,
 ) -> ExperimentStats | None:
-    # This even works when we don't have parallelism:
-    this_process = psutil.Process()
-    parent_process = this_process.parent()
-    sibling_processes = parent_process.children()
-    worker_number = sibling_processes.index(this_process)
+    """Run workload in prov_collector once.
+
+    If cpu_slots is given, the run is pinned to this worker's share of the
+    cores, out of cpu_slots parallel workers on this machine. If
+    use_namespaces, it runs in a container (see run_exec), and the cost of
+    setting that up is recorded in the counters as namespace_setup_walltime.
+
+    """
+    worker_number = worker_slot(temp_dir.parent, cpu_slots)
+    cpu = cpu_assignment(worker_number, cpu_slots) if cpu_slots is not None else None
 
     # This renames the relevant directories so they don't conflict with other workers
     work_dir = work_dir / str(worker_number)
     log_dir = log_dir / str(worker_number)
     temp_dir = temp_dir / str(worker_number)
 
-    with ch_time_block.ctx(f"setup {workload}"):
+    with timeline.span(f"setup {workload}", "setup"):
         try:
             work_dir.mkdir(exist_ok=True, parents=True)
             workload.setup(work_dir)
@@ -237,11 +402,14 @@ def run_one_experiment(
                 memory=0,
                 provenance_size=0,
                 operations=(),
+                counters={},
             )
+
+    with timeline.span(f"clean {log_dir}", "cleanup"):
         log_dir.mkdir(exist_ok=True, parents=True)
         delete_children(log_dir)
 
-    with ch_time_block.ctx(f"setup {prov_collector}"):
+    with timeline.span(f"setup {prov_collector}", "setup"):
         if prov_collector.requires_empty_dir:
             (temp_dir / "old_work_dir").mkdir()
             hardlink_children(work_dir, temp_dir / "old_work_dir")
@@ -256,7 +424,7 @@ def run_one_experiment(
         cmd = prov_collector.run(cmd, log_dir, size)
         # cmd = (result_bin / "setarch", "--addr-no-randomize", *cmd)
 
-    with ch_time_block.ctx(f"run {workload} in {prov_collector}"):
+    with timeline.span(f"run {workload} in {prov_collector}", "run"):
         full_env = merge_env_vars(
             {
                 "LD_LIBRARY_PATH": str(result_lib),
@@ -277,6 +445,8 @@ def run_one_experiment(
                 pathlib.Path("/nix/store"): DirMode.READ_ONLY,
             },
             network_access=workload.network_access,
+            cpu=cpu,
+            use_namespaces=use_namespaces,
         )
 
     if not stats.success:
@@ -291,7 +461,12 @@ def run_one_experiment(
                 stdout=to_str(stats.stdout),
                 stderr=to_str(stats.stderr),
             )
-    with ch_time_block.ctx(f"parse {prov_collector}"):
+    with timeline.span(f"parse {prov_collector}", "parse"):
+        counters = dict(prov_collector.counters(log_dir))
+        if stats.cpu_freq_khz is not None:
+            counters["cpu_freq_khz"] = stats.cpu_freq_khz
+        if use_namespaces:
+            counters["namespace_setup_walltime"] = namespace_setup_walltime()
         provenance_size = 0
         for child in log_dir.iterdir():
             provenance_size += child.stat().st_size
@@ -313,4 +488,5 @@ def run_one_experiment(
         memory=stats.memory,
         provenance_size=provenance_size,
         operations=operations,
+        counters=counters,
     )
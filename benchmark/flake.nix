@@ -54,6 +54,32 @@
               install postmark $out/bin
             '';
           };
+          synthetic-io = pkgs.stdenv.mkDerivation {
+            pname = "synthetic-io";
+            version = "0.1.0";
+            src = ./synthetic_io.c;
+            dontUnpack = true;
+            buildPhase = ''
+              cc $src -Wall -Wextra -O2 -pthread -o synthetic_io
+            '';
+            installPhase = ''
+              install --directory $out/bin
+              install synthetic_io $out/bin
+            '';
+          };
+          io-counters = pkgs.stdenv.mkDerivation {
+            pname = "io-counters";
+            version = "0.1.0";
+            src = ./io_counters.c;
+            dontUnpack = true;
+            buildPhase = ''
+              cc $src -Wall -Wextra -O2 -o io_counters
+            '';
+            installPhase = ''
+              install --directory $out/bin
+              install io_counters $out/bin
+            '';
+          };
           splash-3 = pkgs.stdenv.mkDerivation rec {
             pname = "splash";
             version = "3";
@@ -605,6 +631,8 @@
               # Benchmark
               pkgs.blast
               postmark-from-src
+              synthetic-io
+              io-counters
               pkgs.lighttpd
               apacheHttpd
               miniHttpd
@@ -687,6 +715,7 @@
                 benchexec
                 charmonium-time-block
                 pypkgs.psutil
+                pypkgs.pyarrow
 
                 # deps of notebooks
                 # pypkgs.arviz
@@ -0,0 +1,155 @@
+/*
+ * Run a command and report how much I/O its whole process tree did.
+ *
+ * Compile me with
+ *
+ *     gcc -Wall -Wextra -O2 io_counters.c -o io_counters
+ *
+ * Usage:
+ *
+ *     io_counters OUTPUT_FILE CMD [ARGS...]
+ *
+ * OUTPUT_FILE gets one "key: value" line per counter:
+ *
+ *   - the fields of /proc/self/io (rchar, wchar, syscr, syscw, read_bytes,
+ *     write_bytes, cancelled_write_bytes), read after the command has been
+ *     reaped. The kernel folds each reaped child's counters into its parent, and
+ *     we make ourselves a child subreaper, so orphaned grandchildren that exit
+ *     before the command does are counted too.
+ *
+ *   - syscalls, the count of the raw_syscalls:sys_enter tracepoint over the
+ *     command and its descendants. This is the same inherited counter that
+ *     `perf stat -e raw_syscalls:sys_enter` would use, but it saves us a
+ *     dependency on perf. It is -1 if the tracepoint is not accessible (see
+ *     /proc/sys/kernel/perf_event_paranoid).
+ *
+ * Both of these are cheap: the kernel maintains the /proc counters anyway, and
+ * the tracepoint counter costs one increment per syscall.
+ *
+ * The exit code is that of CMD (or 128 + signal).
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#define unlikely(x)    __builtin_expect(!!(x), 0)
+
+#define EXPECT_POSITIVE(expr) ({\
+            long ret = expr; \
+            if (unlikely(ret < 0)) { \
+                fprintf(stderr, "failure on line %d: %s\nreturned a negative, %ld\nstrerror: %s\n", __LINE__, #expr, ret, strerror(errno)); \
+                abort(); \
+            } \
+            ret; \
+    })
+
+static const char* tracepoint_id_files[] = {
+    "/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+    "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id",
+};
+
+/* Returns a perf fd counting syscalls of pid and its future children, or -1. */
+static int open_syscall_counter(pid_t pid) {
+    long long id = -1;
+    for (size_t i = 0; i < sizeof(tracepoint_id_files) / sizeof(tracepoint_id_files[0]) && id < 0; ++i) {
+        FILE* file = fopen(tracepoint_id_files[i], "r");
+        if (file) {
+            if (fscanf(file, "%lld", &id) != 1) {
+                id = -1;
+            }
+            fclose(file);
+        }
+    }
+    if (id < 0) {
+        return -1;
+    }
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_TRACEPOINT;
+    attr.config = (uint64_t) id;
+    attr.disabled = 1;
+    attr.enable_on_exec = 1;
+    attr.inherit = 1;
+    return (int) syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s OUTPUT_FILE CMD [ARGS...]\n", argv[0]);
+        return 2;
+    }
+    FILE* output = fopen(argv[1], "w");
+    if (!output) {
+        fprintf(stderr, "fopen %s: %s\n", argv[1], strerror(errno));
+        return 2;
+    }
+    EXPECT_POSITIVE(prctl(PR_SET_CHILD_SUBREAPER, 1, 0, 0, 0));
+
+    /* The child waits on the pipe until the counter is attached, so that
+     * enable_on_exec catches the exec. */
+    int go[2];
+    EXPECT_POSITIVE(pipe2(go, O_CLOEXEC));
+    pid_t pid = EXPECT_POSITIVE(fork());
+    if (pid == 0) {
+        char byte;
+        close(go[1]);
+        if (read(go[0], &byte, 1) != 1) {
+            _exit(127);
+        }
+        execvp(argv[2], &argv[2]);
+        fprintf(stderr, "execvp %s: %s\n", argv[2], strerror(errno));
+        _exit(127);
+    }
+    close(go[0]);
+    int counter = open_syscall_counter(pid);
+    EXPECT_POSITIVE(write(go[1], "", 1));
+    close(go[1]);
+
+    int wstatus;
+    while (waitpid(pid, &wstatus, 0) < 0) {
+        if (errno != EINTR) {
+            fprintf(stderr, "waitpid: %s\n", strerror(errno));
+            return 2;
+        }
+    }
+    /* Reap orphans which have already exited; still-running ones are not waited for. */
+    while (waitpid(-1, NULL, WNOHANG) > 0) { }
+
+    FILE* proc_io = fopen("/proc/self/io", "r");
+    if (proc_io) {
+        char line[256];
+        while (fgets(line, sizeof(line), proc_io)) {
+            fputs(line, output);
+        }
+        fclose(proc_io);
+    }
+    long long syscalls = -1;
+    if (counter >= 0) {
+        uint64_t value;
+        if (read(counter, &value, sizeof(value)) == sizeof(value)) {
+            syscalls = (long long) value;
+        }
+        close(counter);
+    }
+    fprintf(output, "syscalls: %lld\n", syscalls);
+    fclose(output);
+
+    if (WIFSIGNALED(wstatus)) {
+        return 128 + WTERMSIG(wstatus);
+    } else {
+        return WEXITSTATUS(wstatus);
+    }
+}
@@ -0,0 +1,119 @@
+import json
+import pathlib
+import subprocess
+import typer
+import pandas  # type: ignore
+from typing_extensions import Annotated
+from experiment import get_results
+from workloads import WORKLOADS
+from prov_collectors import NoProv, ProvTracer, prov_tracer_slim_lib
+from util import confidence_interval
+
+
+# Pinned by name, so the gate keeps measuring the same thing as groups change;
+# a baseline only compares with runs over the same workloads.
+GATE_WORKLOADS = [
+    "hello", "ps", "true", "echo", "ls",
+    "python-hello-world", "python-import",
+    "gcc-hello-world", "gcc-hello-world threads",
+    "lm-getppid", "lm-read", "lm-write", "lm-stat", "lm-fstat", "lm-open/close",
+    "lm-fork", "lm-exec", "lm-fs",
+    "archive", "archive gzip", "unarchive", "unarchive gzip",
+]
+
+# Its own results store: gate cells are rerun at every commit, and must not
+# overwrite the cells of the main experiment (in .cache/results).
+GATE_CACHE_DIR = pathlib.Path(".cache/overhead_gate")
+
+
+def overhead_cis(df: pandas.DataFrame, confidence_level: float, seed: int) -> pandas.DataFrame:
+    """Per workload, the mean of prov-tracer walltime / noprov walltime, with a bootstrap confidence interval.
+
+    Ratios are paired by iteration, since the two cells of one iteration ran
+    close together.
+
+    """
+    walltimes = df.pivot_table(index=["workload", "iteration"], columns="collector", values="walltime", observed=True)
+    ratios = (walltimes["prov-tracer"] / walltimes["noprov"]).dropna()
+    rows = {}
+    for workload, workload_ratios in ratios.groupby(level="workload", observed=True):
+        low, high = (
+            confidence_interval(workload_ratios.to_numpy(), confidence_level, seed)
+            if len(workload_ratios) > 1 else
+            (float("nan"), float("nan"))
+        )
+        rows[workload] = {"overhead": workload_ratios.mean(), "low": low, "high": high}
+    return pandas.DataFrame.from_dict(rows, orient="index")
+
+
+def current_commit() -> str:
+    return subprocess.run(
+        ["git", "rev-parse", "HEAD"], check=True, capture_output=True, text=True,
+    ).stdout.strip()
+
+
+def main(
+        baseline_path: Annotated[pathlib.Path, typer.Option("--baseline")] = pathlib.Path("overhead_baseline.json"),
+        update_baseline: Annotated[bool, typer.Option("--update-baseline", help="Store this run as the new baseline instead of comparing against it")] = False,
+        iterations: int = 5,
+        seed: int = 0,
+        confidence_level: float = 0.95,
+) -> None:
+    """Check the slim build of the tracer's overhead on GATE_WORKLOADS against a baseline.
+
+    Exits with 1 if, for any workload, the whole confidence interval of this
+    run's overhead lies above the baseline's confidence interval.
+
+    """
+    by_name = {workload.name: workload for workload in WORKLOADS}
+    if missing := [name for name in GATE_WORKLOADS if name not in by_name]:
+        raise ValueError(f"Gate workloads no longer defined: {', '.join(missing)}")
+    workloads = [by_name[name] for name in GATE_WORKLOADS]
+    # Gate the build that is deployed, not the release build the other experiments use
+    if not prov_tracer_slim_lib.exists():
+        raise FileNotFoundError(f"{prov_tracer_slim_lib} not built; run `cargo build --profile slim` in prov-tracer")
+    df = get_results(
+        [NoProv(), ProvTracer(prov_tracer_slim_lib)],
+        workloads,
+        iterations=iterations,
+        seed=seed,
+        ignore_failures=False,
+        # Cached cells would be from whichever commit first ran them
+        rerun=True,
+        parallelism=1,
+        cache_dir=GATE_CACHE_DIR,
+    )
+    current = overhead_cis(df, confidence_level, seed)
+
+    if update_baseline:
+        baseline_path.write_text(json.dumps({
+            "commit": current_commit(),
+            "iterations": iterations,
+            "confidence_level": confidence_level,
+            "workloads": current.to_dict(orient="index"),
+        }, indent=2) + "\n")
+        print(current.to_string())
+        print(f"Wrote baseline to {baseline_path}")
+        return
+
+    if not baseline_path.exists():
+        print(current.to_string())
+        print(f"No baseline at {baseline_path}; create one with --update-baseline")
+        raise typer.Exit(2)
+    baseline_data = json.loads(baseline_path.read_text())
+    baseline = pandas.DataFrame.from_dict(baseline_data["workloads"], orient="index")
+    comparison = current.join(baseline, rsuffix="_baseline", how="left").assign(
+        regressed=lambda df: df["low"] > df["high_baseline"],
+    )
+    with pandas.option_context("display.width", None):
+        print(f"Overhead of prov-tracer relative to noprov; baseline from {baseline_data['commit']}")
+        print(comparison.to_string(float_format="{:.3f}".format))
+    if missing := sorted(set(current.index) - set(baseline.index)):
+        print(f"Not in the baseline: {', '.join(missing)}")
+    if comparison["regressed"].any():
+        print(f"Regressed: {', '.join(comparison.index[comparison['regressed']])}")
+        raise typer.Exit(1)
+
+
+if __name__ == "__main__":
+    typer.run(main)
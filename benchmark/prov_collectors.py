@@ -1,18 +1,23 @@
+import codecs
 import dataclasses
 import warnings
 import subprocess
 import os
-import yaml
+import sqlite3
 import re
-from collections.abc import Sequence, Mapping
+from collections.abc import Iterator, Sequence, Mapping
 from pathlib import Path
-from util import run_all, terminate_or_kill, CmdArg, check_returncode, flatten1
+from util import run_all, terminate_or_kill, CmdArg, check_returncode
 from typing import Callable, cast, Any
 from compound_pattern import CompoundPattern
 
 
 result_bin = (Path(__file__).parent / "result/bin").resolve()
 result_lib = result_bin.parent / "lib"
+prov_tracer_lib = (Path(__file__).parent / "../prov-tracer/target/release/libprov_tracer.so").resolve()
+# The production build (`cargo build --profile slim`; see prov-tracer/Cargo.toml)
+prov_tracer_slim_lib = prov_tracer_lib.parent.parent / "slim/libprov_tracer.so"
+prov_tools_bin = (Path(__file__).parent / "../prov-tracer/prov_tools/target/release").resolve()
 
 
 # TODO: change ProvOperation.targets from str to Path
@@ -45,6 +50,15 @@ class ProvCollector:
     def count(self, log: Path, exe: Path) -> tuple[ProvOperation, ...]:
         return ()
 
+    def counters(self, log: Path) -> Mapping[str, float]:
+        """Workload-characterization counters gathered during the run, if any.
+
+        This is called before the log size is measured, so implementations
+        should remove any files they read.
+
+        """
+        return {}
+
     @property
     def name(self) -> str:
         return self.__class__.__name__.lower()
@@ -61,6 +75,37 @@ class ProvCollector:
 class NoProv(ProvCollector):
     name = "noprov"
 
+
+class IOCounters(ProvCollector):
+    """The workload's operational intensity, from io_counters.c.
+
+    These runs are separate from noprov's, so that the baseline every
+    overhead is measured against runs the workload bare. io_counters does
+    perturb the run (a fork and exec, and an inherited syscall tracepoint);
+    its rel_slowdown against noprov, and its row in the synthetic cost model,
+    measure by how much.
+
+    """
+
+    name = "io-counters"
+    counters_file = "io_counters.txt"
+
+    def run(self, cmd: Sequence[CmdArg], log: Path, size: int) -> Sequence[CmdArg]:
+        return (result_bin / "io_counters", log / self.counters_file, *cmd)
+
+    def counters(self, log: Path) -> Mapping[str, float]:
+        counters_file = log / self.counters_file
+        counters = {
+            key.strip(): float(value)
+            for line in counters_file.read_text().strip().split("\n")
+            for key, value in [line.split(":", 1)]
+        }
+        counters_file.unlink()
+        if counters.get("syscalls", -1) < 0:
+            warnings.warn("raw_syscalls:sys_enter was not accessible; is kernel.perf_event_paranoid too high?")
+            counters["syscalls"] = float("nan")
+        return counters
+
 libcalls = "-*+" + "+".join([
     # https://www.gnu.org/software/libc/manual/html_node/Opening-Streams.html
     "fopen", "fopen64", "freopen", "freopen64",
@@ -465,6 +510,106 @@ class FSATrace(AbstractTracer):
         return operations
 
 
+class ProvTracer(ProvCollector):
+    method = "lib instrm."
+    submethod = "libc I/O"
+    name = "prov-tracer"
+
+    # Text form of a record, as printed by prov-cat; see VerboseProvLogger in prov-tracer/src/lib.rs
+    # 12345 open mode: Read file: (-100 "path") fd: 3
+    # 12345 op code: Hardlink file0: (-100 "a") file1: (-100 "b") err: Errno { code: 2, ... }
+    # With PROV_TRACER_STACKS, records end with " stack: N" (see prov-tracer/src/stacks.rs); stack and module records are skipped.
+    line_pattern = re.compile(
+        r'^\d+ (?:open mode: (?P<mode>\w+)|op code: (?P<op>\w+))'
+        r' file0?: \((?P<dirfd0>-?\d+) (?P<target0>".*?(?<!\\)")\)'
+        r'(?: file1: \((?P<dirfd1>-?\d+) (?P<target1>".*?(?<!\\)")\))?'
+        r'(?: fd: (?P<fd>-?\d+))?(?: err: (?P<err>.+?))?(?: stack: \d+)?$'
+    )
+    # 12345 mark label: "train", from prov_tracer_mark() in the application
+    mark_pattern = re.compile(r'^\d+ mark label: (?P<label>".*?(?<!\\)")(?: stack: \d+)?$')
+    # Failed lookups of one name along a search path (see prov-tracer/src/search_coalescer.rs):
+    # 12345 dirs id: 0 list: ("/usr/local/include" "/usr/include")
+    # 12345 search op: open(Read) name: "stdio.h" dirfd: -100 dirs: 0 err: Errno { ... }
+    dirs_pattern = re.compile(r'^\d+ dirs id: (?P<id>\d+) list: \((?P<dirs>.*)\)$')
+    search_pattern = re.compile(
+        r'^\d+ search op: (?:open\((?P<mode>\w+)\)|(?P<op>\w+)) name: (?P<name>".*?(?<!\\)")'
+        r' dirfd: (?P<dirfd>-?\d+) dirs: (?P<id>\d+) err: (?P<err>.*?)(?: stack: \d+)?$'
+    )
+    quoted_pattern = re.compile(r'".*?(?<!\\)"')
+    # A file created and deleted by one thread, or written under a temporary name and renamed into place,
+    # whose records were folded into one (see prov-tracer/src/ephemeral_files.rs):
+    # 12345 ephemeral file: (-100 "tmp0") created: 12300 records: 9
+    # 12345 wrote file: (-100 "foo") created: 12300 records: 3
+    folded_pattern = re.compile(
+        r'^\d+ (?P<kind>ephemeral|wrote) file: \((?P<dirfd0>-?\d+) (?P<target0>".*?(?<!\\)")\) created: \d+ records: (?P<records>\d+)$'
+    )
+
+    def __init__(self, lib: Path = prov_tracer_lib) -> None:
+        self.lib = lib
+
+    def run(self, cmd: Sequence[CmdArg], log: Path, size: int) -> Sequence[CmdArg]:
+        return (
+            result_bin / "env",
+            f"LD_PRELOAD={self.lib}",
+            f"PROV_TRACER_FILE={log}/%p.%t.prov_trace",
+            *cmd,
+        )
+
+    def count(self, log: Path, exe: Path) -> tuple[ProvOperation, ...]:
+        traces = sorted(log.glob("*.prov_trace"))
+        if not traces:
+            return ()
+        proc = subprocess.run(
+            [prov_tools_bin / "prov-cat", *traces],
+            check=True,
+            capture_output=True,
+        )
+        operations = []
+        # Ids are per trace file, and prov-cat prints each file in turn, so the latest definition is the one in force.
+        dir_lists: dict[str, list[str]] = {}
+        for line in proc.stdout.decode(errors="surrogateescape").split("\n"):
+            # close and dup name no files
+            if (match := self.line_pattern.match(line)):
+                operations.append(ProvOperation(
+                    "open " + match.group("mode") if match.group("mode") else match.group("op"),
+                    self._unquote(match.group("target0")),
+                    self._unquote(match.group("target1")) if match.group("target1") else None,
+                    {
+                        key: val
+                        for key, val in match.groupdict().items()
+                        if key in {"dirfd0", "dirfd1", "fd", "err"} and val is not None
+                    },
+                ))
+            elif (match := self.mark_pattern.match(line)):
+                operations.append(ProvOperation("mark", None, None, {"label": self._unquote(match.group("label"))}))
+            elif (match := self.folded_pattern.match(line)):
+                operations.append(ProvOperation(
+                    match.group("kind"),
+                    self._unquote(match.group("target0")),
+                    None,
+                    {"dirfd0": match.group("dirfd0"), "records": match.group("records")},
+                ))
+            elif (match := self.dirs_pattern.match(line)):
+                dir_lists[match.group("id")] = [self._unquote(quoted) for quoted in self.quoted_pattern.findall(match.group("dirs"))]
+            elif (match := self.search_pattern.match(line)):
+                # One operation per failed probe, as if they had not been coalesced
+                # (a flight recorder's dump may start after the definition of its list).
+                name = self._unquote(match.group("name"))
+                for directory in dir_lists.get(match.group("id"), []):
+                    operations.append(ProvOperation(
+                        "open " + match.group("mode") if match.group("mode") else match.group("op"),
+                        f"{directory.removesuffix('/')}/{name}" if directory else name,
+                        None,
+                        {"dirfd0": match.group("dirfd"), "err": match.group("err")},
+                    ))
+        return tuple(operations)
+
+    @staticmethod
+    def _unquote(quoted: str) -> str:
+        # Rust's Debug for CStr uses the same escapes as a Python bytes literal (\xNN, \n, \", ...), but leaves valid UTF-8 as is.
+        return cast(bytes, codecs.escape_decode(quoted[1:-1].encode())[0]).decode(errors="surrogateescape")
+
+
 class CDE(ProvCollector):
     method = "ptrace"
     submethod = "syscalls"
@@ -507,18 +652,64 @@ class ReproZip(ProvCollector):
         assert not (log / "reprozip").exists()
         return (result_bin / "reprozip", "trace", "--dir", log / "reprozip", *cmd)
 
+    # Bits of opened_files.mode; see reprozip/native/database.h
+    file_modes = (
+        (0x01, "read"),
+        (0x02, "write"),
+        (0x04, "chdir"),
+        (0x08, "stat"),
+        (0x10, "readlink"),
+    )
+    batch_size = 4096
+
     def count(self, log: Path, exe: Path) -> tuple[ProvOperation, ...]:
-        config = yaml.safe_load((log / "reprozip/config.yml").read_text())
-        def n2l(lst):
-            return [] if lst is None else lst
-        files = n2l(config.get("other_files")) + list(flatten1(
-            n2l(package.get("files"))
-            for package in n2l(config.get("packages"))
-        ))
-        return tuple(
-            ProvOperation("read", file, None, None)
-            for file in files
-        )
+        return tuple(self.operations(log / "reprozip/trace.sqlite3"))
+
+    def operations(self, database: Path) -> Iterator[ProvOperation]:
+        """Stream the processes, executions, and file accesses from ReproZip's trace database.
+
+        config.yml is derived from this (it is just the file list, grouped
+        into packages), but it is YAML, which is slow to load when it is big.
+
+        """
+        # The tracer is done with the database, so open it immutable and skip locking.
+        conn = sqlite3.connect(f"file:{database}?immutable=1", uri=True)
+        try:
+            for id, parent, is_thread, exitcode in self._rows(
+                    conn, "SELECT id, parent, is_thread, exitcode FROM processes ORDER BY id",
+            ):
+                # Process ids go in args, so they are not counted as files
+                yield ProvOperation(
+                    "clone" if is_thread else "fork",
+                    None,
+                    None,
+                    {"process": id, "parent": parent, "exitcode": exitcode},
+                )
+            for name, process, argv, workingdir in self._rows(
+                    conn, "SELECT name, process, argv, workingdir FROM executed_files ORDER BY id",
+            ):
+                yield ProvOperation(
+                    "execute",
+                    name,
+                    None,
+                    {"process": process, "argv": argv.split("\0")[:-1], "workingdir": workingdir},
+                )
+            for name, mode, is_directory, process in self._rows(
+                    conn, "SELECT name, mode, is_directory, process FROM opened_files ORDER BY id",
+            ):
+                yield ProvOperation(
+                    "+".join(op for bit, op in self.file_modes if mode & bit) or "open",
+                    name,
+                    None,
+                    {"process": process, "is_directory": bool(is_directory)},
+                )
+        finally:
+            conn.close()
+
+    def _rows(self, conn: sqlite3.Connection, query: str) -> Iterator[tuple[Any, ...]]:
+        cursor = conn.execute(query)
+        while batch := cursor.fetchmany(self.batch_size):
+            yield from batch
 
 
 class SciUnit(ProvCollector):
@@ -681,12 +872,14 @@ class Auditd(ProvCollector):
 
 PROV_COLLECTORS: list[ProvCollector] = [
     NoProv(),
+    IOCounters(),
     STrace(),
     LTrace(),
     FSATrace(),
     CDE(),
     RR(),
     ReproZip(),
+    ProvTracer(),
     SciUnit(),
     SpadeFuse(),
     SpadeAuditd(),
@@ -703,28 +896,28 @@ PROV_COLLECTOR_GROUPS: Mapping[str, list[ProvCollector]] = {
     "superfast": [
         prov_collector
         for prov_collector in PROV_COLLECTORS
-        if prov_collector.name in ["noprov", "fsatrace"]
+        if prov_collector.name in ["noprov", "io-counters", "fsatrace"]
     ],
     "fast": [
         prov_collector
         for prov_collector in PROV_COLLECTORS
-        if prov_collector.name in ["noprov", "strace", "fsatrace", "reprozip"]
+        if prov_collector.name in ["noprov", "io-counters", "strace", "fsatrace", "reprozip"]
     ],
     "finished": [
         prov_collector
         for prov_collector in PROV_COLLECTORS
-        if prov_collector.name in ["noprov", "strace", "fsatrace", "rr", "reprozip"]
+        if prov_collector.name in ["noprov", "io-counters", "strace", "fsatrace", "rr", "reprozip"]
         # ltrace
     ],
     "working-ltrace": [
         prov_collector
         for prov_collector in PROV_COLLECTORS
-        if prov_collector.name in ["noprov", "strace", "fsatrace", "rr", "reprozip", "ltrace"]
+        if prov_collector.name in ["noprov", "io-counters", "strace", "fsatrace", "rr", "reprozip", "ltrace"]
     ],
     "working": [
         prov_collector
         for prov_collector in PROV_COLLECTORS
-        if prov_collector.name in ["noprov", "strace", "fsatrace", "rr", "reprozip", "sciunit"]
+        if prov_collector.name in ["noprov", "io-counters", "strace", "fsatrace", "rr", "reprozip", "sciunit"]
         # ltrace
         # cde
     ],
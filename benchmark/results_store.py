@@ -0,0 +1,274 @@
+import os
+import re
+import json
+import fcntl
+import contextlib
+import pathlib
+import urllib.parse
+import itertools
+import collections
+import pandas  # type: ignore
+import pyarrow  # type: ignore
+import pyarrow.dataset  # type: ignore
+import pyarrow.parquet  # type: ignore
+from collections.abc import Sequence, Mapping, Iterator
+from prov_collectors import ProvOperation
+from util import n_unique
+
+
+cell_schema = pyarrow.schema([
+    ("cell_id", pyarrow.string()),
+    ("collector", pyarrow.string()),
+    ("collector_method", pyarrow.string()),
+    ("collector_submethod", pyarrow.string()),
+    ("workload", pyarrow.string()),
+    ("workload_kind", pyarrow.string()),
+    ("iteration", pyarrow.int64()),
+    ("cputime", pyarrow.float64()),
+    ("walltime", pyarrow.float64()),
+    ("memory", pyarrow.int64()),
+    ("storage", pyarrow.int64()),
+    ("n_ops", pyarrow.int64()),
+    ("n_unique_files", pyarrow.int64()),
+    ("op_type_counts", pyarrow.map_(pyarrow.string(), pyarrow.int64())),
+    ("counters", pyarrow.map_(pyarrow.string(), pyarrow.float64())),
+    ("operations_id", pyarrow.string()),
+])
+
+
+operation_schema = pyarrow.schema([
+    ("operations_id", pyarrow.string()),
+    ("type", pyarrow.string()),
+    ("target0", pyarrow.string()),
+    ("target1", pyarrow.string()),
+    ("args", pyarrow.string()),
+])
+
+
+def cell_id(collector: str, workload: str, iteration: int) -> str:
+    return "_".join([
+        urllib.parse.quote(collector, safe=''),
+        urllib.parse.quote(workload, safe=''),
+        str(iteration),
+    ])
+
+
+class ResultsStore:
+    """Append-only columnar store of experiment results.
+
+    Each finished cell (collector, workload, iteration) is appended as its own
+    Parquet fragment, so parallel workers never write to the same file and a
+    crash loses at most the cell in flight. compact() then merges the
+    fragments into a compacted segment (compacted.<n>.parquet) per directory,
+    written in large row groups, so a store does not grow into one tiny file
+    per cell. Segments are tiered: a compaction folds in only the newest
+    segments no bigger than what it adds, so its cost follows the new
+    fragments rather than the whole history, and there are O(log cells)
+    segments. A cell's rows come from its fragment if it has one (e.g.
+    because it was rerun), else from the newest segment that has it.
+
+    Operations are stored out of line, keyed by operations_id, so that
+    aggregating over cells never has to touch them.
+
+    """
+
+    # compacted.parquet is a store's single segment from before segments were numbered.
+    segment_pattern = re.compile(r"compacted(?:\.(\d+))?\.parquet")
+    row_group_size = 65536
+
+    def __init__(self, root: pathlib.Path) -> None:
+        self.root = root
+        self.cells_dir = root / "cells"
+        self.operations_dir = root / "operations"
+        self._segment_cell_ids: dict[int, frozenset[str]] = {}
+
+    def has(self, cell_id: str) -> bool:
+        return (self.cells_dir / f"{cell_id}.parquet").exists() or any(
+            cell_id in self._segment_ids(number)
+            for number, _ in self._segments(self.cells_dir)
+        )
+
+    def _segment_ids(self, number: int) -> frozenset[str]:
+        """The cells in segment number, which are also the operations_ids in the operations segment of that number."""
+        if number not in self._segment_cell_ids:
+            path = dict(self._segments(self.cells_dir))[number]
+            self._segment_cell_ids[number] = frozenset(
+                pyarrow.parquet.read_table(path, columns=["cell_id"]).column("cell_id").to_pylist()
+            )
+        return self._segment_cell_ids[number]
+
+    @staticmethod
+    def _segments(directory: pathlib.Path) -> list[tuple[int, pathlib.Path]]:
+        """The compacted segments in directory, oldest first."""
+        return sorted(
+            (int(match.group(1) or 0), path)
+            for path in directory.glob("compacted*.parquet")
+            if (match := ResultsStore.segment_pattern.fullmatch(path.name))
+        )
+
+    @staticmethod
+    def _fragment_ids(directory: pathlib.Path) -> list[str]:
+        return [
+            path.name.removesuffix(".parquet")
+            for path in directory.glob("*.parquet")
+            if not ResultsStore.segment_pattern.fullmatch(path.name)
+        ]
+
+    @contextlib.contextmanager
+    def _lock(self, operation: int) -> Iterator[None]:
+        """Appends share the lock; compact() holds it exclusively, so it never deletes a fragment being written."""
+        self.root.mkdir(exist_ok=True, parents=True)
+        with (self.root / "lock").open("a") as lock_file:
+            fcntl.flock(lock_file, operation)
+            yield
+
+    def append(
+            self,
+            cell_id: str,
+            collector: str,
+            collector_method: str,
+            collector_submethod: str,
+            workload: str,
+            workload_kind: str,
+            iteration: int,
+            cputime: float,
+            walltime: float,
+            memory: int,
+            provenance_size: int,
+            operations: Sequence[ProvOperation],
+            counters: Mapping[str, float],
+    ) -> None:
+        with self._lock(fcntl.LOCK_SH):
+            # Operations go first, so that a cell is never visible without its operations.
+            self._write(self.operations_dir / f"{cell_id}.parquet", pyarrow.Table.from_pydict(
+                {
+                    "operations_id": [cell_id] * len(operations),
+                    "type": [op.type for op in operations],
+                    "target0": [op.target0 for op in operations],
+                    "target1": [op.target1 for op in operations],
+                    "args": [
+                        json.dumps(op.args, default=str) if op.args is not None else None
+                        for op in operations
+                    ],
+                },
+                schema=operation_schema,
+            ))
+            self._write(self.cells_dir / f"{cell_id}.parquet", pyarrow.Table.from_pylist(
+                [{
+                    "cell_id": cell_id,
+                    "collector": collector,
+                    "collector_method": collector_method,
+                    "collector_submethod": collector_submethod,
+                    "workload": workload,
+                    "workload_kind": workload_kind,
+                    "iteration": iteration,
+                    "cputime": cputime,
+                    "walltime": walltime,
+                    "memory": memory,
+                    "storage": provenance_size,
+                    "n_ops": len(operations),
+                    "n_unique_files": n_unique(itertools.chain(
+                        (op.target0 for op in operations),
+                        (op.target1 for op in operations),
+                    )),
+                    "op_type_counts": list(collections.Counter(op.type for op in operations).items()),
+                    "counters": list(counters.items()),
+                    "operations_id": cell_id,
+                }],
+                schema=cell_schema,
+            ))
+
+    @staticmethod
+    def _write(path: pathlib.Path, table: pyarrow.Table) -> None:
+        path.parent.mkdir(exist_ok=True, parents=True)
+        tmp_path = path.with_name(f".{path.name}.{os.getpid()}.tmp")
+        pyarrow.parquet.write_table(table, tmp_path)
+        # Rename is atomic, so readers never see a partially-written fragment.
+        os.replace(tmp_path, path)
+
+    def compact(self) -> None:
+        """Merge the fragments of cells and operations, and the newest segments no bigger than them, into a new segment.
+
+        Operations are compacted first, and the merged segments and fragments
+        deleted last, so a crash part way through leaves a state readers
+        already resolve: fragments supersede segments, newer segments older
+        ones, and an operations segment without its cells segment is ignored
+        (and overwritten by the next compaction).
+
+        """
+        with self._lock(fcntl.LOCK_EX):
+            fragment_ids = self._fragment_ids(self.cells_dir)
+            if not fragment_ids:
+                return
+            segments = self._segments(self.cells_dir)
+            merged: list[int] = []
+            n_cells = len(fragment_ids)
+            while segments and (size := pyarrow.parquet.ParquetFile(segments[-1][1]).metadata.num_rows) <= n_cells:
+                merged.insert(0, segments.pop()[0])
+                n_cells += size
+            number = max([number for number, _ in self._segments(self.cells_dir)], default=0) + 1
+            for directory, schema, key in [
+                    (self.operations_dir, operation_schema, "operations_id"),
+                    (self.cells_dir, cell_schema, "cell_id"),
+            ]:
+                segment = directory / f"compacted.{number}.parquet"
+                tmp_path = segment.with_name(f".{segment.name}.{os.getpid()}.tmp")
+                with pyarrow.parquet.ParquetWriter(tmp_path, schema) as writer:
+                    for table in _rebatch(self._batches(directory, key, None, merged), schema, self.row_group_size):
+                        writer.write_table(table, row_group_size=self.row_group_size)
+                os.replace(tmp_path, segment)
+            for directory in [self.operations_dir, self.cells_dir]:
+                for old_number, path in self._segments(directory):
+                    if old_number in merged:
+                        path.unlink()
+            for directory in [self.cells_dir, self.operations_dir]:
+                for fragment_id in fragment_ids:
+                    (directory / f"{fragment_id}.parquet").unlink(missing_ok=True)
+            self._segment_cell_ids.clear()
+
+    def _batches(self, directory: pathlib.Path, key: str, ids: Sequence[str] | None, segment_numbers: Sequence[int] | None = None) -> Iterator[pyarrow.RecordBatch]:
+        """Rows of the fragments, and rows of segments (those in segment_numbers, or all) which neither a fragment nor a newer segment supersedes, whose key is in ids (or all of them)."""
+        if ids is not None and not ids:
+            return
+        wanted = pyarrow.dataset.field(key).isin(list(ids)) if ids is not None else None
+        superseded = set(self._fragment_ids(directory))
+        if superseded:
+            yield from pyarrow.dataset.dataset(
+                [str(directory / f"{fragment_id}.parquet") for fragment_id in superseded],
+                format="parquet",
+            ).to_batches(filter=wanted)
+        cell_segments = {number for number, _ in self._segments(self.cells_dir)}
+        for number, path in reversed(self._segments(directory)):
+            if number not in cell_segments:
+                continue
+            if segment_numbers is None or number in segment_numbers:
+                current = wanted
+                if superseded:
+                    not_superseded = ~pyarrow.dataset.field(key).isin(list(superseded))
+                    current = not_superseded if wanted is None else wanted & not_superseded
+                yield from pyarrow.dataset.dataset(str(path), format="parquet").to_batches(filter=current)
+            superseded |= self._segment_ids(number)
+
+    def cells(self, cell_ids: Sequence[str]) -> pandas.DataFrame:
+        if not self.cells_dir.exists():
+            return cell_schema.empty_table().to_pandas()
+        return pyarrow.Table.from_batches(list(self._batches(self.cells_dir, "cell_id", cell_ids)), schema=cell_schema).to_pandas()
+
+    def operations(self, operations_ids: Sequence[str]) -> pandas.DataFrame:
+        if not self.operations_dir.exists():
+            return operation_schema.empty_table().to_pandas()
+        return pyarrow.Table.from_batches(list(self._batches(self.operations_dir, "operations_id", operations_ids)), schema=operation_schema).to_pandas()
+
+
+def _rebatch(batches: Iterator[pyarrow.RecordBatch], schema: pyarrow.Schema, size: int) -> Iterator[pyarrow.Table]:
+    """Regroups batches (a fragment's are as small as one cell) into tables of about size rows, one row group each."""
+    pending: list[pyarrow.RecordBatch] = []
+    n_pending = 0
+    for batch in batches:
+        pending.append(batch)
+        n_pending += batch.num_rows
+        if n_pending >= size:
+            yield pyarrow.Table.from_batches(pending, schema=schema)
+            pending, n_pending = [], 0
+    if pending:
+        yield pyarrow.Table.from_batches(pending, schema=schema)
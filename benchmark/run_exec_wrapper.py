@@ -1,6 +1,9 @@
 from __future__ import annotations
 import dataclasses
+import functools
 import os
+import shutil
+import statistics
 import contextlib
 import signal
 import warnings
@@ -52,9 +55,17 @@ class RunexecStats:
     success: bool
     stdout: bytes
     stderr: bytes
+    cores: tuple[int, ...] | None
+    cpu_freq_khz: float | None
 
     @staticmethod
-    def create(result: Mapping[str, Any], stdout: bytes, stderr: bytes) -> RunexecStats:
+    def create(
+            result: Mapping[str, Any],
+            stdout: bytes,
+            stderr: bytes,
+            cores: tuple[int, ...] | None,
+            cpu_freq_khz: float | None,
+    ) -> RunexecStats:
         keys = set(
             "walltime cputime memory blkio_read blkio_write cpuenergy".split(" ")
         )
@@ -64,6 +75,8 @@ class RunexecStats:
         attrs["success"] = attrs["exitcode"] == 0
         attrs["stdout"] = stdout
         attrs["stderr"] = stderr
+        attrs["cores"] = cores
+        attrs["cpu_freq_khz"] = cpu_freq_khz
         return RunexecStats(**attrs)
 
 
@@ -76,6 +89,100 @@ class DirMode:
     OVERLAY: DirMode = container.DIR_OVERLAY
 
 
+@dataclasses.dataclass(frozen=True)
+class CpuAssignment:
+    cores: tuple[int, ...]
+    memory_nodes: tuple[int, ...]
+
+
+sys_cpu = Path("/sys/devices/system/cpu")
+
+
+def cpu_assignment(slot: int, n_slots: int) -> CpuAssignment:
+    """Disjoint cores, and the memory nodes they are on, for slot out of n_slots parallel workers.
+
+    Hyperthreads of one physical core always go to the same slot. If there
+    are physical cores to spare, the first is left for the harness itself.
+
+    """
+    physical_cores: dict[tuple[str, str], list[int]] = {}
+    for cpu in sorted(os.sched_getaffinity(0)):
+        topology = sys_cpu / f"cpu{cpu}/topology"
+        key = (
+            (topology / "physical_package_id").read_text().strip(),
+            (topology / "core_id").read_text().strip(),
+        ) if topology.exists() else (str(cpu), "")
+        physical_cores.setdefault(key, []).append(cpu)
+    groups = list(physical_cores.values())
+    if len(groups) < n_slots:
+        raise ValueError(f"Cannot give {n_slots} workers disjoint cores; only {len(groups)} physical cores are available")
+    if len(groups) > n_slots:
+        groups = groups[1:]
+    # Contiguous chunks, so that a slot's cores tend to share a memory node
+    per_slot = len(groups) // n_slots
+    cores = tuple(sorted(
+        cpu
+        for group in groups[slot * per_slot : (slot + 1) * per_slot]
+        for cpu in group
+    ))
+    memory_nodes = tuple(sorted({
+        int(node.name.removeprefix("node"))
+        for cpu in cores
+        for node in (sys_cpu / f"cpu{cpu}").glob("node[0-9]*")
+    }))
+    return CpuAssignment(cores, memory_nodes)
+
+
+@functools.cache
+def cpuset_available() -> bool:
+    """Whether benchexec can pin runs to cores, i.e. the cpuset cgroup controller is delegated to this process."""
+    try:
+        for line in Path("/proc/self/cgroup").read_text().splitlines():
+            hierarchy, controllers, path = line.split(":", 2)
+            if hierarchy == "0" and not controllers:
+                # cgroup v2: available if our cgroup can enable it for the children benchexec makes
+                return "cpuset" in (Path("/sys/fs/cgroup") / path.lstrip("/") / "cgroup.controllers").read_text().split()
+            if "cpuset" in controllers.split(","):
+                return True
+    except (OSError, ValueError):
+        pass
+    return False
+
+
+def cpu_state(cores: Sequence[int] | None) -> tuple[float | None, str | None]:
+    """Mean scaling_cur_freq (kHz) over cores (or all CPUs), and the turbo/boost setting, if exposed."""
+    freq_files = (
+        [sys_cpu / f"cpu{cpu}/cpufreq/scaling_cur_freq" for cpu in cores]
+        if cores is not None else
+        list(sys_cpu.glob("cpu[0-9]*/cpufreq/scaling_cur_freq"))
+    )
+    freqs = [int(file.read_text()) for file in freq_files if file.exists()]
+    turbo = None
+    for turbo_file in [sys_cpu / "intel_pstate/no_turbo", sys_cpu / "cpufreq/boost"]:
+        if turbo_file.exists():
+            turbo = f"{turbo_file.name}={turbo_file.read_text().strip()}"
+    return (sum(freqs) / len(freqs) if freqs else None), turbo
+
+
+# The CPU state before the previous run in this process
+_last_cpu_state: tuple[float | None, str | None] | None = None
+freq_change_tolerance = 0.1
+
+
+def check_cpu_state(cores: Sequence[int] | None) -> float | None:
+    """Warn if frequency or turbo changed since the last run; returns the current frequency."""
+    global _last_cpu_state
+    freq, turbo = cpu_state(cores)
+    if _last_cpu_state is not None:
+        last_freq, last_turbo = _last_cpu_state
+        if turbo != last_turbo:
+            warnings.warn(f"Turbo state changed between runs: {last_turbo} -> {turbo}")
+        if freq is not None and last_freq is not None and abs(freq - last_freq) > freq_change_tolerance * last_freq:
+            warnings.warn(f"CPU frequency changed between runs: {last_freq / 1e3:.0f} MHz -> {freq / 1e3:.0f} MHz; is a scaling governor other than performance in use?")
+    _last_cpu_state = (freq, turbo)
+    return freq
+
+
 def run_exec(
     cmd: Sequence[CmdArg] = ("true",),
     cwd: Path = Path().resolve(),
@@ -84,7 +191,30 @@ def run_exec(
     time_limit: None | int = None,
     mem_limit: None | int = None,
     network_access: bool = False,
+    cpu: CpuAssignment | None = None,
+    use_namespaces: bool = False,
+    check_cpu: bool = True,
 ) -> RunexecStats:
+    """Run cmd under benchexec, measuring its resource usage.
+
+    With use_namespaces, cmd runs in a container: / is read-only except for
+    the FULL_ACCESS dir_modes, /home is hidden, /tmp is a private tmpfs, and
+    unless network_access, the network namespace is private, with only a
+    loopback interface. That is enough for workloads which talk to servers
+    they start themselves, and lets servers in parallel runs bind the same
+    port; network_access is for commands which need the host's network.
+    Container setup adds to walltime; see namespace_setup_walltime.
+
+    Unless check_cpu is False, the CPU state is compared with the previous
+    run's (see check_cpu_state); pass False for runs that are not
+    measurements, so they do not move the baseline.
+
+    """
+    if cpu is not None and not cpuset_available():
+        warnings.warn("Cannot pin runs to cores without the cpuset cgroup controller delegated to us; running unpinned")
+        cpu = None
+    cores = cpu.cores if cpu is not None else None
+    cpu_freq_khz = check_cpu_state(cores) if check_cpu else None
     with gen_temp_dir() as tmp_dir:
         stdout = tmp_dir / "stdout"
         stderr = tmp_dir / "stderr"
@@ -93,7 +223,8 @@ def run_exec(
                 "/": DirMode.READ_ONLY,
                 "/home": DirMode.HIDDEN,
                 "/run": DirMode.HIDDEN,
-                "/tmp": DirMode.FULL_ACCESS,
+                # Hidden dirs are replaced by an empty, writable tmpfs
+                "/tmp": DirMode.HIDDEN if use_namespaces else DirMode.FULL_ACCESS,
                 "/var": DirMode.HIDDEN,
             },
             **{
@@ -104,13 +235,12 @@ def run_exec(
         # https://github.com/sosy-lab/benchexec/blob/2c56e08d5f0f44b3073f9c82a6c5f166a12b45e7/benchexec/runexecutor.py#L304
         # https://github.com/sosy-lab/benchexec/blob/2c56e08d5f0f44b3073f9c82a6c5f166a12b45e7/benchexec/containerexecutor.py#L297
         run_executor = RunExecutor(
-            use_namespaces=False,
-            # use_namespaces=True,
-            # dir_modes=dir_modes_processed,
-            # container_system_config=True,
-            # container_tmpfs=True,
-            # network_access=network_access,
-        )
+            use_namespaces=True,
+            dir_modes=dir_modes_processed,
+            container_system_config=True,
+            container_tmpfs=True,
+            network_access=network_access,
+        ) if use_namespaces else RunExecutor(use_namespaces=False)
         caught_signal_number: Signal | None = None
         def run_executor_stop(signal_number: Signal, _: types.FrameType | None) -> None:
             warnings.warn(f"In signal catcher for {signal_number}")
@@ -146,6 +276,8 @@ def run_exec(
                 softtimelimit=time_limit,
                 hardtimelimit=hard_time_limit,
                 memlimit=mem_limit,
+                cores=list(cpu.cores) if cpu is not None else None,
+                memory_nodes=list(cpu.memory_nodes) if cpu is not None and cpu.memory_nodes else None,
             )
         if caught_signal_number is not None:
             raise InterruptedError(f"Caught signal {caught_signal_number}")
@@ -153,4 +285,32 @@ def run_exec(
             run_exec_run,
             stdout.read_bytes(),
             stderr.read_bytes(),
+            cores,
+            cpu_freq_khz,
         )
+
+
+_namespace_setup_walltime: float | None = None
+
+
+def namespace_setup_walltime(samples: int = 5) -> float:
+    """How much walltime running in a container (use_namespaces) adds to a run.
+
+    This is the difference in median walltime of `true` with and without
+    namespaces, measured once per process; subtract it from the walltime of
+    runs with use_namespaces to compare them with runs without.
+
+    """
+    global _namespace_setup_walltime
+    if _namespace_setup_walltime is None:
+        true = shutil.which("true")
+        assert true is not None
+        medians = [
+            statistics.median(
+                run_exec(cmd=(true,), use_namespaces=use_namespaces, check_cpu=False).walltime
+                for _ in range(samples)
+            )
+            for use_namespaces in [True, False]
+        ]
+        _namespace_setup_walltime = max(0.0, medians[0] - medians[1])
+    return _namespace_setup_walltime
@@ -6,6 +6,7 @@ from experiment import get_results
 from workloads import WORKLOAD_GROUPS
 from prov_collectors import PROV_COLLECTOR_GROUPS
 from stats import STATS
+from work_queue import WorkQueue
 from util import flatten1
 import enum
 
@@ -24,6 +25,10 @@ def main(
         rerun: Annotated[bool, typer.Option("--rerun")] = False,
         ignore_failures: Annotated[bool, typer.Option("--keep-going")] = False,
         parallelism: int = 1,
+        pin_cores: Annotated[bool, typer.Option(help="Give each parallel worker its own cores and memory nodes (needs the cpuset cgroup controller)")] = False,
+        use_namespaces: Annotated[bool, typer.Option("--namespaces", help="Run each cell in a container with a private /tmp and network namespace")] = False,
+        queue_path: Annotated[pathlib.Path | None, typer.Option("--queue", help="Distribute cells to worker.py processes through this queue instead of running them here")] = None,
+        machine_class: Annotated[str | None, typer.Option("--machine-class", help="Machine class which queued cells are pinned to (default: this machine's)")] = None,
 ) -> None:
     collectors = list(flatten1([
         PROV_COLLECTOR_GROUPS[collector_name.value]
@@ -53,6 +58,10 @@ def main(
         ignore_failures=ignore_failures,
         rerun=rerun,
         parallelism=parallelism,
+        pin_cores=pin_cores,
+        use_namespaces=use_namespaces,
+        queue=WorkQueue(queue_path) if queue_path is not None else None,
+        queue_machine_class=machine_class,
     )
     with pathlib.Path("runner.log").open("a+") as file:
         print("Done", datetime.datetime.now().isoformat(), file=file)
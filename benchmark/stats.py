@@ -9,7 +9,7 @@ import charmonium.time_block
 from typing import Mapping, Callable
 from util import flatten1
 from prov_collectors import PROV_COLLECTORS
-from workloads import WORKLOADS
+from workloads import WORKLOADS, SyntheticIO
 
 
 rel_qois = ["cputime", "walltime", "memory"]
@@ -20,6 +20,11 @@ output.mkdir(exist_ok=True)
 
 @charmonium.time_block.decor()
 def output_features(df: pandas.DataFrame) -> None:
+    intensity_columns = [
+        column
+        for column in ["syscalls_per_cpu_sec", "io_syscalls_per_cpu_sec", "io_bytes_per_cpu_sec"]
+        if column in df.columns
+    ]
     agged = (
         df
         .groupby(["collector", "workload"], observed=True, as_index=True)
@@ -41,6 +46,10 @@ def output_features(df: pandas.DataFrame) -> None:
                 "workload_kind",
                 "last",
             ),
+            **{
+                column + "_median": pandas.NamedAgg(column, "median")
+                for column in intensity_columns
+            },
         })
         .assign(**{
             "rel_slowdown": lambda df: df["walltime_mean"] / df.loc["noprov"]["walltime_mean"],
@@ -80,6 +89,10 @@ def output_features(df: pandas.DataFrame) -> None:
                 for group_name, syscall_names in syscall_groups.items()
             },
             "n_ops_per_sec": strace["n_ops_mean"] / noprov["walltime_mean"],
+            **{
+                column: noprov[column + "_median"]
+                for column in intensity_columns
+            },
         })
         features_df.to_pickle(output / "features_df.pkl")
 
@@ -140,8 +153,8 @@ def op_freqs(df: pandas.DataFrame) -> None:
         .groupby("collector", observed=True)
         .agg(**{
             "op_count_pairs": pandas.NamedAgg(
-                column="operations",
-                aggfunc=lambda opss: collections.Counter(op.type for ops in opss for op in ops).most_common(),
+                column="op_type_counts",
+                aggfunc=lambda op_type_countss: functools.reduce(operator.add, op_type_countss, collections.Counter()).most_common(),
             ),
         })
         .explode("op_count_pairs")
@@ -265,8 +278,24 @@ def minimize(df: pandas.DataFrame):
         df[(df["collector"] == "noprov") & (df["workload"] == workload)]["walltime"].mean()
         for workload in workloads
     ])
-    collectors = list(mean_df.index) + ["ops/sec"]
-    data = numpy.vstack([mean_df.to_numpy(), synthetic_features])
+    intensity_features = {
+        "syscalls/cpu-sec": "syscalls_per_cpu_sec",
+        "bytes/cpu-sec": "io_bytes_per_cpu_sec",
+    }
+    intensity_features = {
+        label: column
+        for label, column in intensity_features.items()
+        if column in df.columns and df[column].notna().all()
+    }
+    intensity_data = numpy.array([
+        [
+            df[df["workload"] == workload][column].iloc[0]
+            for workload in workloads
+        ]
+        for column in intensity_features.values()
+    ]).reshape(len(intensity_features), len(workloads))
+    collectors = list(mean_df.index) + ["ops/sec"] + list(intensity_features.keys())
+    data = numpy.vstack([mean_df.to_numpy(), synthetic_features, intensity_data])
     collectors_proj, singular_values, workloads_proj = scipy.linalg.svd(data)
     workload_to_kind = {
         workload.name: workload.kind
@@ -332,10 +361,19 @@ def mle_model(df: pandas.DataFrame) -> None:
         })
     )
     workload_syscalls = [
-        numpy.mean(df[(df["workload"] == workload) & (df["collector"] == "strace")]["n_ops"])
+        _workload_syscalls(df, workload)
         for workload in df.workload.cat.categories
     ]
 
+def _workload_syscalls(df: pandas.DataFrame, workload: str) -> float:
+    "Syscalls of the workload, from io-counters' counter if it was accessible, else from strace."
+    if "syscalls" in df.columns:
+        baseline_syscalls = df[(df["workload"] == workload) & (df["collector"] == "io-counters")]["syscalls"]
+        if len(baseline_syscalls) and baseline_syscalls.notna().all():
+            return float(numpy.mean(baseline_syscalls))
+    return float(numpy.mean(df[(df["workload"] == workload) & (df["collector"] == "strace")]["n_ops"]))
+
+
 @charmonium.time_block.decor()
 def bayesian(df: pandas.DataFrame) -> None:
     import pymc  # type: ignore
@@ -371,7 +409,7 @@ def bayesian(df: pandas.DataFrame) -> None:
         workload_syscalls = pymc.ConstantData(
             "workload_syscalls",
             [
-                numpy.mean(df[(df["workload"] == workload) & (df["collector"] == "strace")]["n_ops"])
+                _workload_syscalls(df, workload)
                 for workload in df.workload.cat.categories
             ],
             dims="workload",
@@ -543,6 +581,55 @@ def bayesian(df: pandas.DataFrame) -> None:
 
 
 
+@charmonium.time_block.decor()
+def synthetic_cost_model(df: pandas.DataFrame) -> None:
+    """Fit each collector's overhead on the synthetic workloads as a per-operation cost.
+
+    The synthetic workloads perform a known number of each operation, so
+    cputime(collector) - cputime(noprov) ~ fixed + sum(cost[op] * count[op]),
+    where fixed is the collector's startup and shutdown. CPU time, unlike
+    walltime, adds up over threads, and rate-limited workloads are left out,
+    since they mostly wait.
+
+    """
+    synthetic_workloads = {
+        workload.name: workload
+        for workload in WORKLOADS
+        if isinstance(workload, SyntheticIO) and workload.opens_per_sec == 0 and workload.name in df.workload.cat.categories
+    }
+    if not synthetic_workloads:
+        return
+    op_types = sorted(next(iter(synthetic_workloads.values())).op_counts().keys())
+    baseline = {
+        workload: numpy.median(df[(df["workload"] == workload) & (df["collector"] == "noprov")]["cputime"])
+        for workload in synthetic_workloads
+    }
+    with (output / "synthetic_cost_model.txt").open("w") as output_file:
+        print("Per-operation cost (microseconds); fixed cost (milliseconds)", file=output_file)
+        print(f"{'':15s}" + " ".join(f"{op_type:>9s}" for op_type in op_types) + f" {'fixed':>9s} {'residual':>9s}", file=output_file)
+        for collector in df.collector.cat.categories:
+            if collector == "noprov":
+                continue
+            rows = df[(df["collector"] == collector) & df["workload"].isin(synthetic_workloads.keys())]
+            counts = numpy.array([
+                [synthetic_workloads[workload].op_counts()[op_type] for op_type in op_types] + [1]
+                for workload in rows["workload"]
+            ]).reshape(len(rows), len(op_types) + 1)
+            if numpy.linalg.matrix_rank(counts) < len(op_types) + 1:
+                # Too few of the sweep's workloads ran to separate every cost
+                continue
+            overhead = numpy.array([
+                cputime - baseline[workload]
+                for workload, cputime in zip(rows["workload"], rows["cputime"])
+            ])
+            (*costs, fixed), residuals, *_ = numpy.linalg.lstsq(counts, overhead, rcond=None)
+            residual = numpy.sqrt(residuals[0] / len(rows)) if len(residuals) else numpy.nan
+            print(
+                f"{collector:15s}" + " ".join(f"{cost * 1e6:9.3f}" for cost in costs) + f" {fixed * 1e3:9.3f} {residual:9.3f}",
+                file=output_file,
+            )
+
+
 stats_list: list[Callable[[pandas.DataFrame], None]] = [
     performance,
     op_freqs,
@@ -550,6 +637,7 @@ stats_list: list[Callable[[pandas.DataFrame], None]] = [
     minimize,
     bayesian,
     output_features,
+    synthetic_cost_model,
 ]
 
 
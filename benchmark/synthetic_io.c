@@ -0,0 +1,269 @@
+/*
+ * Parametric I/O microbenchmark.
+ *
+ * The real-application workloads in workloads.py have a fixed operation mix.
+ * This program lets us dial in the mix instead, so that collector overhead can
+ * be fit as a per-operation cost.
+ *
+ * Compile me with
+ *
+ *     gcc -Wall -Wextra -O2 -pthread synthetic_io.c -o synthetic_io
+ *
+ * Usage:
+ *
+ *     synthetic_io -S [options] DIR   # create the file tree under DIR and exit
+ *     synthetic_io [options] DIR      # run the operation mix against DIR
+ *
+ * Options (the same options must be passed to setup and run):
+ *
+ *     -n OPENS    open/read/close cycles per thread (default 200000)
+ *     -r RATE     target opens per second per thread; 0 means unthrottled (default 0)
+ *     -s RATIO    stat calls per open (default 0)
+ *     -m FRAC     fraction of those stat calls which target a nonexistent path (default 0)
+ *     -d DEPTH    directory depth of the files (default 1)
+ *     -w WIDTH    number of files in the leaf directory (default 16)
+ *     -t THREADS  number of threads (default 1)
+ *     -f RATIO    forks per open; the child exits immediately (default 0)
+ *     -b BYTES    bytes per read (default 4096)
+ *     -l RATIO    directory listings per open (default 0)
+ *
+ * Ratios are accumulated, so -s 0.25 stats exactly once every four opens.
+ * The file chosen for each operation comes from a per-thread PRNG with a fixed
+ * seed, so two runs with the same options do exactly the same operations.
+ */
+
+#define _GNU_SOURCE
+#include <linux/limits.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define unlikely(x)    __builtin_expect(!!(x), 0)
+
+#define EXPECT_NONNULL(expr) ({\
+            void* ret = expr; \
+            if (unlikely(ret == NULL)) { \
+                fprintf(stderr, "failure on line %d: %s\nreturned NULL\nstrerror: %s\n", __LINE__, #expr, strerror(errno)); \
+                abort(); \
+            } \
+            ret; \
+    })
+
+#define EXPECT_POSITIVE(expr) ({\
+            long ret = expr; \
+            if (unlikely(ret < 0)) { \
+                fprintf(stderr, "failure on line %d: %s\nreturned a negative, %ld\nstrerror: %s\n", __LINE__, #expr, ret, strerror(errno)); \
+                abort(); \
+            } \
+            ret; \
+    })
+
+#define EXPECT_ZERO(expr) ({\
+            int ret = expr; \
+            if (unlikely(ret != 0)) { \
+                fprintf(stderr, "failure on line %d: %s\nreturned a non-zero, %d\nstrerror: %s\n", __LINE__, #expr, ret, strerror(errno)); \
+                abort(); \
+            } \
+            ret; \
+    })
+
+struct params {
+    bool setup;
+    long opens;
+    double rate;
+    double stats_per_open;
+    double stat_miss_fraction;
+    int depth;
+    int width;
+    int threads;
+    double forks_per_open;
+    size_t bytes_per_read;
+    double lists_per_open;
+    const char* root;
+};
+
+static struct params params = {
+    .setup = false,
+    .opens = 200000,
+    .rate = 0,
+    .stats_per_open = 0,
+    .stat_miss_fraction = 0,
+    .depth = 1,
+    .width = 16,
+    .threads = 1,
+    .forks_per_open = 0,
+    .bytes_per_read = 4096,
+    .lists_per_open = 0,
+    .root = NULL,
+};
+
+/* Directory which holds the files, i.e., root/d0/d1/.../d{depth-1}
+ * Half of PATH_MAX leaves plenty of room for the file names below it. */
+static char leaf_dir[PATH_MAX / 2];
+
+static void usage(const char* argv0) {
+    fprintf(stderr, "Usage: %s [-S] [-n opens] [-r rate] [-s ratio] [-m frac] [-d depth] [-w width] [-t threads] [-f ratio] [-b bytes] [-l ratio] DIR\n", argv0);
+    exit(2);
+}
+
+static void parse_args(int argc, char** argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "Sn:r:s:m:d:w:t:f:b:l:")) != -1) {
+        switch (opt) {
+        case 'S': params.setup = true; break;
+        case 'n': params.opens = atol(optarg); break;
+        case 'r': params.rate = atof(optarg); break;
+        case 's': params.stats_per_open = atof(optarg); break;
+        case 'm': params.stat_miss_fraction = atof(optarg); break;
+        case 'd': params.depth = atoi(optarg); break;
+        case 'w': params.width = atoi(optarg); break;
+        case 't': params.threads = atoi(optarg); break;
+        case 'f': params.forks_per_open = atof(optarg); break;
+        case 'b': params.bytes_per_read = (size_t) atol(optarg); break;
+        case 'l': params.lists_per_open = atof(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || params.depth < 0 || params.width < 1 || params.threads < 1 || params.bytes_per_read < 1) {
+        usage(argv[0]);
+    }
+    params.root = argv[optind];
+}
+
+static void file_path(char* buf, int idx) {
+    snprintf(buf, PATH_MAX, "%s/f%d", leaf_dir, idx);
+}
+
+static void missing_path(char* buf, int idx) {
+    snprintf(buf, PATH_MAX, "%s/missing%d", leaf_dir, idx);
+}
+
+static void setup(void) {
+    char* buf = EXPECT_NONNULL(malloc(params.bytes_per_read));
+    memset(buf, 'A', params.bytes_per_read);
+    for (int i = 0; i < params.width; ++i) {
+        char path[PATH_MAX];
+        file_path(path, i);
+        int fd = EXPECT_POSITIVE(open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644));
+        EXPECT_POSITIVE(write(fd, buf, params.bytes_per_read));
+        EXPECT_ZERO(close(fd));
+    }
+    free(buf);
+}
+
+/* xorshift64; good enough to scatter accesses over the files */
+static uint64_t next_random(uint64_t* state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+static void sleep_until(struct timespec* deadline) {
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, NULL) == EINTR) { }
+}
+
+static void* worker(void* arg) {
+    uint64_t prng = 0x9E3779B97F4A7C15ULL * ((uint64_t) (intptr_t) arg + 1);
+    char* buf = EXPECT_NONNULL(malloc(params.bytes_per_read));
+    char path[PATH_MAX];
+    double stat_acc = 0, miss_acc = 0, fork_acc = 0, list_acc = 0;
+    long period_ns = params.rate > 0 ? (long) (1e9 / params.rate) : 0;
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+    for (long op = 0; op < params.opens; ++op) {
+        file_path(path, (int) (next_random(&prng) % (uint64_t) params.width));
+        int fd = EXPECT_POSITIVE(open(path, O_RDONLY));
+        EXPECT_POSITIVE(read(fd, buf, params.bytes_per_read));
+        EXPECT_ZERO(close(fd));
+
+        for (stat_acc += params.stats_per_open; stat_acc >= 1; stat_acc -= 1) {
+            struct stat statbuf;
+            miss_acc += params.stat_miss_fraction;
+            if (miss_acc >= 1) {
+                miss_acc -= 1;
+                missing_path(path, (int) (next_random(&prng) % (uint64_t) params.width));
+                if (stat(path, &statbuf) == 0 || errno != ENOENT) {
+                    fprintf(stderr, "%s unexpectedly exists\n", path);
+                    abort();
+                }
+            } else {
+                file_path(path, (int) (next_random(&prng) % (uint64_t) params.width));
+                EXPECT_ZERO(stat(path, &statbuf));
+            }
+        }
+
+        for (list_acc += params.lists_per_open; list_acc >= 1; list_acc -= 1) {
+            DIR* dir = EXPECT_NONNULL(opendir(leaf_dir));
+            while (readdir(dir) != NULL) { }
+            EXPECT_ZERO(closedir(dir));
+        }
+
+        for (fork_acc += params.forks_per_open; fork_acc >= 1; fork_acc -= 1) {
+            pid_t pid = EXPECT_POSITIVE(fork());
+            if (pid == 0) {
+                _exit(0);
+            }
+            int wstatus;
+            EXPECT_POSITIVE(waitpid(pid, &wstatus, 0));
+        }
+
+        if (period_ns) {
+            deadline.tv_nsec += period_ns;
+            while (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_nsec -= 1000000000L;
+                deadline.tv_sec += 1;
+            }
+            sleep_until(&deadline);
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+int main(int argc, char** argv) {
+    parse_args(argc, argv);
+
+    /* Build (and in setup mode, create) root/d0/.../d{depth-1} */
+    snprintf(leaf_dir, sizeof(leaf_dir), "%s", params.root);
+    if (params.setup) {
+        mkdir(leaf_dir, 0755);
+    }
+    for (int level = 0; level < params.depth; ++level) {
+        size_t len = strlen(leaf_dir);
+        snprintf(leaf_dir + len, sizeof(leaf_dir) - len, "/d%d", level);
+        if (params.setup && mkdir(leaf_dir, 0755) != 0 && errno != EEXIST) {
+            fprintf(stderr, "mkdir %s: %s\n", leaf_dir, strerror(errno));
+            return 1;
+        }
+    }
+
+    if (params.setup) {
+        setup();
+        return 0;
+    }
+
+    pthread_t* threads = EXPECT_NONNULL(calloc((size_t) params.threads, sizeof(pthread_t)));
+    for (int i = 0; i < params.threads; ++i) {
+        EXPECT_ZERO(pthread_create(&threads[i], NULL, worker, (void*) (intptr_t) i));
+    }
+    for (int i = 0; i < params.threads; ++i) {
+        EXPECT_ZERO(pthread_join(threads[i], NULL));
+    }
+    free(threads);
+    return 0;
+}
@@ -0,0 +1,131 @@
+import os
+import json
+import time
+import socket
+import pathlib
+import contextlib
+import collections
+import charmonium.time_block as ch_time_block
+from collections.abc import Iterator, Mapping
+from typing import Any
+
+
+# Worker processes inherit this, so their spans land in the same run directory.
+_TIMELINE_DIR_VAR = "PROV_BENCH_TIMELINE_DIR"
+_context: dict[str, Any] = {}
+
+
+def start(timeline_dir: pathlib.Path) -> None:
+    timeline_dir.mkdir(exist_ok=True, parents=True)
+    os.environ[_TIMELINE_DIR_VAR] = str(timeline_dir.resolve())
+
+
+@contextlib.contextmanager
+def context(**kwargs: Any) -> Iterator[None]:
+    "Attach kwargs (e.g., worker or cell) to every span recorded within this block."
+    old_context = dict(_context)
+    _context.update(kwargs)
+    try:
+        yield
+    finally:
+        _context.clear()
+        _context.update(old_context)
+
+
+@contextlib.contextmanager
+def span(name: str, phase: str) -> Iterator[None]:
+    """Like ch_time_block.ctx, but also records a span for the timeline.
+
+    phase is a coarse category, like setup, run, parse, or cleanup, which the
+    summary groups by.
+
+    """
+    start_ns = time.time_ns()
+    try:
+        with ch_time_block.ctx(name):
+            yield
+    finally:
+        stop_ns = time.time_ns()
+        if timeline_dir_str := os.environ.get(_TIMELINE_DIR_VAR):
+            record = {
+                "name": name,
+                "phase": phase,
+                "start_ns": start_ns,
+                "stop_ns": stop_ns,
+                "host": socket.gethostname(),
+                "pid": os.getpid(),
+                **_context,
+            }
+            # One file per process, so there is no contention between workers.
+            # Lines this short are written atomically by O_APPEND anyway.
+            with (pathlib.Path(timeline_dir_str) / f"{os.getpid()}.jsonl").open("a") as spans_file:
+                spans_file.write(json.dumps(record, default=str) + "\n")
+
+
+def load_spans(timeline_dir: pathlib.Path) -> list[Mapping[str, Any]]:
+    return [
+        json.loads(line)
+        for spans_file in sorted(timeline_dir.glob("*.jsonl"))
+        for line in spans_file.read_text().split("\n")
+        if line.strip()
+    ]
+
+
+def export_chrome_trace(timeline_dir: pathlib.Path, output: pathlib.Path) -> None:
+    """Write the spans as a Chrome trace-event file.
+
+    Load it in chrome://tracing or https://ui.perfetto.dev. Each host is a
+    process and each worker is a thread within it, so parallel workers show up
+    as parallel tracks.
+
+    """
+    spans = load_spans(timeline_dir)
+    hosts = sorted({span["host"] for span in spans})
+    host_to_pid = {host: pid for pid, host in enumerate(hosts)}
+
+    def tid(span: Mapping[str, Any]) -> int:
+        # The coordinator (no worker) gets thread 0
+        return 0 if span.get("worker") is None else int(span["worker"]) + 1
+
+    events: list[Mapping[str, Any]] = []
+    for host, pid in host_to_pid.items():
+        events.append({"ph": "M", "name": "process_name", "pid": pid, "tid": 0, "args": {"name": host}})
+    for pid, thread in sorted({(host_to_pid[span["host"]], tid(span)) for span in spans}):
+        events.append({
+            "ph": "M", "name": "thread_name", "pid": pid, "tid": thread,
+            "args": {"name": "coordinator" if thread == 0 else f"worker {thread - 1}"},
+        })
+    t0 = min((span["start_ns"] for span in spans), default=0)
+    for span in spans:
+        events.append({
+            "ph": "X",
+            "name": span["name"],
+            "cat": span["phase"],
+            "ts": (span["start_ns"] - t0) / 1e3,
+            "dur": (span["stop_ns"] - span["start_ns"]) / 1e3,
+            "pid": host_to_pid[span["host"]],
+            "tid": tid(span),
+            "args": {
+                key: value
+                for key, value in span.items()
+                if key not in {"name", "phase", "start_ns", "stop_ns", "host"}
+            },
+        })
+    output.write_text(json.dumps({"traceEvents": events, "displayTimeUnit": "ms"}))
+
+
+def summarize(timeline_dir: pathlib.Path) -> str:
+    "Total seconds in each phase, per collector."
+    spans = load_spans(timeline_dir)
+    totals: Mapping[str, collections.Counter[str]] = collections.defaultdict(collections.Counter)
+    for span in spans:
+        totals[span.get("collector", "(harness)")][span["phase"]] += (span["stop_ns"] - span["start_ns"]) / 1e9
+    phases = sorted({span["phase"] for span in spans})
+    lines = [f"{'collector':15s} " + " ".join(f"{phase:>10s}" for phase in phases) + f" {'total':>10s}"]
+    for collector, phase_totals in sorted(totals.items()):
+        lines.append(
+            f"{collector:15s} "
+            + " ".join(f"{phase_totals[phase]:10.1f}" for phase in phases)
+            + f" {sum(phase_totals.values()):10.1f}"
+        )
+    return "\n".join(lines)
@@ -0,0 +1,198 @@
+import os
+import time
+import pickle
+import socket
+import sqlite3
+import pathlib
+import platform
+import contextlib
+import dataclasses
+from collections.abc import Iterator, Sequence
+
+
+def machine_class() -> str:
+    """Identify machines which should produce comparable timings.
+
+    Cells are pinned to a machine class, so a cell queued for one class is only
+    ever run on machines of that class.
+
+    """
+    cpu_model = "unknown"
+    with contextlib.suppress(OSError):
+        for line in pathlib.Path("/proc/cpuinfo").read_text().split("\n"):
+            if line.startswith("model name"):
+                cpu_model = line.partition(":")[2].strip()
+                break
+    mem_gib = 0
+    with contextlib.suppress(OSError):
+        for line in pathlib.Path("/proc/meminfo").read_text().split("\n"):
+            if line.startswith("MemTotal:"):
+                mem_gib = round(int(line.split()[1]) / 1024**2)
+                break
+    return f"{platform.machine()} {cpu_model} x{os.cpu_count()} {mem_gib}GiB"
+
+
+def worker_name() -> str:
+    return f"{socket.gethostname()}:{os.getpid()}"
+
+
+@dataclasses.dataclass(frozen=True)
+class QueuedCell:
+    cell_id: str
+    iteration: int
+    collector: str
+    workload: str
+    machine_class: str
+
+
+class WorkQueue:
+    """Persistent queue of experiment cells in an SQLite file.
+
+    The file can live on shared storage (e.g., NFS with working locks), so the
+    coordinator and workers on other machines see the same queue. A cell is
+    pending, claimed by a worker (which must heartbeat), done (with a pickled
+    ExperimentStats), or failed. Claimed cells whose worker stops heartbeating
+    go back to pending.
+
+    """
+
+    def __init__(self, path: pathlib.Path) -> None:
+        self.path = path
+        path.parent.mkdir(exist_ok=True, parents=True)
+        with self._transaction() as conn:
+            conn.execute("""
+                CREATE TABLE IF NOT EXISTS cells (
+                    cell_id TEXT PRIMARY KEY,
+                    iteration INTEGER NOT NULL,
+                    collector TEXT NOT NULL,
+                    workload TEXT NOT NULL,
+                    machine_class TEXT NOT NULL,
+                    state TEXT NOT NULL,
+                    worker TEXT,
+                    heartbeat REAL,
+                    attempts INTEGER NOT NULL DEFAULT 0,
+                    result BLOB
+                )
+            """)
+            conn.execute("CREATE INDEX IF NOT EXISTS cells_state ON cells (state, machine_class)")
+
+    @contextlib.contextmanager
+    def _transaction(self) -> Iterator[sqlite3.Connection]:
+        # A fresh connection per transaction is cheap, and keeps this object picklable.
+        conn = sqlite3.connect(self.path, timeout=60, isolation_level=None)
+        try:
+            conn.execute("BEGIN IMMEDIATE")
+            try:
+                yield conn
+            except BaseException:
+                conn.execute("ROLLBACK")
+                raise
+            else:
+                conn.execute("COMMIT")
+        finally:
+            conn.close()
+
+    def enqueue(self, cells: Sequence[QueuedCell]) -> None:
+        """Queue cells, replacing any previous failed attempt at the same cell.
+
+        Cells already pending, claimed, or done are left alone, so a restarted
+        coordinator neither discards results it has not taken yet nor reruns
+        cells in flight.
+
+        """
+        with self._transaction() as conn:
+            conn.executemany(
+                """
+                INSERT INTO cells (cell_id, iteration, collector, workload, machine_class, state)
+                VALUES (?, ?, ?, ?, ?, 'pending')
+                ON CONFLICT (cell_id) DO UPDATE SET
+                    machine_class = excluded.machine_class, state = 'pending',
+                    worker = NULL, heartbeat = NULL, attempts = 0, result = NULL
+                WHERE state = 'failed'
+                """,
+                [
+                    (cell.cell_id, cell.iteration, cell.collector, cell.workload, cell.machine_class)
+                    for cell in cells
+                ],
+            )
+
+    def claim(self, worker: str, machine_class: str) -> QueuedCell | None:
+        with self._transaction() as conn:
+            row = conn.execute(
+                """
+                SELECT cell_id, iteration, collector, workload, machine_class FROM cells
+                WHERE state = 'pending' AND machine_class = ?
+                ORDER BY rowid LIMIT 1
+                """,
+                (machine_class,),
+            ).fetchone()
+            if row is None:
+                return None
+            conn.execute(
+                """
+                UPDATE cells SET state = 'claimed', worker = ?, heartbeat = ?, attempts = attempts + 1
+                WHERE cell_id = ?
+                """,
+                (worker, time.time(), row[0]),
+            )
+            return QueuedCell(*row)
+
+    def heartbeat(self, cell_id: str, worker: str) -> None:
+        with self._transaction() as conn:
+            conn.execute(
+                "UPDATE cells SET heartbeat = ? WHERE cell_id = ? AND worker = ? AND state = 'claimed'",
+                (time.time(), cell_id, worker),
+            )
+
+    def complete(self, cell_id: str, worker: str, result: object | None) -> None:
+        "Push a result (None means the cell failed) back to the coordinator."
+        with self._transaction() as conn:
+            conn.execute(
+                "UPDATE cells SET state = ?, result = ? WHERE cell_id = ? AND worker = ? AND state = 'claimed'",
+                (
+                    "done" if result is not None else "failed",
+                    pickle.dumps(result) if result is not None else None,
+                    cell_id,
+                    worker,
+                ),
+            )
+
+    def requeue_stale(self, timeout: float, max_attempts: int) -> int:
+        "Requeue cells whose worker has not heartbeat in timeout seconds; returns how many."
+        with self._transaction() as conn:
+            conn.execute(
+                """
+                UPDATE cells SET state = 'failed'
+                WHERE state = 'claimed' AND heartbeat < ? AND attempts >= ?
+                """,
+                (time.time() - timeout, max_attempts),
+            )
+            return conn.execute(
+                """
+                UPDATE cells SET state = 'pending', worker = NULL, heartbeat = NULL
+                WHERE state = 'claimed' AND heartbeat < ?
+                """,
+                (time.time() - timeout,),
+            ).rowcount
+
+    def take_finished(self, cell_ids: Sequence[str]) -> list[tuple[str, object | None]]:
+        """Return (cell_id, result) for finished cells, and remove them from the queue.
+
+        result is None for failed cells.
+
+        """
+        rows = []
+        with self._transaction() as conn:
+            # Chunked to stay under SQLite's limit on bound parameters
+            for start in range(0, len(cell_ids), 500):
+                chunk = list(cell_ids[start : start + 500])
+                placeholders = ",".join("?" * len(chunk))
+                rows.extend(conn.execute(
+                    f"SELECT cell_id, result FROM cells WHERE state IN ('done', 'failed') AND cell_id IN ({placeholders})",
+                    chunk,
+                ).fetchall())
+            conn.executemany("DELETE FROM cells WHERE cell_id = ?", [(row[0],) for row in rows])
+        return [
+            (cell_id, pickle.loads(result) if result is not None else None)
+            for cell_id, result in rows
+        ]
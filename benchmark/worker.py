@@ -0,0 +1,91 @@
+import typer
+import pathlib
+import datetime
+import threading
+import time
+import sqlite3
+import traceback
+from typing_extensions import Annotated
+import timeline
+from experiment import run_one_experiment, worker_slot
+from workloads import WORKLOADS
+from prov_collectors import PROV_COLLECTORS
+from work_queue import WorkQueue, machine_class, worker_name
+from util import delete_children
+
+
+def main(
+        queue_path: Annotated[pathlib.Path, typer.Option("--queue")] = pathlib.Path(".cache/queue.sqlite"),
+        this_machine_class: Annotated[str | None, typer.Option("--machine-class")] = None,
+        heartbeat_interval: float = 30,
+        poll_interval: float = 10,
+        exit_when_empty: Annotated[bool, typer.Option("--exit-when-empty")] = False,
+        cpu_slots: Annotated[int | None, typer.Option("--pin-cores", help="Number of workers started on this machine; each gets its own cores")] = None,
+        use_namespaces: Annotated[bool, typer.Option("--namespaces", help="Run each cell in a container with a private /tmp and network namespace")] = False,
+        size: int = 256,
+        ignore_failures: Annotated[bool, typer.Option("--ignore-failures/--no-ignore-failures", help="Report a failing workload quietly, rather than printing its command and output")] = True,
+) -> None:
+    """Pull cells from the queue, run them here, and push the results back.
+
+    Start one of these per parallel slot on each machine; runner.py --queue is
+    the coordinator.
+
+    """
+    queue = WorkQueue(queue_path)
+    this_machine_class = this_machine_class or machine_class()
+    worker = worker_name()
+    collectors = {collector.name: collector for collector in PROV_COLLECTORS}
+    workloads = {workload.name: workload for workload in WORKLOADS}
+    # Same layout as run_experiments uses on the coordinator, but local to this machine
+    big_temp_dir = pathlib.Path(".workdir")
+    temp_dir = big_temp_dir / "temp"
+    log_dir = big_temp_dir / "log"
+    artifacts_dir = big_temp_dir / "artifacts"
+    work_dir = big_temp_dir / "work"
+    for dir in [temp_dir, log_dir, work_dir]:
+        dir.mkdir(exist_ok=True, parents=True)
+    timeline.start(big_temp_dir / "timeline" / datetime.datetime.now().strftime("%Y-%m-%dT%H-%M-%S"))
+    # Other workers on this machine share big_temp_dir; run_one_experiment works in this slot's subdirectories.
+    slot = worker_slot(big_temp_dir, cpu_slots)
+    print(f"Worker {worker} (slot {slot}) for machine class {this_machine_class!r}")
+
+    while True:
+        cell = queue.claim(worker, this_machine_class)
+        if cell is None:
+            if exit_when_empty:
+                break
+            time.sleep(poll_interval)
+            continue
+
+        done = threading.Event()
+
+        def heartbeat() -> None:
+            while not done.wait(heartbeat_interval):
+                # A missed heartbeat is retried at the next interval; only a run of them gets the cell requeued.
+                try:
+                    queue.heartbeat(cell.cell_id, worker)
+                except sqlite3.Error:
+                    traceback.print_exc()
+
+        heartbeat_thread = threading.Thread(target=heartbeat, daemon=True)
+        heartbeat_thread.start()
+        try:
+            with timeline.context(cell=cell.cell_id, collector=cell.collector, workload=cell.workload, worker=slot):
+                with timeline.span(f"clean {temp_dir / str(slot)}", "cleanup"):
+                    delete_children(temp_dir / str(slot))
+                stats = run_one_experiment(
+                    cell.iteration, collectors[cell.collector], workloads[cell.workload],
+                    work_dir, log_dir, temp_dir, artifacts_dir, size, ignore_failures,
+                    cpu_slots=cpu_slots, use_namespaces=use_namespaces,
+                )
+        except Exception:
+            traceback.print_exc()
+            stats = None
+        finally:
+            done.set()
+            heartbeat_thread.join()
+        queue.complete(cell.cell_id, worker, stats)
+
+
+if __name__ == "__main__":
+    typer.run(main)
@@ -7,7 +7,7 @@ import re
 import urllib.parse
 from collections.abc import Sequence, Mapping
 from pathlib import Path
-from util import run_all, CmdArg, check_returncode, merge_env_vars, download, groupby_dict, cmd_arg
+from util import run_all, CmdArg, check_returncode, merge_env_vars, download, groupby_dict, cmd_arg, flatten1
 import yaml
 import tarfile
 import shlex
@@ -28,6 +28,7 @@ groupname = grp.getgrgid(pwd.getpwnam(username).pw_gid).gr_name
 class Workload:
     kind: str
     name: str
+    # Needs the host's network; servers the workload starts itself are reachable without it (see run_exec).
     network_access = False
 
     def setup(self, workdir: Path) -> None:
@@ -343,7 +344,6 @@ DocumentRoot $SRV_ROOT
 
 class HttpBench(Workload):
     kind = "http_server"
-    network_access = True
 
     def __init__(self, port: int, n_requests: int, request_size: int):
         self.port = port
@@ -570,7 +570,6 @@ username:$6$3FjBjHLcRPwcOK8h$DpG7OtbJXsQJ0g/TTAQjYiw47ZApeNdo6k9tRlcHQzfALKsoDxe
 class Proftpd(Workload):
     kind = "ftp_server"
     name = "proftpd with ftpbench"
-    network_access = True
 
     def __init__(self, ftp_port: int, n_requests: int) -> None:
         self.ftp_port = ftp_port
@@ -957,6 +956,117 @@ class Copy(Workload):
             {},
         )
 
+class SyntheticIO(Workload):
+    """Parametric I/O microbenchmark; see synthetic_io.c.
+
+    Unlike the other workloads, the operation mix is known exactly, so a sweep
+    over these parameters lets us fit collector overhead as a per-operation
+    cost (see stats.synthetic_cost_model).
+
+    """
+
+    kind = "synthetic"
+
+    def __init__(
+            self,
+            opens: int = 200_000,
+            opens_per_sec: float = 0,
+            stats_per_open: float = 0,
+            stat_miss_fraction: float = 0,
+            depth: int = 1,
+            width: int = 16,
+            threads: int = 1,
+            forks_per_open: float = 0,
+            bytes_per_read: int = 4096,
+            lists_per_open: float = 0,
+    ) -> None:
+        self.opens = opens
+        self.opens_per_sec = opens_per_sec
+        self.stats_per_open = stats_per_open
+        self.stat_miss_fraction = stat_miss_fraction
+        self.depth = depth
+        self.width = width
+        self.threads = threads
+        self.forks_per_open = forks_per_open
+        self.bytes_per_read = bytes_per_read
+        self.lists_per_open = lists_per_open
+        non_default = [
+            f"{flag}={value}"
+            for flag, value, default in self._flags()
+            if value != default
+        ]
+        self.name = "synthetic " + (" ".join(non_default) if non_default else "base")
+
+    def _flags(self) -> list[tuple[str, float, float]]:
+        return [
+            ("n", self.opens, 200_000),
+            ("r", self.opens_per_sec, 0),
+            ("s", self.stats_per_open, 0),
+            ("m", self.stat_miss_fraction, 0),
+            ("d", self.depth, 1),
+            ("w", self.width, 16),
+            ("t", self.threads, 1),
+            ("f", self.forks_per_open, 0),
+            ("b", self.bytes_per_read, 4096),
+            ("l", self.lists_per_open, 0),
+        ]
+
+    def _args(self) -> tuple[str, ...]:
+        return tuple(flatten1((f"-{flag}", str(value)) for flag, value, _ in self._flags()))
+
+    def _tree(self, workdir: Path) -> Path:
+        # Different depths, widths, and read sizes need different trees
+        return workdir / "synthetic" / f"d{self.depth}-w{self.width}-b{self.bytes_per_read}"
+
+    def setup(self, workdir: Path) -> None:
+        tree = self._tree(workdir)
+        if not tree.exists():
+            tree.mkdir(parents=True)
+            check_returncode(subprocess.run(
+                [result_bin / "synthetic_io", "-S", *self._args(), tree],
+                env={"PATH": str(result_bin)},
+                check=False,
+                capture_output=True,
+            ))
+
+    def run(self, workdir: Path) -> tuple[tuple[CmdArg, ...], Mapping[CmdArg, CmdArg]]:
+        return (
+            (result_bin / "synthetic_io", *self._args(), self._tree(workdir)),
+            {},
+        )
+
+    def op_counts(self) -> Mapping[str, float]:
+        """Number of each operation this workload performs, summed over threads.
+
+        Calls that always come in the same proportion are one operation, since
+        no sweep could tell their costs apart: "open" is an open, a read and a
+        close, and "list" is an opendir with its width + 3 readdirs and closedir.
+
+        """
+        opens = self.opens * self.threads
+        return {
+            "open": opens,
+            "stat": opens * self.stats_per_open,
+            "list": opens * self.lists_per_open,
+            "fork": opens * self.forks_per_open,
+        }
+
+    @staticmethod
+    def sweep() -> list["SyntheticIO"]:
+        "Vary one parameter at a time around the base configuration."
+        return [
+            SyntheticIO(),
+            *(SyntheticIO(stats_per_open=ratio) for ratio in [1, 4, 16]),
+            SyntheticIO(stats_per_open=4, stat_miss_fraction=0.75),
+            *(SyntheticIO(depth=depth) for depth in [4, 16]),
+            *(SyntheticIO(threads=threads) for threads in [2, 8]),
+            *(SyntheticIO(forks_per_open=ratio) for ratio in [0.001, 0.01]),
+            *(SyntheticIO(bytes_per_read=size) for size in [64, 1024 * 1024]),
+            *(SyntheticIO(lists_per_open=ratio) for ratio in [0.1, 1]),
+            SyntheticIO(opens=20_000, opens_per_sec=10_000),
+        ]
+
+
 noop_cmd = (result_bin / "true",)
 def create_file_cmd(size: int) -> tuple[CmdArg, ...]:
     return (
@@ -1112,6 +1222,7 @@ WORKLOADS: list[Workload] = [
     FtpClient("ftp-curl", (result_bin / "curl", "--silent", "--output", "$dst", "$url"), HTTP_PORT, 10),
     FtpClient("ftp-wget", (result_bin / "wget", "--quiet", "--output-document", "$dst", "$url"), HTTP_PORT, 10),
     Postmark(100_000),
+    *SyntheticIO.sweep(),
     Archive("", SMALLER_TARBALL_URL, 100),
     Archive("gzip", SMALLER_TARBALL_URL, 100),
     Archive("pigz", SMALLER_TARBALL_URL, 100),
@@ -1314,28 +1425,34 @@ WORKLOAD_GROUPS: Mapping[str, list[Workload]] = {
     },
 
     # Second order groups
+    # These leave out the synthetic sweep, which is its own group ("synthetic"),
+    # so that adding it did not change what existing runs and comparisons cover.
     # TODO: try spack boost, other spacks
     "file_servers": [
         workload
         for workload in WORKLOADS
         if workload.kind in {"ftp_server", "http_server"}
     ],
-    "all": WORKLOADS,
+    "all": [
+        workload
+        for workload in WORKLOADS
+        if workload.kind != "synthetic"
+    ],
     "working": [
         workload
         for workload in WORKLOADS
-        if workload.name not in {"titanic-to"}
+        if workload.name not in {"titanic-to"} and workload.kind != "synthetic"
 
     ],
     "working-ltrace": [
         workload
         for workload in WORKLOADS
-        if workload.name not in {"titanic-to", "select-tcp", "spack spack-repo.mpich", "spack glibc", "spack boost"} and workload.kind not in {"spack", "ftp_client", "splash-3"}
+        if workload.name not in {"titanic-to", "select-tcp", "spack spack-repo.mpich", "spack glibc", "spack boost"} and workload.kind not in {"spack", "ftp_client", "splash-3", "synthetic"}
     ],
     "fast": [
         workload
         for workload in WORKLOADS
-        if workload.name not in {"postmark", "titanic-to", "select-tcp", "spack spack-repo.mpich"} and workload.kind not in {"spack", "http_server", "splash-3"}
+        if workload.name not in {"postmark", "titanic-to", "select-tcp", "spack spack-repo.mpich"} and workload.kind not in {"spack", "http_server", "splash-3", "synthetic"}
     ],
     "superfast": [
         workload
@@ -0,0 +1,32 @@
+/*
+ * Calls an application can make into libprov_tracer (see src/api.rs).
+ *
+ * The symbols are weak, so a program need not link against the tracer: test
+ * a function's address before calling it, and the call is skipped when the
+ * tracer is not preloaded.
+ *
+ *     if (prov_tracer_mark) prov_tracer_mark("train");
+ */
+
+#ifndef PROV_TRACER_H
+#define PROV_TRACER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Records label in the calling thread's trace. */
+void prov_tracer_mark(const char* label) __attribute__((weak));
+
+/* Stop and restart tracing the calling thread's I/O; pauses nest. */
+void prov_tracer_pause(void) __attribute__((weak));
+void prov_tracer_resume(void) __attribute__((weak));
+
+/* Dumps the flight recorder (PROV_TRACER_MODE=flight); otherwise does nothing. */
+void prov_tracer_dump(void) __attribute__((weak));
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
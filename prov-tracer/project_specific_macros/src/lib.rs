@@ -78,20 +78,28 @@ pub fn populate_libc_calls_and_hook_fns(input: proc_macro::TokenStream) -> proc_
                         #(#arg_colon_types),*
                     ) -> #return_type => #traced_name {
                         #print_begin
-                        if #condition {
-                            CALL_LOGGER.with_borrow_mut(|_call_logger| {
+                        if globals::TRACING.load(std::sync::atomic::Ordering::Relaxed) && globals::PAUSED.get() == 0 && #condition {
+                            let mut hook_timer = counters::HookTimer::start();
+                            let call_return = CALL_LOGGER.with_borrow_mut(|_call_logger| {
                                 let call_logger = &mut _call_logger.inner;
                                 #print_call0
                                 call_logger.#pre_call(#(#args,)*);
                                 #print_call1
+                                hook_timer.pause();
                                 errno::set_errno(errno::Errno(0));
                                 let call_return = redhook::real!(#name)(#(#args,)*);
                                 let this_errno = errno::errno();
+                                hook_timer.resume();
                                 #print_call2
                                 call_logger.#post_call(#(#args,)* call_return, this_errno);
+                                if globals::DETACH_REQUESTED.load(std::sync::atomic::Ordering::Relaxed) {
+                                    call_logger.detach_if_requested();
+                                }
                                 #print_call3a
                                 call_return
-                            })
+                            });
+                            hook_timer.stop();
+                            call_return
                         } else {
                             let call_return = redhook::real!(#name)(#(#args,)*);
                             #print_call3b
@@ -124,11 +132,9 @@ pub fn populate_libc_calls_and_hook_fns(input: proc_macro::TokenStream) -> proc_
         });
     let cfunc_sigs_stmt = if INCLUDE_RTTI {
         quote!{
-            lazy_static::lazy_static! {
-                static ref CFUNC_SIGS: CFuncSigs = CFuncSigs::from([
-                    #(#cfunc_sigs),*
-                ]);
-            }
+            static CFUNC_SIGS: std::sync::LazyLock<CFuncSigs> = std::sync::LazyLock::new(|| CFuncSigs::from([
+                #(#cfunc_sigs),*
+            ]));
         }
     } else { quote!() };
 
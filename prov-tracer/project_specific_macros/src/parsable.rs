@@ -18,10 +18,14 @@ pub enum CPrimType {
     Ftw64FuncT(Ident),
     NftwFuncT(Ident),
     Nftw64FuncT(Ident),
+    Struct(Token![struct], Ident),
 }
 
 impl Parse for CPrimType {
     fn parse(input: ParseStream) -> Result<Self> {
+        if input.peek(Token![struct]) {
+            return Ok(CPrimType::Struct(input.parse()?, input.parse()?));
+        }
         let ident: syn::Ident = input.parse()?;
         match ident.to_string().as_str() {
             "int" => Ok(CPrimType::Int(ident)),
@@ -169,6 +173,8 @@ pub fn cprim_type_to_type(typ: &CPrimType) -> proc_macro2::TokenStream {
         CPrimType::Ftw64FuncT(_) => quote!(*const libc::c_void),
         CPrimType::NftwFuncT(_) => quote!(*const libc::c_void),
         CPrimType::Nftw64FuncT(_) => quote!(*const libc::c_void),
+        // Hooks only pass structs through, by pointer.
+        CPrimType::Struct(_, _) => quote!(libc::c_void),
     }
 }
 
@@ -202,6 +208,7 @@ pub fn cprim_type_to_obj(typ: &CPrimType) -> proc_macro2::TokenStream {
         CPrimType::Ftw64FuncT(_) => quote!(CPrimType::Ftw64FuncT),
         CPrimType::NftwFuncT(_) => quote!(CPrimType::NftwFuncT),
         CPrimType::Nftw64FuncT(_) => quote!(CPrimType::Nftw64FuncT),
+        CPrimType::Struct(_, _) => quote!(CPrimType::Struct),
     }
 }
 
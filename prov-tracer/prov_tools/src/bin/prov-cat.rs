@@ -0,0 +1,50 @@
+/*
+ * Decompress traces to their text form.
+ *
+ *     prov-cat [--dictionary PATH] TRACE...
+ *
+ * TRACE may be a per-thread trace or a compacted one (see prov-compact),
+ * whose records are printed as "timestamp pid tid record".
+ *
+ * --dictionary is only needed for traces written with a custom
+ * PROV_TRACER_ZSTD_DICT; the builtin dictionary is recognized automatically.
+ */
+
+use std::io::Write;
+
+fn main() -> std::io::Result<()> {
+    let (paths, options) = prov_tools::parse_args(std::env::args(), &["dictionary"]).unwrap_or_else(|err| {
+        eprintln!("{}\nUsage: prov-cat [--dictionary PATH] TRACE...", err);
+        std::process::exit(2);
+    });
+    let stdout = std::io::stdout();
+    let mut stdout = std::io::BufWriter::new(stdout.lock());
+    for path in paths {
+        let path = std::path::Path::new(&path);
+        if prov_tools::is_compacted(path)? {
+            let reader = prov_tools::CompactedReader::open(path, options.get("dictionary").map(String::as_str))?;
+            let mut line = Vec::new();
+            for start in (0..reader.index.len()).step_by(256) {
+                for block in reader.decoded_blocks(start..(start + 256).min(reader.index.len()))? {
+                    for record in block.split_inclusive(|byte| *byte == b'\n') {
+                        line.clear();
+                        trace_format::compacted::expand_paths(record, &reader.paths, &mut line)?;
+                        stdout.write_all(&line)?;
+                    }
+                }
+            }
+            continue;
+        }
+        let mut reader = prov_tools::TraceReader::open(path, options.get("dictionary").map(String::as_str))?;
+        loop {
+            let blocks = reader.next_decoded_blocks(256)?;
+            if blocks.is_empty() {
+                break;
+            }
+            for block in blocks {
+                stdout.write_all(&block)?;
+            }
+        }
+    }
+    stdout.flush()
+}
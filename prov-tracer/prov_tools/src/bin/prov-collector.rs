@@ -0,0 +1,275 @@
+/*
+ * Collect the records of every traced thread that connects to us
+ * (PROV_TRACER_MODE=collector) into one compacted trace.
+ *
+ *     prov-collector --socket PATH --output FILE [--ring-kb N] [--lag-ms N] [--level N] [--threads N] [-- COMMAND...]
+ *
+ * With a command, runs it with PROV_TRACER_MODE and PROV_TRACER_SOCKET set
+ * (LD_PRELOAD is up to the command), and finishes once it has exited and
+ * every connection has closed; the exit status is the command's. Without
+ * one, runs until SIGINT or SIGTERM.
+ *
+ * Every connection (one per traced thread) gets its own memfd ring of
+ * --ring-kb (default 1024; see trace_format::shm_ring). Rings are drained
+ * every POLL_INTERVAL, and records are written once they are --lag-ms
+ * (default 1000) old, so the output is in timestamp order unless a tracee
+ * takes longer than that to publish a record. Later records are still
+ * written, out of order, and counted.
+ *
+ * A tracee can only damage its own ring: a ring whose counters make no sense
+ * is retired, and lines without a timestamp are skipped.
+ */
+
+use std::io::{BufRead, Read};
+use std::os::fd::{AsRawFd, FromRawFd, OwnedFd};
+use trace_format::compacted;
+use trace_format::shm_ring::{ShmRing, RING_HEADER_SIZE};
+
+const USAGE: &str = "Usage: prov-collector --socket PATH --output FILE [--ring-kb N] [--lag-ms N] [--level N] [--threads N] [-- COMMAND...]";
+const POLL_INTERVAL: std::time::Duration = std::time::Duration::from_millis(10);
+/// How long a tracee may take to greet us after connecting
+const HANDSHAKE_TIMEOUT: std::time::Duration = std::time::Duration::from_secs(1);
+
+static STOP: std::sync::atomic::AtomicBool = std::sync::atomic::AtomicBool::new(false);
+
+extern "C" fn stop(_signal: libc::c_int) {
+    STOP.store(true, std::sync::atomic::Ordering::Relaxed);
+}
+
+fn timestamp_ns() -> u64 {
+    let mut ts = libc::timespec { tv_sec: 0, tv_nsec: 0 };
+    unsafe { libc::clock_gettime(libc::CLOCK_MONOTONIC, &mut ts) };
+    ts.tv_sec as u64 * 1_000_000_000 + ts.tv_nsec as u64
+}
+
+/// One traced thread's ring.
+struct Source {
+    stream: std::os::unix::net::UnixStream,
+    ring: ShmRing,
+    map_len: usize,
+    /// "pid tid", as the tracee told us
+    name: Vec<u8>,
+    consumed: u64,
+}
+
+impl Source {
+    /// Greets a new connection and hands it a ring.
+    fn accept(stream: std::os::unix::net::UnixStream, ring_size: usize) -> std::io::Result<Self> {
+        stream.set_read_timeout(Some(HANDSHAKE_TIMEOUT))?;
+        let mut greeting = Vec::new();
+        std::io::BufReader::new(&stream).take(64).read_until(b'\n', &mut greeting)?;
+        let name = std::str::from_utf8(greeting.strip_suffix(b"\n").unwrap_or(&[])).ok()
+            .and_then(|greeting| greeting.split_once(' '))
+            .and_then(|(pid, tid)| Some((pid.parse::<u32>().ok()?, tid.parse::<u64>().ok()?)))
+            .map(|(pid, tid)| format!("{} {}", pid, tid).into_bytes())
+            .ok_or_else(|| std::io::Error::new(std::io::ErrorKind::InvalidData, "bad greeting"))?;
+
+        let map_len = RING_HEADER_SIZE + ring_size;
+        let memfd = unsafe {
+            let fd = libc::memfd_create(c"prov-ring".as_ptr(), libc::MFD_CLOEXEC);
+            if fd < 0 {
+                return Err(std::io::Error::last_os_error());
+            }
+            OwnedFd::from_raw_fd(fd)
+        };
+        if unsafe { libc::ftruncate(memfd.as_raw_fd(), map_len as libc::off_t) } != 0 {
+            return Err(std::io::Error::last_os_error());
+        }
+        let base = unsafe {
+            libc::mmap(std::ptr::null_mut(), map_len, libc::PROT_READ | libc::PROT_WRITE, libc::MAP_SHARED, memfd.as_raw_fd(), 0)
+        };
+        if base == libc::MAP_FAILED {
+            return Err(std::io::Error::last_os_error());
+        }
+        let source = Self { ring: unsafe { ShmRing::from_raw(base as *mut u8, map_len) }, map_len, name, consumed: 0, stream };
+        send_fd(&source.stream, &memfd)?;
+        source.stream.set_nonblocking(true)?;
+        Ok(source)
+    }
+
+    /// Appends the newly published records to pending, as "timestamp pid tid record".
+    /// Returns the number of records, or an error if the ring is corrupt.
+    fn drain(&mut self, pending: &mut Pending, buffer: &mut Vec<u8>) -> Result<u64, String> {
+        let written = self.ring.written();
+        if written < self.consumed || written - self.consumed > self.ring.capacity() as u64 {
+            return Err(format!("ring counters out of range (read {}, written {})", self.consumed, written));
+        }
+        buffer.clear();
+        self.ring.get(self.consumed, written, buffer);
+        self.consumed = written;
+        self.ring.consume(written);
+        let mut records = 0;
+        for record in buffer.split(|byte| *byte == b'\n').filter(|record| !record.is_empty()) {
+            let Some(timestamp) = compacted::timestamp(record) else { continue };
+            let timestamp_len = record.iter().position(|byte| *byte == b' ').unwrap_or(record.len());
+            let mut line = Vec::with_capacity(record.len() + self.name.len() + 1);
+            line.extend_from_slice(&record[..timestamp_len]);
+            line.push(b' ');
+            line.extend_from_slice(&self.name);
+            line.extend_from_slice(&record[timestamp_len..]);
+            pending.push(timestamp, line);
+            records += 1;
+        }
+        Ok(records)
+    }
+
+    /// Whether the tracee has closed its end (exited, or every thread holding it has).
+    fn hung_up(&self) -> bool {
+        !matches!((&self.stream).read(&mut [0u8; 1]), Err(err) if err.kind() == std::io::ErrorKind::WouldBlock)
+    }
+}
+
+impl Drop for Source {
+    fn drop(&mut self) {
+        unsafe { libc::munmap(self.ring.base() as *mut libc::c_void, self.map_len) };
+    }
+}
+
+fn send_fd(stream: &std::os::unix::net::UnixStream, fd: &OwnedFd) -> std::io::Result<()> {
+    let mut byte = [0u8; 1];
+    let mut iov = libc::iovec { iov_base: byte.as_mut_ptr() as *mut libc::c_void, iov_len: 1 };
+    let mut control = [0u64; 8];
+    let mut message: libc::msghdr = unsafe { std::mem::zeroed() };
+    message.msg_iov = &mut iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.as_mut_ptr() as *mut libc::c_void;
+    unsafe {
+        message.msg_controllen = libc::CMSG_SPACE(std::mem::size_of::<libc::c_int>() as u32) as usize;
+        let cmsg = libc::CMSG_FIRSTHDR(&message);
+        (*cmsg).cmsg_level = libc::SOL_SOCKET;
+        (*cmsg).cmsg_type = libc::SCM_RIGHTS;
+        (*cmsg).cmsg_len = libc::CMSG_LEN(std::mem::size_of::<libc::c_int>() as u32) as usize;
+        std::ptr::write_unaligned(libc::CMSG_DATA(cmsg) as *mut libc::c_int, fd.as_raw_fd());
+        if libc::sendmsg(stream.as_raw_fd(), &message, libc::MSG_NOSIGNAL) != 1 {
+            return Err(std::io::Error::last_os_error());
+        }
+    }
+    Ok(())
+}
+
+/// Records not yet written, oldest first.
+struct Pending {
+    heap: std::collections::BinaryHeap<std::cmp::Reverse<(u64, u64, Vec<u8>)>>,
+    /// Breaks ties in arrival order
+    next_seq: u64,
+    last_written: u64,
+    late: u64,
+}
+
+impl Pending {
+    fn push(&mut self, timestamp: u64, line: Vec<u8>) {
+        self.heap.push(std::cmp::Reverse((timestamp, self.next_seq, line)));
+        self.next_seq += 1;
+    }
+
+    /// Writes every record up to watermark.
+    fn write_until(&mut self, watermark: u64, writer: &mut prov_tools::CompactedWriter) {
+        while self.heap.peek().is_some_and(|std::cmp::Reverse((timestamp, _, _))| *timestamp <= watermark) {
+            let std::cmp::Reverse((timestamp, _, line)) = self.heap.pop().unwrap();
+            if timestamp < self.last_written {
+                self.late += 1;
+            }
+            self.last_written = self.last_written.max(timestamp);
+            writer.push(timestamp, &line);
+        }
+    }
+}
+
+fn main() -> std::io::Result<()> {
+    let mut args: Vec<String> = std::env::args().collect();
+    let command = match args.iter().position(|arg| arg == "--") {
+        Some(separator) => args.split_off(separator).split_off(1),
+        None => Vec::new(),
+    };
+    let (positional, options) = prov_tools::parse_args(args.into_iter(), &["socket", "output", "ring-kb", "lag-ms", "level", "threads"]).unwrap_or_else(|err| {
+        eprintln!("{}\n{}", err, USAGE);
+        std::process::exit(2);
+    });
+    let parse_option = |name: &str, default: usize| -> usize {
+        options.get(name).map(|value| value.parse().unwrap_or_else(|_| {
+            eprintln!("--{} must be a number\n{}", name, USAGE);
+            std::process::exit(2);
+        })).unwrap_or(default)
+    };
+    let (Some(socket_path), Some(output), true) = (options.get("socket"), options.get("output"), positional.is_empty()) else {
+        eprintln!("{}", USAGE);
+        std::process::exit(2);
+    };
+    let ring_size = parse_option("ring-kb", 1024).max(4) * 1024;
+    let lag = parse_option("lag-ms", 1000) as u64 * 1_000_000;
+    let level = parse_option("level", 3) as i32;
+    let n_threads = parse_option("threads", prov_tools::n_threads()).max(1);
+
+    let _ = std::fs::remove_file(socket_path);
+    let listener = std::os::unix::net::UnixListener::bind(socket_path)?;
+    listener.set_nonblocking(true)?;
+    let mut child = if command.is_empty() {
+        for signal in [libc::SIGINT, libc::SIGTERM] {
+            unsafe { libc::signal(signal, stop as extern "C" fn(libc::c_int) as libc::sighandler_t) };
+        }
+        None
+    } else {
+        Some(std::process::Command::new(&command[0])
+            .args(&command[1..])
+            .env("PROV_TRACER_MODE", "collector")
+            .env("PROV_TRACER_SOCKET", std::path::absolute(socket_path)?)
+            .spawn()?)
+    };
+
+    let mut writer = prov_tools::CompactedWriter::create(std::path::Path::new(output), level, n_threads)?;
+    let mut pending = Pending { heap: Default::default(), next_seq: 0, last_written: 0, late: 0 };
+    let mut sources: Vec<Source> = Vec::new();
+    let mut buffer = Vec::new();
+    let (mut connections, mut corrupt) = (0u64, 0u64);
+    let mut exit_status = None;
+    loop {
+        loop {
+            match listener.accept() {
+                Ok((stream, _)) => match Source::accept(stream, ring_size) {
+                    Ok(source) => {
+                        sources.push(source);
+                        connections += 1;
+                    },
+                    Err(err) => eprintln!("prov-collector: dropped a connection: {}", err),
+                },
+                Err(err) if err.kind() == std::io::ErrorKind::WouldBlock => break,
+                Err(err) => return Err(err),
+            }
+        }
+        if let Some(child) = &mut child {
+            if exit_status.is_none() {
+                exit_status = child.try_wait()?;
+            }
+        }
+        let finishing = STOP.load(std::sync::atomic::Ordering::Relaxed) || exit_status.is_some();
+        sources.retain_mut(|source| {
+            // Check before draining, so nothing published before the hang-up is missed.
+            let hung_up = source.hung_up();
+            match source.drain(&mut pending, &mut buffer) {
+                Ok(_) => !hung_up,
+                Err(err) => {
+                    eprintln!("prov-collector: retiring ring of {}: {}", String::from_utf8_lossy(&source.name), err);
+                    corrupt += 1;
+                    false
+                },
+            }
+        });
+        // With a command, wait for its stragglers (e.g. daemonized children) to hang up too.
+        if finishing && (child.is_none() || sources.is_empty()) {
+            break;
+        }
+        pending.write_until(timestamp_ns().saturating_sub(lag), &mut writer);
+        std::thread::sleep(POLL_INTERVAL);
+    }
+    pending.write_until(u64::MAX, &mut writer);
+    let summary = writer.finish()?;
+    let _ = std::fs::remove_file(socket_path);
+    eprintln!(
+        "{} connections, {} late records, {} corrupt rings, {} -> {}",
+        connections, pending.late, corrupt, summary, output,
+    );
+    match exit_status {
+        Some(status) => std::process::exit(status.code().unwrap_or(1)),
+        None => Ok(()),
+    }
+}
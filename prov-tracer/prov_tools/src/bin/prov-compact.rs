@@ -0,0 +1,222 @@
+/*
+ * Merge the per-thread traces of a run into one compacted trace.
+ *
+ *     prov-compact --output FILE [--fan-in N] [--level N] [--threads N] [--dictionary PATH] TRACE_OR_DIR...
+ *
+ * Directories are searched recursively for *.prov_trace files, whose names
+ * must start with "pid.tid." (the default PROV_TRACER_FILE does).
+ *
+ * Records are k-way merged by timestamp, paths are interned into one table
+ * for the whole run, and the result is written as a compacted trace (see
+ * trace_format::compacted). Inputs are streamed a block at a time. When
+ * there are more than --fan-in inputs (default 256, to stay under the open
+ * file limit), groups of them are first merged into temporary runs, in
+ * parallel, and then the runs are merged.
+ *
+ * --dictionary is only needed for inputs written with a custom PROV_TRACER_ZSTD_DICT.
+ */
+
+use trace_format::compacted;
+
+const USAGE: &str = "Usage: prov-compact --output FILE [--fan-in N] [--level N] [--threads N] [--dictionary PATH] TRACE_OR_DIR...";
+
+struct Input {
+    path: std::path::PathBuf,
+    /// "pid tid", for per-thread traces; runs already have it in every line
+    source: Option<Vec<u8>>,
+}
+
+fn find_traces(path: &std::path::Path, traces: &mut Vec<std::path::PathBuf>) -> std::io::Result<()> {
+    if path.is_dir() {
+        for entry in std::fs::read_dir(path)? {
+            find_traces(&entry?.path(), traces)?;
+        }
+    } else if path.extension().is_some_and(|extension| extension == "prov_trace") {
+        traces.push(path.to_path_buf());
+    }
+    Ok(())
+}
+
+fn per_thread_input(path: std::path::PathBuf) -> std::io::Result<Input> {
+    let name = path.file_name().unwrap_or_default().to_string_lossy().into_owned();
+    let mut fields = name.split('.');
+    match (fields.next().and_then(|pid| pid.parse::<u32>().ok()), fields.next().and_then(|tid| tid.parse::<u64>().ok())) {
+        (Some(pid), Some(tid)) => Ok(Input { source: Some(format!("{} {}", pid, tid).into_bytes()), path }),
+        _ => Err(std::io::Error::new(std::io::ErrorKind::InvalidInput, format!("{}: cannot tell pid and tid from the file name", path.display()))),
+    }
+}
+
+struct Cursor {
+    reader: prov_tools::TraceReader<std::io::BufReader<std::fs::File>>,
+    decoder: trace_format::BlockDecoder,
+    source: Option<Vec<u8>>,
+    path: std::path::PathBuf,
+    block: Vec<u8>,
+    pos: usize,
+    /// The current record, as "timestamp pid tid record"
+    line: Vec<u8>,
+    timestamp: u64,
+}
+
+impl Cursor {
+    fn open(input: &Input, dictionary_path: Option<&str>) -> std::io::Result<Self> {
+        // Small buffers, since there are up to fan-in of these open at once
+        let file = std::io::BufReader::with_capacity(64 * 1024, std::fs::File::open(&input.path)?);
+        let reader = prov_tools::TraceReader::new(file, dictionary_path)?;
+        Ok(Self {
+            decoder: reader.decoder()?,
+            reader,
+            source: input.source.clone(),
+            path: input.path.clone(),
+            block: Vec::new(),
+            pos: 0,
+            line: Vec::new(),
+            timestamp: 0,
+        })
+    }
+
+    /// Moves to the next record; returns false at the end of the trace.
+    fn advance(&mut self) -> std::io::Result<bool> {
+        while self.pos >= self.block.len() {
+            match self.reader.next_block()? {
+                Some(block) => {
+                    self.block = self.decoder.decode(&block)?;
+                    self.pos = 0;
+                },
+                None => return Ok(false),
+            }
+        }
+        let rest = &self.block[self.pos..];
+        let len = rest.iter().position(|byte| *byte == b'\n').unwrap_or(rest.len());
+        let record = &rest[..len];
+        self.pos += len + 1;
+        self.timestamp = compacted::timestamp(record).ok_or_else(|| std::io::Error::new(
+            std::io::ErrorKind::InvalidData,
+            format!("{}: record without a timestamp (written by an older tracer?)", self.path.display()),
+        ))?;
+        self.line.clear();
+        match &self.source {
+            Some(source) => {
+                let timestamp_len = record.iter().position(|byte| *byte == b' ').unwrap_or(record.len());
+                self.line.extend_from_slice(&record[..timestamp_len]);
+                self.line.push(b' ');
+                self.line.extend_from_slice(source);
+                self.line.extend_from_slice(&record[timestamp_len..]);
+            },
+            None => self.line.extend_from_slice(record),
+        }
+        Ok(true)
+    }
+}
+
+/// Calls sink on every record of inputs, in timestamp order.
+fn merge(inputs: &[Input], dictionary_path: Option<&str>, mut sink: impl FnMut(u64, &[u8]) -> std::io::Result<()>) -> std::io::Result<()> {
+    let mut cursors = Vec::with_capacity(inputs.len());
+    let mut heap = std::collections::BinaryHeap::new();
+    for input in inputs {
+        let mut cursor = Cursor::open(input, dictionary_path)?;
+        if cursor.advance()? {
+            heap.push(std::cmp::Reverse((cursor.timestamp, cursors.len())));
+        }
+        cursors.push(cursor);
+    }
+    while let Some(std::cmp::Reverse((timestamp, i))) = heap.pop() {
+        let cursor = &mut cursors[i];
+        sink(timestamp, &cursor.line)?;
+        if cursor.advance()? {
+            heap.push(std::cmp::Reverse((cursor.timestamp, i)));
+        }
+    }
+    Ok(())
+}
+
+/// Merges inputs into one run, which is an ordinary trace file with "timestamp pid tid record" lines.
+fn merge_run(inputs: &[Input], output: &std::path::Path, dictionary_path: Option<&str>) -> std::io::Result<Input> {
+    let header = trace_format::Header { compression: trace_format::Compression::Zstd, dictionary_hash: 0 };
+    let mut file = std::fs::File::create(output)?;
+    trace_format::write_header(&mut file, &header)?;
+    let mut pipeline = prov_tools::BlockPipeline::new(file, trace_format::HEADER_SIZE as u64, header, None, 1, 1);
+    let mut blocker = prov_tools::Blocker::new();
+    merge(inputs, dictionary_path, |timestamp, line| {
+        blocker.block.extend_from_slice(line);
+        blocker.block.push(b'\n');
+        blocker.record(timestamp, &mut pipeline);
+        Ok(())
+    })?;
+    blocker.ship(&mut pipeline);
+    pipeline.finish()?;
+    Ok(Input { path: output.to_path_buf(), source: None })
+}
+
+fn main() -> std::io::Result<()> {
+    let (paths, options) = prov_tools::parse_args(std::env::args(), &["output", "fan-in", "level", "threads", "dictionary"]).unwrap_or_else(|err| {
+        eprintln!("{}\n{}", err, USAGE);
+        std::process::exit(2);
+    });
+    let parse_option = |name: &str, default: usize| -> usize {
+        options.get(name).map(|value| value.parse().unwrap_or_else(|_| {
+            eprintln!("--{} must be a number\n{}", name, USAGE);
+            std::process::exit(2);
+        })).unwrap_or(default)
+    };
+    let Some(output) = options.get("output").map(std::path::PathBuf::from) else {
+        eprintln!("--output is required\n{}", USAGE);
+        std::process::exit(2);
+    };
+    let fan_in = parse_option("fan-in", 256).max(2);
+    let level = parse_option("level", 3) as i32;
+    let n_threads = parse_option("threads", prov_tools::n_threads()).max(1);
+    let dictionary_path = options.get("dictionary").map(String::as_str);
+
+    let mut traces = Vec::new();
+    for path in &paths {
+        find_traces(std::path::Path::new(path), &mut traces)?;
+    }
+    traces.sort();
+    let n_traces = traces.len();
+    let mut inputs = traces.into_iter().map(per_thread_input).collect::<std::io::Result<Vec<_>>>()?;
+
+    // Merge groups of fan_in inputs into runs until one merge can take them all.
+    let runs_dir = output.with_extension(format!("runs.{}", std::process::id()));
+    let mut level_no = 0;
+    while inputs.len() > fan_in {
+        std::fs::create_dir_all(&runs_dir)?;
+        let groups = inputs.chunks(fan_in).collect::<Vec<_>>();
+        let next_group = std::sync::atomic::AtomicUsize::new(0);
+        let mut runs: Vec<Option<std::io::Result<Input>>> = groups.iter().map(|_| None).collect();
+        let runs_lock = std::sync::Mutex::new(&mut runs);
+        std::thread::scope(|scope| {
+            for _ in 0..n_threads.min(groups.len()) {
+                scope.spawn(|| loop {
+                    let i = next_group.fetch_add(1, std::sync::atomic::Ordering::Relaxed);
+                    if i >= groups.len() {
+                        break;
+                    }
+                    let run = merge_run(groups[i], &runs_dir.join(format!("{}.{}.prov_trace", level_no, i)), dictionary_path);
+                    runs_lock.lock().unwrap()[i] = Some(run);
+                });
+            }
+        });
+        let runs = runs.into_iter().map(Option::unwrap).collect::<std::io::Result<Vec<_>>>()?;
+        if level_no > 0 {
+            for input in &inputs {
+                std::fs::remove_file(&input.path)?;
+            }
+        }
+        inputs = runs;
+        level_no += 1;
+    }
+
+    let mut writer = prov_tools::CompactedWriter::create(&output, level, n_threads)?;
+    merge(&inputs, dictionary_path, |timestamp, line| {
+        writer.push(timestamp, line);
+        Ok(())
+    })?;
+    let summary = writer.finish()?;
+
+    if level_no > 0 {
+        std::fs::remove_dir_all(&runs_dir)?;
+    }
+    eprintln!("{} traces, {} -> {}", n_traces, summary, output.display());
+    Ok(())
+}
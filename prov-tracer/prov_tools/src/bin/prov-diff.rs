@@ -0,0 +1,603 @@
+/*
+ * Explain why two runs differ by comparing the files they read and wrote.
+ *
+ *     prov-diff [--dictionary PATH] [--hash-cache MODE] RUN_A RUN_B
+ *     prov-diff [--dictionary PATH] [--hash-cache MODE] --summarize OUTPUT RUN
+ *
+ * A RUN is a compacted trace, a per-thread trace, a directory of per-thread
+ * traces, or a summary written by --summarize. A summary is the sorted set of
+ * (path, access, content hash) of a run; the content hash (XXH3-128) is of
+ * the file as it is when the summary is made, so summarize a run right after
+ * it finishes, from the directory it ran in (relative paths are resolved
+ * against ours).
+ *
+ * Reports inputs (files read) that are new, removed, or whose content
+ * changed, and likewise for outputs (files written). Files the tracer folded
+ * into one record count as written ("wrote file", renamed into place) or not
+ * at all ("ephemeral file", deleted again before the run ended). Exits 1 if
+ * the runs differ, like diff(1).
+ *
+ * Hashes are cached in an extended attribute of each file (HASH_XATTR),
+ * tagged with its mtime, size, inode and ctime, so unchanged files (large
+ * reference data, say) are not read again by later runs. Setting the
+ * attribute changes the ctime itself, so the tag holds a bound on it,
+ * CTIME_SLACK_NS past the ctime the file had after a previous set (by the
+ * file system's clock, not ours); any later change moves the ctime beyond
+ * that. On fs-verity files, the kernel's digest tags the entry instead; it
+ * is cheap to get and cannot go stale. Files on network file systems are
+ * never cached, since other clients' changes need not move the ctime we
+ * see. --hash-cache is read (default) to use the cache but never write to
+ * files, update to use and refresh it, or off.
+ */
+
+use std::io::{BufRead, Read, Write};
+
+const USAGE: &str = "Usage: prov-diff [--dictionary PATH] [--hash-cache read|update|off] RUN_A RUN_B\n       prov-diff [--dictionary PATH] [--hash-cache read|update|off] --summarize OUTPUT RUN";
+const SUMMARY_MAGIC: &str = "prov-summary 1";
+
+const READ: u8 = 1;
+const WRITE: u8 = 2;
+const METADATA: u8 = 4;
+const NO_HASH: &[u8] = b"-";
+
+/// "1 MTIME_NS SIZE INODE MAX_CTIME_NS VERITY_DIGEST HASH", where the digest is hex or "-"
+const HASH_XATTR: &std::ffi::CStr = c"user.prov.xxh3";
+const CTIME_SLACK_NS: i128 = 10_000_000;
+/// statfs f_type of file systems whose ctimes another machine may set (NFS, SMB/CIFS, FUSE, Ceph, AFS, 9p, Lustre, GPFS)
+const NETWORK_FS_MAGICS: [i64; 11] = [
+    0x6969, 0x517b, 0xfe534d42, 0xff534d42, 0x65735546, 0x00c36400,
+    0x5346414f, 0x6b414653, 0x01021997, 0x0bd00bd0, 0x47504653,
+];
+/// _IOWR('f', 134, struct fsverity_digest)
+const FS_IOC_MEASURE_VERITY: libc::c_ulong = 0xc004_6686;
+const MAX_VERITY_DIGEST: usize = 64;
+
+#[derive(Clone, Copy, PartialEq)]
+enum HashCache {
+    Update,
+    Read,
+    Off,
+}
+
+#[derive(Debug, Clone, PartialEq, Eq)]
+struct Entry<'a> {
+    /// As it appears in the trace, quoted; borrowed from the file when read from a summary
+    path: std::borrow::Cow<'a, [u8]>,
+    access: u8,
+    /// Hex digest, or "-" for metadata-only accesses and for paths that are not regular files now.
+    /// Kept as text so summaries can be compared without parsing it.
+    hash: std::borrow::Cow<'a, [u8]>,
+}
+
+/// Finds "(dirfd PATH)" after key in record and returns PATH, resolving @id references.
+fn path_after<'a>(record: &'a [u8], key: &[u8], paths: &'a [Vec<u8>]) -> Option<&'a [u8]> {
+    let start = record.windows(key.len()).position(|window| window == key)? + key.len();
+    let rest = &record[start..];
+    let rest = &rest[rest.iter().position(|byte| *byte == b' ')? + 1..];
+    if let Some(id) = rest.strip_prefix(b"@") {
+        let digits = id.iter().take_while(|byte| byte.is_ascii_digit()).count();
+        return paths.get(std::str::from_utf8(&id[..digits]).ok()?.parse::<usize>().ok()?).map(Vec::as_slice);
+    }
+    // Paths never contain an unescaped quote, so the first `")` closes this one.
+    let end = rest.windows(2).position(|window| window == b"\")")?;
+    Some(&rest[..end + 1])
+}
+
+/// Adds the accesses of one record (a line of a per-thread or compacted trace) to accesses.
+fn add_record(record: &[u8], paths: &[Vec<u8>], accesses: &mut std::collections::HashMap<Vec<u8>, u8>) {
+    let contains = |needle: &[u8]| record.windows(needle.len()).any(|window| window == needle);
+    if contains(b" err: ") {
+        return;
+    }
+    let mut add = |path: Option<&[u8]>, access: u8| {
+        if let Some(path) = path {
+            match accesses.get_mut(path) {
+                Some(existing) => *existing |= access,
+                None => { accesses.insert(path.to_vec(), access); },
+            }
+        }
+    };
+    if contains(b"open mode: ") {
+        let access = if contains(b"mode: ReadWrite ") {
+            READ | WRITE
+        } else if contains(b"mode: Read ") {
+            READ
+        } else {
+            WRITE
+        };
+        add(path_after(record, b"file: (", paths), access);
+    } else if contains(b" wrote file: (") {
+        // Created, written and renamed into place by one thread (see ephemeral_files); an output
+        add(path_after(record, b"file: (", paths), WRITE);
+    } else if contains(b" ephemeral file: (") {
+        // Created and deleted again within the run, so neither an input nor an output
+    } else if contains(b" file0: (") {
+        add(path_after(record, b"file0: (", paths), METADATA);
+        add(path_after(record, b"file1: (", paths), WRITE);
+    } else if contains(b" file: (") {
+        add(path_after(record, b"file: (", paths), METADATA);
+    }
+}
+
+fn add_block(block: &[u8], paths: &[Vec<u8>], accesses: &mut std::collections::HashMap<Vec<u8>, u8>) {
+    for record in block.split(|byte| *byte == b'\n') {
+        add_record(record, paths, accesses);
+    }
+}
+
+fn find_traces(path: &std::path::Path, traces: &mut Vec<std::path::PathBuf>) -> std::io::Result<()> {
+    if path.is_dir() {
+        for entry in std::fs::read_dir(path)? {
+            find_traces(&entry?.path(), traces)?;
+        }
+    } else if path.extension().is_some_and(|extension| extension == "prov_trace") {
+        traces.push(path.to_path_buf());
+    }
+    Ok(())
+}
+
+fn read_accesses(run: &std::path::Path, dictionary_path: Option<&str>) -> std::io::Result<std::collections::HashMap<Vec<u8>, u8>> {
+    let mut accesses = std::collections::HashMap::new();
+    if run.is_file() && prov_tools::is_compacted(run)? {
+        let reader = prov_tools::CompactedReader::open(run, dictionary_path)?;
+        for start in (0..reader.index.len()).step_by(256) {
+            for block in reader.decoded_blocks(start..(start + 256).min(reader.index.len()))? {
+                add_block(&block, &reader.paths, &mut accesses);
+            }
+        }
+        return Ok(accesses);
+    }
+    let mut traces = Vec::new();
+    if run.is_file() {
+        traces.push(run.to_path_buf());
+    } else {
+        find_traces(run, &mut traces)?;
+    }
+    // One trace per thread at a time; each thread keeps its own map until the end.
+    let next_trace = std::sync::atomic::AtomicUsize::new(0);
+    let maps = std::thread::scope(|scope| {
+        let handles = (0..prov_tools::n_threads().min(traces.len().max(1))).map(|_| scope.spawn(|| {
+            let mut accesses = std::collections::HashMap::new();
+            loop {
+                let i = next_trace.fetch_add(1, std::sync::atomic::Ordering::Relaxed);
+                let Some(trace) = traces.get(i) else { return Ok(accesses) };
+                let mut reader = prov_tools::TraceReader::open(trace, dictionary_path)?;
+                let mut decoder = reader.decoder()?;
+                while let Some(block) = reader.next_block()? {
+                    add_block(&decoder.decode(&block)?, &[], &mut accesses);
+                }
+            }
+        })).collect::<Vec<_>>();
+        handles.into_iter().map(|handle| handle.join().unwrap()).collect::<std::io::Result<Vec<_>>>()
+    })?;
+    for map in maps {
+        for (path, access) in map {
+            *accesses.entry(path).or_insert(0) |= access;
+        }
+    }
+    Ok(accesses)
+}
+
+/// What a cached hash is valid for
+struct Tag {
+    mtime_ns: i128,
+    size: u64,
+    inode: u64,
+    ctime_ns: i128,
+}
+
+impl Tag {
+    fn of(stat: &std::fs::Metadata) -> Self {
+        use std::os::unix::fs::MetadataExt;
+        Self {
+            mtime_ns: stat.mtime() as i128 * 1_000_000_000 + stat.mtime_nsec() as i128,
+            size: stat.size(),
+            inode: stat.ino(),
+            ctime_ns: stat.ctime() as i128 * 1_000_000_000 + stat.ctime_nsec() as i128,
+        }
+    }
+
+    fn same_contents(&self, other: &Tag) -> bool {
+        (self.mtime_ns, self.size, self.inode) == (other.mtime_ns, other.size, other.inode)
+    }
+}
+
+/// The fs-verity digest of file, if it has one.
+fn measure_verity(file: &std::fs::File) -> Option<Vec<u8>> {
+    // struct fsverity_digest { __u16 digest_algorithm; __u16 digest_size; __u8 digest[]; }
+    let mut digest = [0u8; 4 + MAX_VERITY_DIGEST];
+    digest[2..4].copy_from_slice(&(MAX_VERITY_DIGEST as u16).to_ne_bytes());
+    if unsafe { libc::ioctl(std::os::fd::AsRawFd::as_raw_fd(file), FS_IOC_MEASURE_VERITY, digest.as_mut_ptr()) } != 0 {
+        return None;
+    }
+    let size = u16::from_ne_bytes([digest[2], digest[3]]) as usize;
+    // The algorithm is part of the digest's identity.
+    Some([&digest[..2], &digest[4..4 + size.min(MAX_VERITY_DIGEST)]].concat())
+}
+
+fn on_network_fs(file: &std::fs::File) -> bool {
+    let mut stat: libc::statfs = unsafe { std::mem::zeroed() };
+    if unsafe { libc::fstatfs(std::os::fd::AsRawFd::as_raw_fd(file), &mut stat) } != 0 {
+        return true;
+    }
+    NETWORK_FS_MAGICS.contains(&(stat.f_type as i64))
+}
+
+fn hex(bytes: &[u8]) -> String {
+    bytes.iter().map(|byte| format!("{:02x}", byte)).collect()
+}
+
+fn cached_hash(file: &std::fs::File, tag: &Tag, verity: Option<&[u8]>) -> Option<u128> {
+    let mut value = [0u8; 256];
+    let len = unsafe {
+        libc::fgetxattr(std::os::fd::AsRawFd::as_raw_fd(file), HASH_XATTR.as_ptr(), value.as_mut_ptr() as *mut libc::c_void, value.len())
+    };
+    let value = std::str::from_utf8(&value[..usize::try_from(len).ok()?]).ok()?;
+    let fields = value.split(' ').collect::<Vec<_>>();
+    let [version, mtime_ns, size, inode, ctime_ns, cached_verity, hash] = fields.as_slice() else { return None };
+    if *version != "1" {
+        return None;
+    }
+    let valid = match verity {
+        Some(verity) => *cached_verity == hex(verity),
+        None => {
+            let cached = Tag {
+                mtime_ns: mtime_ns.parse().ok()?,
+                size: size.parse().ok()?,
+                inode: inode.parse().ok()?,
+                ctime_ns: ctime_ns.parse().ok()?,
+            };
+            *cached_verity == "-" && cached.same_contents(tag) && tag.ctime_ns <= cached.ctime_ns
+        },
+    };
+    if valid { u128::from_str_radix(hash, 16).ok() } else { None }
+}
+
+fn cache_hash(file: &std::fs::File, tag: &Tag, verity: Option<&[u8]>, hash: u128) {
+    // The first set moves the ctime from wherever it was to now; the bound on
+    // the ctime of the next one comes from that. Try a few times, in case a
+    // set lands more than the slack after the one before.
+    let mut max_ctime_ns = tag.ctime_ns + CTIME_SLACK_NS;
+    for _ in 0..3 {
+        let value = format!(
+            "1 {} {} {} {} {} {:032x}",
+            tag.mtime_ns, tag.size, tag.inode, max_ctime_ns, verity.map(hex).unwrap_or("-".to_string()), hash,
+        );
+        let set = unsafe {
+            libc::fsetxattr(std::os::fd::AsRawFd::as_raw_fd(file), HASH_XATTR.as_ptr(), value.as_ptr() as *const libc::c_void, value.len(), 0)
+        };
+        if set != 0 || verity.is_some() {
+            return;
+        }
+        match file.metadata() {
+            Ok(stat) if Tag::of(&stat).same_contents(tag) && Tag::of(&stat).ctime_ns > max_ctime_ns => {
+                max_ctime_ns = Tag::of(&stat).ctime_ns + CTIME_SLACK_NS;
+            },
+            // Done, or written to meanwhile, in which case the entry does not match anyway.
+            _ => return,
+        }
+    }
+}
+
+fn hash_file(path: &[u8], buffer: &mut [u8], cache: HashCache) -> Option<u128> {
+    use std::os::unix::ffi::OsStrExt;
+    let path = std::path::Path::new(std::ffi::OsStr::from_bytes(path));
+    let mut file = std::fs::File::open(path).ok()?;
+    let stat = file.metadata().ok()?;
+    if !stat.is_file() {
+        return None;
+    }
+    let tag = Tag::of(&stat);
+    let cache = if cache != HashCache::Off && on_network_fs(&file) { HashCache::Off } else { cache };
+    let verity = if cache == HashCache::Off { None } else { measure_verity(&file) };
+    if cache != HashCache::Off {
+        if let Some(hash) = cached_hash(&file, &tag, verity.as_deref()) {
+            return Some(hash);
+        }
+    }
+    let mut hasher = xxhash_rust::xxh3::Xxh3::new();
+    loop {
+        match file.read(buffer) {
+            Ok(0) => break,
+            Ok(n) => hasher.update(&buffer[..n]),
+            Err(err) if err.kind() == std::io::ErrorKind::Interrupted => (),
+            Err(_) => return None,
+        }
+    }
+    let hash = hasher.digest128();
+    // Only cache what the file held throughout.
+    if cache == HashCache::Update && file.metadata().is_ok_and(|stat| Tag::of(&stat).same_contents(&tag) && Tag::of(&stat).ctime_ns == tag.ctime_ns) {
+        cache_hash(&file, &tag, verity.as_deref(), hash);
+    }
+    Some(hash)
+}
+
+/// Sorts the accesses by path and hashes every file that was read or written, on all cores.
+fn summarize(accesses: std::collections::HashMap<Vec<u8>, u8>, cache: HashCache) -> Vec<Entry<'static>> {
+    let mut entries = accesses.into_iter().map(|(path, access)| Entry { path: path.into(), access, hash: NO_HASH.into() }).collect::<Vec<_>>();
+    entries.sort_unstable_by(|a, b| a.path.cmp(&b.path));
+    let chunk_size = entries.len().div_ceil(prov_tools::n_threads()).max(1);
+    std::thread::scope(|scope| {
+        for chunk in entries.chunks_mut(chunk_size) {
+            scope.spawn(move || {
+                let mut buffer = vec![0u8; 1 << 20];
+                for entry in chunk {
+                    if entry.access & (READ | WRITE) != 0 {
+                        if let Some(hash) = hash_file(&trace_format::compacted::unquote(&entry.path), &mut buffer, cache) {
+                            entry.hash = format!("{:032x}", hash).into_bytes().into();
+                        }
+                    }
+                }
+            });
+        }
+    });
+    entries
+}
+
+fn access_str(access: u8) -> String {
+    [(READ, 'r'), (WRITE, 'w'), (METADATA, 'm')].iter()
+        .map(|(bit, letter)| if access & bit != 0 { *letter } else { '-' })
+        .collect()
+}
+
+
+fn write_summary(entries: &[Entry], output: &std::path::Path) -> std::io::Result<()> {
+    let mut output = std::io::BufWriter::new(std::fs::File::create(output)?);
+    writeln!(output, "{}", SUMMARY_MAGIC)?;
+    for entry in entries {
+        write!(output, "{} ", access_str(entry.access))?;
+        output.write_all(&entry.hash)?;
+        output.write_all(b" ")?;
+        output.write_all(&entry.path)?;
+        output.write_all(b"\n")?;
+    }
+    output.flush()
+}
+
+fn invalid_summary(path: &std::path::Path, line: &[u8]) -> std::io::Error {
+    std::io::Error::new(std::io::ErrorKind::InvalidData, format!("{}: malformed summary line {:?}", path.display(), String::from_utf8_lossy(line)))
+}
+
+fn parse_summary_lines<'a>(path: &std::path::Path, lines: &'a [u8]) -> std::io::Result<Vec<Entry<'a>>> {
+    // Summary lines are rarely shorter than this, so this usually avoids regrowing
+    let mut entries = Vec::with_capacity(lines.len() / 48);
+    for line in lines.split(|byte| *byte == b'\n').filter(|line| !line.is_empty()) {
+        // "rwm HASH PATH", where the access field is always 3 letters and HASH is 32 hex digits or "-"
+        if line.len() < 7 || line[3] != b' ' {
+            return Err(invalid_summary(path, line));
+        }
+        let access = [(READ, b'r'), (WRITE, b'w'), (METADATA, b'm')].iter()
+            .filter(|(_, letter)| line[..3].contains(letter))
+            .fold(0, |access, (bit, _)| access | bit);
+        let (hash, entry_path) = if line[4..].starts_with(b"- ") {
+            (&line[4..5], &line[6..])
+        } else if line.len() > 37 && line[36] == b' ' {
+            (&line[4..36], &line[37..])
+        } else {
+            return Err(invalid_summary(path, line));
+        };
+        entries.push(Entry { path: entry_path.into(), access, hash: hash.into() });
+    }
+    Ok(entries)
+}
+
+/// Parses the summary in path, whose contents are contents, in chunks of lines, on all cores.
+fn parse_summary<'a>(path: &std::path::Path, contents: &'a [u8]) -> std::io::Result<Vec<Entry<'a>>> {
+    let body = &contents[contents.iter().position(|byte| *byte == b'\n').map_or(contents.len(), |end| end + 1)..];
+    let mut chunks = Vec::new();
+    let mut rest = body;
+    let chunk_size = body.len().div_ceil(prov_tools::n_threads()).max(1);
+    while !rest.is_empty() {
+        let end = rest[chunk_size.min(rest.len() - 1)..].iter().position(|byte| *byte == b'\n')
+            .map_or(rest.len(), |newline| chunk_size.min(rest.len() - 1) + newline + 1);
+        chunks.push(&rest[..end]);
+        rest = &rest[end..];
+    }
+    let parsed = std::thread::scope(|scope| {
+        let handles = chunks.iter().map(|chunk| scope.spawn(|| parse_summary_lines(path, chunk))).collect::<Vec<_>>();
+        handles.into_iter().map(|handle| handle.join().unwrap()).collect::<std::io::Result<Vec<_>>>()
+    })?;
+    let entries = if parsed.len() == 1 { parsed.into_iter().next().unwrap() } else { parsed.concat() };
+    if !entries.windows(2).all(|pair| pair[0].path < pair[1].path) {
+        return Err(std::io::Error::new(std::io::ErrorKind::InvalidData, format!("{}: summary is not sorted", path.display())));
+    }
+    Ok(entries)
+}
+
+fn is_summary(path: &std::path::Path) -> std::io::Result<bool> {
+    if !path.is_file() {
+        return Ok(false);
+    }
+    let mut first_line = Vec::new();
+    std::io::BufReader::new(std::fs::File::open(path)?).take(SUMMARY_MAGIC.len() as u64 + 1).read_until(b'\n', &mut first_line)?;
+    Ok(first_line.strip_suffix(b"\n") == Some(SUMMARY_MAGIC.as_bytes()))
+}
+
+/// The contents of run, if it is a summary.
+fn read_if_summary(run: &std::path::Path) -> std::io::Result<Option<Vec<u8>>> {
+    if is_summary(run)? { std::fs::read(run).map(Some) } else { Ok(None) }
+}
+
+fn load<'a>(run: &std::path::Path, contents: &'a Option<Vec<u8>>, dictionary_path: Option<&str>, cache: HashCache) -> std::io::Result<Vec<Entry<'a>>> {
+    match contents {
+        Some(contents) => parse_summary(run, contents),
+        None => Ok(summarize(read_accesses(run, dictionary_path)?, cache)),
+    }
+}
+
+#[derive(Default)]
+struct Counts {
+    new: usize,
+    removed: usize,
+    changed: usize,
+}
+
+/// Merge-joins two sorted summaries and reports the differences in how they use files with the given access.
+fn report(a: &[Entry], b: &[Entry], access: u8, noun: &str, output: &mut impl Write) -> std::io::Result<Counts> {
+    let mut counts = Counts::default();
+    let a = a.iter().filter(|entry| entry.access & access != 0);
+    let b = b.iter().filter(|entry| entry.access & access != 0);
+    let mut a = a.peekable();
+    let mut b = b.peekable();
+    loop {
+        let ordering = match (a.peek(), b.peek()) {
+            (None, None) => break,
+            (Some(_), None) => std::cmp::Ordering::Less,
+            (None, Some(_)) => std::cmp::Ordering::Greater,
+            (Some(entry_a), Some(entry_b)) => entry_a.path.cmp(&entry_b.path),
+        };
+        match ordering {
+            std::cmp::Ordering::Less => {
+                let entry = a.next().unwrap();
+                write!(output, "removed {}: ", noun)?;
+                output.write_all(&entry.path)?;
+                counts.removed += 1;
+            },
+            std::cmp::Ordering::Greater => {
+                let entry = b.next().unwrap();
+                write!(output, "new {}: ", noun)?;
+                output.write_all(&entry.path)?;
+                counts.new += 1;
+            },
+            std::cmp::Ordering::Equal => {
+                let (entry_a, entry_b) = (a.next().unwrap(), b.next().unwrap());
+                if entry_a.hash == entry_b.hash {
+                    continue;
+                }
+                write!(output, "changed {}: ", noun)?;
+                output.write_all(&entry_a.path)?;
+                output.write_all(b" ")?;
+                output.write_all(&entry_a.hash)?;
+                output.write_all(b" -> ")?;
+                output.write_all(&entry_b.hash)?;
+                counts.changed += 1;
+            },
+        }
+        output.write_all(b"\n")?;
+    }
+    Ok(counts)
+}
+
+fn main() -> std::io::Result<()> {
+    let (runs, options) = prov_tools::parse_args(std::env::args(), &["dictionary", "summarize", "hash-cache"]).unwrap_or_else(|err| {
+        eprintln!("{}\n{}", err, USAGE);
+        std::process::exit(2);
+    });
+    let dictionary_path = options.get("dictionary").map(String::as_str);
+    let cache = match options.get("hash-cache").map(String::as_str) {
+        Some("update") => HashCache::Update,
+        None | Some("read") => HashCache::Read,
+        Some("off") => HashCache::Off,
+        Some(mode) => {
+            eprintln!("unknown --hash-cache mode {}\n{}", mode, USAGE);
+            std::process::exit(2);
+        },
+    };
+    if let Some(output) = options.get("summarize") {
+        let [run] = runs.as_slice() else {
+            eprintln!("--summarize takes one RUN\n{}", USAGE);
+            std::process::exit(2);
+        };
+        let run = std::path::Path::new(run);
+        let contents = read_if_summary(run)?;
+        let entries = load(run, &contents, dictionary_path, cache)?;
+        return write_summary(&entries, std::path::Path::new(output));
+    }
+    let [run_a, run_b] = runs.as_slice() else {
+        eprintln!("{}", USAGE);
+        std::process::exit(2);
+    };
+    let (run_a, run_b) = (std::path::Path::new(run_a), std::path::Path::new(run_b));
+    let (contents_a, contents_b) = (read_if_summary(run_a)?, read_if_summary(run_b)?);
+    let (a, b) = std::thread::scope(|scope| {
+        let a = scope.spawn(|| load(run_a, &contents_a, dictionary_path, cache));
+        let b = load(run_b, &contents_b, dictionary_path, cache);
+        (a.join().unwrap(), b)
+    });
+    let (a, b) = (a?, b?);
+    let stdout = std::io::stdout();
+    let mut stdout = std::io::BufWriter::new(stdout.lock());
+    let inputs = report(&a, &b, READ, "input", &mut stdout)?;
+    let outputs = report(&a, &b, WRITE, "output", &mut stdout)?;
+    stdout.flush()?;
+    eprintln!(
+        "inputs: {} new, {} removed, {} changed; outputs: {} new, {} removed, {} changed",
+        inputs.new, inputs.removed, inputs.changed, outputs.new, outputs.removed, outputs.changed,
+    );
+    if inputs.new + inputs.removed + inputs.changed + outputs.new + outputs.removed + outputs.changed > 0 {
+        std::process::exit(1);
+    }
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn entry(path: &str, access: u8, hash: &str) -> Entry<'static> {
+        Entry { path: path.as_bytes().to_vec().into(), access, hash: hash.as_bytes().to_vec().into() }
+    }
+
+    #[test]
+    fn summaries_round_trip() {
+        // Enough lines that parse_summary splits them into several chunks
+        let mut entries: Vec<Entry> = (0..1000)
+            .map(|i| entry(&format!("\"/data/{:04} with space\"", i), [READ, WRITE, READ | METADATA][i % 3], if i % 7 == 0 { "-" } else { "0123456789abcdef0123456789abcdef" }))
+            .collect();
+        entries.push(entry("\"/z/\\\"quoted\\\" \\xff\"", READ | WRITE | METADATA, "-"));
+        let path = std::env::temp_dir().join(format!("prov-diff-test-{}.summary", std::process::id()));
+        write_summary(&entries, &path).unwrap();
+        assert!(is_summary(&path).unwrap());
+        let contents = read_if_summary(&path).unwrap();
+        std::fs::remove_file(&path).unwrap();
+        assert_eq!(parse_summary(&path, contents.as_ref().unwrap()).unwrap(), entries);
+    }
+
+    #[test]
+    fn malformed_summary_lines_are_rejected() {
+        let path = std::path::Path::new("test.summary");
+        for line in [&b"rw"[..], b"rw- 0123 \"/short/hash\"", b"rwx-- \"/no/space\"", b"r-- -\"/glued\""] {
+            assert!(parse_summary_lines(path, line).is_err(), "{}", String::from_utf8_lossy(line));
+        }
+        assert_eq!(parse_summary_lines(path, b"-w- - \"/out\"\n").unwrap(), vec![entry("\"/out\"", WRITE, "-")]);
+    }
+
+    #[test]
+    fn unsorted_summaries_are_rejected() {
+        let contents = format!("{}\nr-- - \"/b\"\nr-- - \"/a\"\n", SUMMARY_MAGIC);
+        assert!(parse_summary(std::path::Path::new("test.summary"), contents.as_bytes()).is_err());
+    }
+
+    #[test]
+    fn folded_records_count_as_written_or_not_at_all() {
+        let paths = vec![b"\"/out/interned\"".to_vec()];
+        let mut accesses = std::collections::HashMap::new();
+        for record in [
+            &b"1 open mode: Read file: (-100 \"/in\") fd: 3"[..],
+            b"2 open mode: Read file: (-100 \"/missing\") err: ENOENT",
+            b"3 wrote file: (-100 \"/out/renamed\") created: 2 records: 4",
+            b"4 ephemeral file: (-100 \"/tmp/scratch\") created: 2 records: 5",
+            b"5 op code: MetadataRead file: (-100 \"/in\")",
+            b"6 open mode: Overwrite file: (-100 @0) fd: 4",
+        ] {
+            add_record(record, &paths, &mut accesses);
+        }
+        let mut accesses: Vec<(String, u8)> = accesses.into_iter().map(|(path, access)| (String::from_utf8(path).unwrap(), access)).collect();
+        accesses.sort();
+        assert_eq!(accesses, vec![
+            ("\"/in\"".to_string(), READ | METADATA),
+            ("\"/out/interned\"".to_string(), WRITE),
+            ("\"/out/renamed\"".to_string(), WRITE),
+        ]);
+    }
+
+    #[test]
+    fn report_finds_new_removed_and_changed_files() {
+        let a = [entry("\"/a\"", READ, "1"), entry("\"/b\"", READ, "2"), entry("\"/c\"", READ, "3"), entry("\"/w\"", WRITE, "4")];
+        let b = [entry("\"/b\"", READ, "2"), entry("\"/c\"", READ, "9"), entry("\"/d\"", READ, "5")];
+        let mut output = Vec::new();
+        let counts = report(&a, &b, READ, "input", &mut output).unwrap();
+        assert_eq!((counts.new, counts.removed, counts.changed), (1, 1, 1));
+        assert_eq!(String::from_utf8(output).unwrap(), "removed input: \"/a\"\nchanged input: \"/c\" 3 -> 9\nnew input: \"/d\"\n");
+    }
+}
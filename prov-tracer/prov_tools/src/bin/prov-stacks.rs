@@ -0,0 +1,223 @@
+/*
+ * Show which call stacks the traced records came from, busiest first.
+ *
+ *     prov-stacks [--top N] [--dictionary PATH] TRACE...
+ *
+ * For traces taken with PROV_TRACER_STACKS (see prov-tracer's src/stacks.rs).
+ * Stack ids are per thread, so stacks are matched up across threads and
+ * processes by their frames, each taken as an offset into the module (the
+ * executable or a library) it fell in; so one code path is one entry however
+ * many processes ran it. The --top N (default 10) stacks with the most
+ * records are printed, with the count of each kind of record, innermost
+ * frame first.
+ *
+ * Frames are symbolized with addr2line (from binutils), against the modules
+ * as they are now; a module that was rebuilt since the trace was taken gives
+ * wrong names. Frames addr2line cannot name are printed as module+offset.
+ *
+ * TRACE may be a per-thread trace or a compacted one (see prov-compact).
+ */
+
+use std::collections::HashMap;
+use std::io::Write;
+
+const USAGE: &str = "Usage: prov-stacks [--top N] [--dictionary PATH] TRACE...";
+
+/// A return address, as (module path, offset from the module's load bias); None if it was in no module
+type Frame = (Option<std::rc::Rc<[u8]>>, usize);
+
+struct Module {
+    base: usize,
+    start: usize,
+    end: usize,
+    path: std::rc::Rc<[u8]>,
+}
+
+/// What one thread's trace has defined so far
+#[derive(Default)]
+struct Thread {
+    modules: Vec<Module>,
+    /// Index into Totals::stacks, by the thread's stack id
+    stacks: HashMap<u64, usize>,
+}
+
+#[derive(Default)]
+struct Totals {
+    stacks: Vec<Vec<Frame>>,
+    by_frames: HashMap<Vec<Frame>, usize>,
+    /// Records per kind, by index into stacks
+    records: HashMap<usize, HashMap<String, u64>>,
+    /// Records whose stack was never defined (e.g. overwritten in a flight recorder's ring)
+    unknown: u64,
+}
+
+fn hex(field: &str) -> Option<usize> {
+    usize::from_str_radix(field.strip_prefix("0x")?, 16).ok()
+}
+
+/// What kind of record this is, e.g. "open Read" or "MetadataRead"
+fn kind(record: &str) -> String {
+    let mut words = record.split(' ');
+    match (words.next(), words.next(), words.next()) {
+        (Some("open"), Some("mode:"), Some(mode)) => format!("open {}", mode),
+        (Some("op"), Some("code:"), Some(op)) => op.to_string(),
+        (Some("search"), Some("op:"), Some(op)) => format!("search {}", op),
+        (Some(first), _, _) => first.to_string(),
+        _ => String::new(),
+    }
+}
+
+impl Totals {
+    /// Takes one record (without its timestamp, or "timestamp pid tid") of a thread.
+    fn record(&mut self, thread: &mut Thread, record: &[u8]) {
+        let record = record.strip_suffix(b"\n").unwrap_or(record);
+        if let Some(module) = record.strip_prefix(b"module base: ") {
+            // 0xBASE start: 0xSTART end: 0xEND path: "PATH"
+            let Some(path_at) = module.windows(7).position(|window| window == b" path: ") else { return };
+            let fields = String::from_utf8_lossy(&module[..path_at]).into_owned();
+            let fields: Vec<&str> = fields.split(' ').collect();
+            if let [base, "start:", start, "end:", end] = fields[..] {
+                if let (Some(base), Some(start), Some(end)) = (hex(base), hex(start), hex(end)) {
+                    let path = trace_format::compacted::unquote(&module[path_at + 7..]).into();
+                    thread.modules.retain(|module| module.end <= start || end <= module.start);
+                    thread.modules.push(Module { base, start, end, path });
+                }
+            }
+        } else if let Some(stack) = record.strip_prefix(b"stack id: ") {
+            // N frames: (0xA 0xB ...)
+            let stack = String::from_utf8_lossy(stack);
+            let Some((id, frames)) = stack.split_once(" frames: ") else { return };
+            let Ok(id) = id.parse::<u64>() else { return };
+            let frames: Vec<Frame> = frames.trim_matches(|c| c == '(' || c == ')').split(' ').filter_map(hex).map(|address| {
+                match thread.modules.iter().find(|module| module.start <= address && address < module.end) {
+                    Some(module) => (Some(module.path.clone()), address - module.base),
+                    None => (None, address),
+                }
+            }).collect();
+            let next = self.stacks.len();
+            let index = *self.by_frames.entry(frames.clone()).or_insert(next);
+            if index == next {
+                self.stacks.push(frames);
+            }
+            thread.stacks.insert(id, index);
+        } else if let Some(tag_at) = record.windows(8).rposition(|window| window == b" stack: ") {
+            let Some(id) = std::str::from_utf8(&record[tag_at + 8..]).ok().and_then(|id| id.parse::<u64>().ok()) else { return };
+            match thread.stacks.get(&id) {
+                Some(index) => {
+                    let kind = kind(&String::from_utf8_lossy(&record[..tag_at]));
+                    *self.records.entry(*index).or_default().entry(kind).or_default() += 1;
+                },
+                None => self.unknown += 1,
+            }
+        }
+    }
+}
+
+/// Names frames with addr2line, one run per module; frames it cannot name are left out.
+fn symbolize(frames: &[&Frame]) -> HashMap<Frame, String> {
+    let mut by_module: HashMap<std::rc::Rc<[u8]>, Vec<usize>> = HashMap::new();
+    for (module, offset) in frames {
+        if let Some(module) = module {
+            by_module.entry(module.clone()).or_default().push(*offset);
+        }
+    }
+    let mut names = HashMap::new();
+    for (module, offsets) in by_module {
+        let path: &std::ffi::OsStr = std::os::unix::ffi::OsStrExt::from_bytes(&module);
+        // A return address is just past the call, which may end the function.
+        let addresses = offsets.iter().map(|offset| format!("{:#x}", offset.saturating_sub(1)));
+        let Ok(output) = std::process::Command::new("addr2line").args(["-f", "-C", "-e"]).arg(path).args(addresses).output() else { continue };
+        let output = String::from_utf8_lossy(&output.stdout);
+        let lines: Vec<&str> = output.lines().collect();
+        for (offset, pair) in offsets.iter().zip(lines.chunks(2)) {
+            if let [function, location] = pair {
+                if *function != "??" {
+                    let location = if location.starts_with("??") { String::new() } else { format!(" at {}", location) };
+                    names.insert((Some(module.clone()), *offset), format!("{}{}", function, location));
+                }
+            }
+        }
+    }
+    names
+}
+
+fn main() -> std::io::Result<()> {
+    let (paths, options) = prov_tools::parse_args(std::env::args(), &["top", "dictionary"]).unwrap_or_else(|err| {
+        eprintln!("{}\n{}", err, USAGE);
+        std::process::exit(2);
+    });
+    let top: usize = options.get("top").map(|value| value.parse().unwrap_or_else(|_| {
+        eprintln!("--top must be a number\n{}", USAGE);
+        std::process::exit(2);
+    })).unwrap_or(10);
+    if paths.is_empty() {
+        eprintln!("{}", USAGE);
+        std::process::exit(2);
+    }
+    let dictionary = options.get("dictionary").map(String::as_str);
+
+    let mut totals = Totals::default();
+    for path in paths {
+        let path = std::path::Path::new(&path);
+        if prov_tools::is_compacted(path)? {
+            // Records are "timestamp pid tid record", from every thread.
+            let mut threads: HashMap<Vec<u8>, Thread> = HashMap::new();
+            let reader = prov_tools::CompactedReader::open(path, dictionary)?;
+            let mut line = Vec::new();
+            for start in (0..reader.index.len()).step_by(256) {
+                for block in reader.decoded_blocks(start..(start + 256).min(reader.index.len()))? {
+                    for record in block.split_inclusive(|byte| *byte == b'\n') {
+                        line.clear();
+                        trace_format::compacted::expand_paths(record, &reader.paths, &mut line)?;
+                        let mut fields = line.splitn(4, |byte| *byte == b' ');
+                        let (Some(_), Some(pid), Some(tid), Some(record)) = (fields.next(), fields.next(), fields.next(), fields.next()) else { continue };
+                        let thread = threads.entry([pid, b" ", tid].concat()).or_default();
+                        totals.record(thread, record);
+                    }
+                }
+            }
+            continue;
+        }
+        let mut thread = Thread::default();
+        let mut reader = prov_tools::TraceReader::open(path, dictionary)?;
+        loop {
+            let blocks = reader.next_decoded_blocks(256)?;
+            if blocks.is_empty() {
+                break;
+            }
+            for block in blocks {
+                for record in block.split_inclusive(|byte| *byte == b'\n') {
+                    let Some(space) = record.iter().position(|byte| *byte == b' ') else { continue };
+                    totals.record(&mut thread, &record[space + 1..]);
+                }
+            }
+        }
+    }
+
+    let mut ranked: Vec<(u64, usize)> = totals.records.iter().map(|(index, kinds)| (kinds.values().sum(), *index)).collect();
+    ranked.sort_by(|a, b| b.cmp(a));
+    ranked.truncate(top);
+    let frames: Vec<&Frame> = ranked.iter().flat_map(|(_, index)| &totals.stacks[*index]).collect();
+    let names = symbolize(&frames);
+
+    let stdout = std::io::stdout();
+    let mut stdout = std::io::BufWriter::new(stdout.lock());
+    for (count, index) in &ranked {
+        let mut kinds: Vec<(&String, &u64)> = totals.records[index].iter().collect();
+        kinds.sort_by(|a, b| b.1.cmp(a.1).then(a.0.cmp(b.0)));
+        let kinds: Vec<String> = kinds.iter().map(|(kind, count)| format!("{} {}", kind, count)).collect();
+        writeln!(stdout, "{} records ({})", count, kinds.join(", "))?;
+        for frame in &totals.stacks[*index] {
+            match (names.get(frame), frame) {
+                (Some(name), _) => writeln!(stdout, "    {}", name)?,
+                (None, (Some(module), offset)) => writeln!(stdout, "    {}+{:#x}", String::from_utf8_lossy(module), offset)?,
+                (None, (None, address)) => writeln!(stdout, "    {:#x}", address)?,
+            }
+        }
+        writeln!(stdout)?;
+    }
+    if totals.unknown > 0 {
+        writeln!(stdout, "{} records whose stack was not in the trace", totals.unknown)?;
+    }
+    stdout.flush()
+}
@@ -0,0 +1,198 @@
+/*
+ * Show what the tracer is doing in every traced process on this host, like top.
+ *
+ *     prov-top [--interval SECONDS] [--count N]
+ *
+ * Reads the counter pages that processes traced with PROV_TRACER_COUNTERS=1
+ * publish in /dev/shm (see trace_format::counters), every --interval
+ * (default 2), and prints per-process rates, busiest first. --count stops
+ * after N screens (default: run until interrupted); with --count, the screen
+ * is not cleared between them.
+ *
+ * Columns: events/s, with the top kinds of event; trace bytes/s; bytes
+ * buffered in memory; records dropped; and the share of one CPU spent in the
+ * tracer's hooks, with the mean cost per traced call.
+ *
+ * Pages of processes that died without unlinking theirs (a crash or _exit)
+ * are removed.
+ */
+
+use std::sync::atomic::Ordering;
+use trace_format::counters::{Counters, COUNTERS_MAGIC, OPS, SHM_PREFIX};
+
+const USAGE: &str = "Usage: prov-top [--interval SECONDS] [--count N]";
+const SHM_DIR: &str = "/dev/shm";
+
+#[derive(Clone, Copy, Default)]
+struct Snapshot {
+    events: [u64; OPS.len()],
+    bytes_logged: u64,
+    buffered_bytes: u64,
+    dropped: u64,
+    hook_calls: u64,
+    hook_ns: u64,
+}
+
+struct Page {
+    base: *mut libc::c_void,
+}
+
+impl Page {
+    fn open(path: &std::path::Path) -> Option<Self> {
+        let file = std::fs::File::open(path).ok()?;
+        let size = std::mem::size_of::<Counters>();
+        if (file.metadata().ok()?.len() as usize) < size {
+            return None;
+        }
+        let base = unsafe {
+            libc::mmap(std::ptr::null_mut(), size, libc::PROT_READ, libc::MAP_SHARED, std::os::fd::AsRawFd::as_raw_fd(&file), 0)
+        };
+        (base != libc::MAP_FAILED).then_some(Self { base })
+    }
+
+    fn counters(&self) -> &Counters {
+        unsafe { &*(self.base as *const Counters) }
+    }
+
+    fn snapshot(&self) -> Option<Snapshot> {
+        let counters = self.counters();
+        if counters.magic.load(Ordering::Acquire) != COUNTERS_MAGIC {
+            return None;
+        }
+        Some(Snapshot {
+            events: std::array::from_fn(|i| counters.events[i].load(Ordering::Relaxed)),
+            bytes_logged: counters.bytes_logged.load(Ordering::Relaxed),
+            buffered_bytes: counters.buffered_bytes.load(Ordering::Relaxed),
+            dropped: counters.dropped.load(Ordering::Relaxed),
+            hook_calls: counters.hook_calls.load(Ordering::Relaxed),
+            hook_ns: counters.hook_ns.load(Ordering::Relaxed),
+        })
+    }
+}
+
+impl Drop for Page {
+    fn drop(&mut self) {
+        unsafe { libc::munmap(self.base, std::mem::size_of::<Counters>()) };
+    }
+}
+
+fn alive(pid: u32) -> bool {
+    unsafe { libc::kill(pid as libc::pid_t, 0) == 0 || *libc::__errno_location() == libc::EPERM }
+}
+
+/// Current counters of every traced process, by pid; removes pages of dead processes.
+fn scan() -> std::collections::BTreeMap<u32, Snapshot> {
+    let mut snapshots = std::collections::BTreeMap::new();
+    let Ok(entries) = std::fs::read_dir(SHM_DIR) else { return snapshots };
+    for entry in entries.flatten() {
+        let name = entry.file_name();
+        let Some(pid) = name.to_str().and_then(|name| name.strip_prefix(SHM_PREFIX)).and_then(|pid| pid.parse::<u32>().ok()) else { continue };
+        if !alive(pid) {
+            let _ = std::fs::remove_file(entry.path());
+            continue;
+        }
+        if let Some(snapshot) = Page::open(&entry.path()).and_then(|page| page.snapshot()) {
+            snapshots.insert(pid, snapshot);
+        }
+    }
+    snapshots
+}
+
+fn command(pid: u32) -> String {
+    std::fs::read_to_string(format!("/proc/{}/comm", pid)).map(|comm| comm.trim_end().to_string()).unwrap_or_default()
+}
+
+fn human(value: f64) -> String {
+    match value {
+        v if v >= 1e9 => format!("{:.1}G", v / 1e9),
+        v if v >= 1e6 => format!("{:.1}M", v / 1e6),
+        v if v >= 1e3 => format!("{:.1}k", v / 1e3),
+        v => format!("{:.0}", v),
+    }
+}
+
+struct Row {
+    pid: u32,
+    events_per_s: f64,
+    top_ops: String,
+    bytes_per_s: f64,
+    buffered: u64,
+    dropped: u64,
+    hook_share: f64,
+    ns_per_call: f64,
+}
+
+fn row(pid: u32, before: &Snapshot, after: &Snapshot, seconds: f64) -> Row {
+    let mut ops: Vec<(u64, &str)> = OPS.iter().enumerate()
+        .map(|(i, op)| (after.events[i].saturating_sub(before.events[i]), *op))
+        .filter(|(count, _)| *count > 0)
+        .collect();
+    ops.sort_by(|a, b| b.cmp(a));
+    let calls = after.hook_calls.saturating_sub(before.hook_calls);
+    let hook_ns = after.hook_ns.saturating_sub(before.hook_ns);
+    Row {
+        pid,
+        events_per_s: ops.iter().map(|(count, _)| *count).sum::<u64>() as f64 / seconds,
+        top_ops: ops.iter().take(3).map(|(count, op)| format!("{} {}", op, human(*count as f64 / seconds))).collect::<Vec<_>>().join(", "),
+        bytes_per_s: after.bytes_logged.saturating_sub(before.bytes_logged) as f64 / seconds,
+        buffered: after.buffered_bytes,
+        dropped: after.dropped,
+        hook_share: hook_ns as f64 / 1e9 / seconds,
+        ns_per_call: if calls > 0 { hook_ns as f64 / calls as f64 } else { 0.0 },
+    }
+}
+
+fn main() {
+    let (positional, options) = prov_tools::parse_args(std::env::args(), &["interval", "count"]).unwrap_or_else(|err| {
+        eprintln!("{}\n{}", err, USAGE);
+        std::process::exit(2);
+    });
+    let interval: f64 = options.get("interval").map(|value| value.parse().unwrap_or_else(|_| {
+        eprintln!("--interval must be a number\n{}", USAGE);
+        std::process::exit(2);
+    })).unwrap_or(2.0);
+    let count: Option<u64> = options.get("count").map(|value| value.parse().unwrap_or_else(|_| {
+        eprintln!("--count must be a number\n{}", USAGE);
+        std::process::exit(2);
+    }));
+    if !positional.is_empty() || interval <= 0.0 {
+        eprintln!("{}", USAGE);
+        std::process::exit(2);
+    }
+
+    let mut before = scan();
+    let mut then = std::time::Instant::now();
+    let mut screens = 0;
+    while count.is_none_or(|count| screens < count) {
+        std::thread::sleep(std::time::Duration::from_secs_f64(interval));
+        let after = scan();
+        let now = std::time::Instant::now();
+        let seconds = (now - then).as_secs_f64();
+        let mut rows: Vec<Row> = after.iter().map(|(pid, snapshot)| {
+            row(*pid, before.get(pid).unwrap_or(&Snapshot::default()), snapshot, seconds)
+        }).collect();
+        rows.sort_by(|a, b| b.events_per_s.total_cmp(&a.events_per_s));
+
+        if count.is_none() {
+            print!("\x1b[H\x1b[2J");
+        }
+        println!(
+            "{} traced processes, {} events/s, {} trace bytes/s, {:.2} CPUs in hooks",
+            rows.len(),
+            human(rows.iter().map(|row| row.events_per_s).sum()),
+            human(rows.iter().map(|row| row.bytes_per_s).sum()),
+            rows.iter().map(|row| row.hook_share).sum::<f64>(),
+        );
+        println!("{:>8} {:<15} {:>9} {:>9} {:>9} {:>8} {:>6} {:>8}  {}", "PID", "COMMAND", "EVENTS/S", "BYTES/S", "BUFFERED", "DROPPED", "HOOK%", "NS/CALL", "TOP EVENTS");
+        for row in &rows {
+            println!(
+                "{:>8} {:<15} {:>9} {:>9} {:>9} {:>8} {:>6.1} {:>8.0}  {}",
+                row.pid, command(row.pid), human(row.events_per_s), human(row.bytes_per_s), human(row.buffered as f64),
+                row.dropped, 100.0 * row.hook_share, row.ns_per_call, row.top_ops,
+            );
+        }
+        before = after;
+        then = now;
+        screens += 1;
+    }
+}
@@ -0,0 +1,391 @@
+/*
+ * Helpers shared by the prov_tools binaries.
+ */
+
+use std::io::{Read, Write};
+use std::os::unix::fs::FileExt;
+use trace_format::compacted;
+
+/// Parses `--flag value` options and positional arguments.
+/// Returns the positional arguments; flags are looked up in `options`.
+pub fn parse_args(args: impl Iterator<Item = String>, options: &[&str]) -> Result<(Vec<String>, std::collections::HashMap<String, String>), String> {
+    let mut positional = Vec::new();
+    let mut values = std::collections::HashMap::new();
+    let mut args = args.skip(1);
+    while let Some(arg) = args.next() {
+        if let Some(option) = arg.strip_prefix("--") {
+            if !options.contains(&option) {
+                return Err(format!("unknown option --{}", option));
+            }
+            let value = args.next().ok_or_else(|| format!("--{} needs a value", option))?;
+            values.insert(option.to_string(), value);
+        } else {
+            positional.push(arg);
+        }
+    }
+    Ok((positional, values))
+}
+
+pub struct TraceReader<R> {
+    reader: R,
+    pub header: trace_format::Header,
+    pub dictionary: Option<Vec<u8>>,
+}
+
+impl TraceReader<std::io::BufReader<std::fs::File>> {
+    pub fn open(path: &std::path::Path, dictionary_path: Option<&str>) -> std::io::Result<Self> {
+        Self::new(std::io::BufReader::with_capacity(1 << 20, std::fs::File::open(path)?), dictionary_path)
+    }
+}
+
+impl<R: Read> TraceReader<R> {
+    pub fn new(mut reader: R, dictionary_path: Option<&str>) -> std::io::Result<Self> {
+        let header = trace_format::Header::read_from(&mut reader)?;
+        let dictionary = trace_format::dictionary_for(&header, dictionary_path)?;
+        Ok(Self { reader, header, dictionary })
+    }
+
+    pub fn next_block(&mut self) -> std::io::Result<Option<trace_format::RawBlock>> {
+        trace_format::read_block(&mut self.reader)
+    }
+
+    pub fn decoder(&self) -> std::io::Result<trace_format::BlockDecoder> {
+        trace_format::BlockDecoder::new(&self.header, self.dictionary.as_deref())
+    }
+
+    /// Reads up to n raw blocks.
+    pub fn next_blocks(&mut self, n: usize) -> std::io::Result<Vec<trace_format::RawBlock>> {
+        let mut blocks = Vec::with_capacity(n);
+        while blocks.len() < n {
+            match self.next_block()? {
+                Some(block) => blocks.push(block),
+                None => break,
+            }
+        }
+        Ok(blocks)
+    }
+
+    /// Decodes blocks on all cores, and returns them in order.
+    pub fn next_decoded_blocks(&mut self, n: usize) -> std::io::Result<Vec<Vec<u8>>> {
+        let blocks = self.next_blocks(n)?;
+        let chunk_size = blocks.len().div_ceil(n_threads()).max(1);
+        let header = &self.header;
+        let dictionary = self.dictionary.as_deref();
+        std::thread::scope(|scope| {
+            let handles = blocks
+                .chunks(chunk_size)
+                .map(|chunk| scope.spawn(|| {
+                    let mut decoder = trace_format::BlockDecoder::new(header, dictionary)?;
+                    chunk.iter().map(|block| decoder.decode(block)).collect::<std::io::Result<Vec<_>>>()
+                }))
+                .collect::<Vec<_>>();
+            let mut decoded = Vec::with_capacity(blocks.len());
+            for handle in handles {
+                decoded.extend(handle.join().unwrap()?);
+            }
+            Ok(decoded)
+        })
+    }
+}
+
+pub fn n_threads() -> usize {
+    std::thread::available_parallelism().map(|n| n.get()).unwrap_or(1)
+}
+
+/// Whether path is a compacted trace rather than a per-thread one.
+pub fn is_compacted(path: &std::path::Path) -> std::io::Result<bool> {
+    let mut magic = [0u8; 8];
+    std::fs::File::open(path)?.read_exact(&mut magic)?;
+    Ok(&magic == compacted::COMPACTED_MAGIC)
+}
+
+/// Summary of the records in a block, for the compacted index
+#[derive(Debug, Clone, Copy, Default)]
+pub struct BlockMeta {
+    pub first_timestamp: u64,
+    pub last_timestamp: u64,
+    pub records: u32,
+}
+
+/// Compresses blocks on worker threads and appends them to a file in the
+/// order they were pushed. Both queues are bounded, so memory stays constant
+/// however much is written.
+pub struct BlockPipeline {
+    work: Option<std::sync::mpsc::SyncSender<(u64, Vec<u8>, BlockMeta)>>,
+    workers: Vec<std::thread::JoinHandle<std::io::Result<()>>>,
+    writer: std::thread::JoinHandle<std::io::Result<(std::fs::File, u64, Vec<compacted::IndexEntry>)>>,
+    next_seq: u64,
+}
+
+impl BlockPipeline {
+    /// Appends to file, whose end is at offset.
+    pub fn new(file: std::fs::File, offset: u64, header: trace_format::Header, dictionary: Option<Vec<u8>>, level: i32, n_workers: usize) -> Self {
+        let n_workers = n_workers.max(1);
+        let (work_sender, work_receiver) = std::sync::mpsc::sync_channel::<(u64, Vec<u8>, BlockMeta)>(2 * n_workers);
+        let (done_sender, done_receiver) = std::sync::mpsc::sync_channel::<(u64, Vec<u8>, BlockMeta)>(2 * n_workers);
+        let work_receiver = std::sync::Arc::new(std::sync::Mutex::new(work_receiver));
+        let dictionary = std::sync::Arc::new(dictionary);
+        let workers = (0..n_workers).map(|_| {
+            let work_receiver = work_receiver.clone();
+            let done_sender = done_sender.clone();
+            let dictionary = dictionary.clone();
+            std::thread::spawn(move || {
+                let mut encoder = trace_format::BlockEncoder::new(header.compression, level, dictionary.as_deref())?;
+                loop {
+                    let job = work_receiver.lock().unwrap().recv();
+                    let Ok((seq, block, meta)) = job else { return Ok(()) };
+                    let mut encoded = Vec::with_capacity(block.len() / 2);
+                    encoder.encode(&block, &mut encoded)?;
+                    if done_sender.send((seq, encoded, meta)).is_err() {
+                        return Ok(());
+                    }
+                }
+            })
+        }).collect();
+        let writer = std::thread::spawn(move || {
+            let mut output = std::io::BufWriter::with_capacity(1 << 20, file);
+            let mut offset = offset;
+            let mut index = Vec::new();
+            let mut pending = std::collections::BTreeMap::new();
+            for (seq, encoded, meta) in done_receiver {
+                pending.insert(seq, (encoded, meta));
+                while let Some((encoded, meta)) = pending.remove(&(index.len() as u64)) {
+                    output.write_all(&encoded)?;
+                    index.push(compacted::IndexEntry {
+                        offset,
+                        first_timestamp: meta.first_timestamp,
+                        last_timestamp: meta.last_timestamp,
+                        records: meta.records,
+                    });
+                    offset += encoded.len() as u64;
+                }
+            }
+            let file = output.into_inner().map_err(|err| err.into_error())?;
+            Ok((file, offset, index))
+        });
+        Self { work: Some(work_sender), workers, writer, next_seq: 0 }
+    }
+
+    pub fn push(&mut self, block: Vec<u8>, meta: BlockMeta) {
+        // A send only fails if a worker died; finish() reports its error.
+        let _ = self.work.as_ref().unwrap().send((self.next_seq, block, meta));
+        self.next_seq += 1;
+    }
+
+    /// Waits for every block to be written. Returns the file, its new end
+    /// offset, and an index entry for every block.
+    pub fn finish(mut self) -> std::io::Result<(std::fs::File, u64, Vec<compacted::IndexEntry>)> {
+        self.work = None;
+        for worker in self.workers {
+            worker.join().unwrap()?;
+        }
+        let (file, offset, index) = self.writer.join().unwrap()?;
+        if index.len() as u64 != self.next_seq {
+            return Err(std::io::Error::other("a block was lost while writing"));
+        }
+        Ok((file, offset, index))
+    }
+}
+
+/// Cuts a stream of records into blocks for a BlockPipeline.
+pub struct Blocker {
+    pub block: Vec<u8>,
+    meta: BlockMeta,
+}
+
+impl Blocker {
+    pub const BLOCK_SIZE: usize = 256 * 1024;
+
+    pub fn new() -> Self {
+        Self { block: Vec::with_capacity(Self::BLOCK_SIZE + 4096), meta: Default::default() }
+    }
+
+    /// Call after appending a line to self.block.
+    pub fn record(&mut self, timestamp: u64, pipeline: &mut BlockPipeline) {
+        if self.meta.records == 0 {
+            self.meta.first_timestamp = timestamp;
+        }
+        self.meta.last_timestamp = timestamp;
+        self.meta.records += 1;
+        if self.block.len() >= Self::BLOCK_SIZE {
+            self.ship(pipeline);
+        }
+    }
+
+    pub fn ship(&mut self, pipeline: &mut BlockPipeline) {
+        if !self.block.is_empty() {
+            pipeline.push(std::mem::replace(&mut self.block, Vec::with_capacity(Self::BLOCK_SIZE + 4096)), self.meta);
+            self.meta = Default::default();
+        }
+    }
+}
+
+impl Default for Blocker {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+/// Writes a compacted trace (see trace_format::compacted) from records
+/// pushed in timestamp order, interning their paths as it goes.
+pub struct CompactedWriter {
+    pipeline: BlockPipeline,
+    header: trace_format::Header,
+    level: i32,
+    n_threads: usize,
+    path_ids: std::collections::HashMap<Vec<u8>, u32>,
+    blocker: Blocker,
+    records: u64,
+}
+
+pub struct CompactedSummary {
+    pub records: u64,
+    pub paths: usize,
+    pub blocks: usize,
+    pub bytes: u64,
+}
+
+impl std::fmt::Display for CompactedSummary {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        write!(f, "{} records, {} paths, {} blocks ({} bytes)", self.records, self.paths, self.blocks, self.bytes)
+    }
+}
+
+impl CompactedWriter {
+    pub fn create(output: &std::path::Path, level: i32, n_threads: usize) -> std::io::Result<Self> {
+        let header = trace_format::Header {
+            compression: trace_format::Compression::Zstd,
+            dictionary_hash: trace_format::dictionary_hash(trace_format::BUILTIN_DICTIONARY),
+        };
+        let mut file = std::fs::File::create(output)?;
+        file.write_all(&header.to_bytes_with_magic(compacted::COMPACTED_MAGIC))?;
+        Ok(Self {
+            pipeline: BlockPipeline::new(file, trace_format::HEADER_SIZE as u64, header, Some(trace_format::BUILTIN_DICTIONARY.to_vec()), level, n_threads),
+            header,
+            level,
+            n_threads,
+            path_ids: std::collections::HashMap::new(),
+            blocker: Blocker::new(),
+            records: 0,
+        })
+    }
+
+    /// line is "timestamp pid tid record", without the end of line.
+    pub fn push(&mut self, timestamp: u64, line: &[u8]) {
+        let path_ids = &mut self.path_ids;
+        compacted::intern_paths(line, |path| {
+            let next_id = path_ids.len() as u32;
+            *path_ids.entry(path.to_vec()).or_insert(next_id)
+        }, &mut self.blocker.block);
+        self.blocker.block.push(b'\n');
+        self.blocker.record(timestamp, &mut self.pipeline);
+        self.records += 1;
+    }
+
+    /// Writes the path table, the index and the footer.
+    pub fn finish(mut self) -> std::io::Result<CompactedSummary> {
+        self.blocker.ship(&mut self.pipeline);
+        let (file, paths_offset, index) = self.pipeline.finish()?;
+
+        let mut paths = vec![Vec::new(); self.path_ids.len()];
+        for (path, id) in self.path_ids {
+            paths[id as usize] = path;
+        }
+        let mut pipeline = BlockPipeline::new(file, paths_offset, self.header, Some(trace_format::BUILTIN_DICTIONARY.to_vec()), self.level, self.n_threads);
+        let mut block = Vec::with_capacity(Blocker::BLOCK_SIZE + 4096);
+        for path in &paths {
+            block.extend_from_slice(path);
+            block.push(b'\n');
+            if block.len() >= Blocker::BLOCK_SIZE {
+                pipeline.push(std::mem::replace(&mut block, Vec::with_capacity(Blocker::BLOCK_SIZE + 4096)), Default::default());
+            }
+        }
+        if !block.is_empty() {
+            pipeline.push(block, Default::default());
+        }
+        let (mut file, index_offset, _) = pipeline.finish()?;
+
+        let mut tail = Vec::with_capacity(index.len() * compacted::INDEX_ENTRY_SIZE + compacted::FOOTER_SIZE);
+        for entry in &index {
+            tail.extend_from_slice(&entry.to_bytes());
+        }
+        tail.extend_from_slice(&compacted::Footer {
+            paths_offset,
+            index_offset,
+            blocks: index.len() as u64,
+            paths: paths.len() as u64,
+        }.to_bytes());
+        file.write_all(&tail)?;
+        Ok(CompactedSummary { records: self.records, paths: paths.len(), blocks: index.len(), bytes: file.metadata()?.len() })
+    }
+}
+
+pub struct CompactedReader {
+    file: std::fs::File,
+    pub header: trace_format::Header,
+    pub dictionary: Option<Vec<u8>>,
+    pub index: Vec<compacted::IndexEntry>,
+    /// Quoted paths, by id
+    pub paths: Vec<Vec<u8>>,
+}
+
+impl CompactedReader {
+    pub fn open(path: &std::path::Path, dictionary_path: Option<&str>) -> std::io::Result<Self> {
+        let file = std::fs::File::open(path)?;
+        let mut header_bytes = [0u8; trace_format::HEADER_SIZE];
+        file.read_exact_at(&mut header_bytes, 0)?;
+        let header = trace_format::Header::from_bytes(&header_bytes, compacted::COMPACTED_MAGIC)?;
+        let dictionary = trace_format::dictionary_for(&header, dictionary_path)?;
+        let mut footer_bytes = [0u8; compacted::FOOTER_SIZE];
+        let len = file.metadata()?.len();
+        file.read_exact_at(&mut footer_bytes, len.saturating_sub(compacted::FOOTER_SIZE as u64))?;
+        let footer = compacted::Footer::from_bytes(&footer_bytes)?;
+        let mut index_bytes = vec![0u8; footer.blocks as usize * compacted::INDEX_ENTRY_SIZE];
+        file.read_exact_at(&mut index_bytes, footer.index_offset)?;
+        let index = index_bytes.chunks(compacted::INDEX_ENTRY_SIZE).map(compacted::IndexEntry::from_bytes).collect();
+        let mut reader = Self { file, header, dictionary, index, paths: Vec::with_capacity(footer.paths as usize) };
+        let mut decoder = reader.decoder()?;
+        let mut offset = footer.paths_offset;
+        while offset < footer.index_offset {
+            let block = reader.raw_block_at(offset)?;
+            offset += (trace_format::BLOCK_HEADER_SIZE + block.payload.len()) as u64;
+            reader.paths.extend(decoder.decode(&block)?.split(|byte| *byte == b'\n').filter(|path| !path.is_empty()).map(<[u8]>::to_vec));
+        }
+        if reader.paths.len() as u64 != footer.paths {
+            return Err(std::io::Error::new(std::io::ErrorKind::InvalidData, "path table is truncated"));
+        }
+        Ok(reader)
+    }
+
+    pub fn decoder(&self) -> std::io::Result<trace_format::BlockDecoder> {
+        trace_format::BlockDecoder::new(&self.header, self.dictionary.as_deref())
+    }
+
+    fn raw_block_at(&self, offset: u64) -> std::io::Result<trace_format::RawBlock> {
+        let mut block_header = [0u8; trace_format::BLOCK_HEADER_SIZE];
+        self.file.read_exact_at(&mut block_header, offset)?;
+        let mut payload = vec![0u8; u32::from_le_bytes(block_header[0..4].try_into().unwrap()) as usize];
+        self.file.read_exact_at(&mut payload, offset + trace_format::BLOCK_HEADER_SIZE as u64)?;
+        Ok(trace_format::RawBlock { uncompressed_len: u32::from_le_bytes(block_header[4..8].try_into().unwrap()), payload })
+    }
+
+    /// Decodes record blocks on all cores, and returns them in order, with paths still interned.
+    pub fn decoded_blocks(&self, blocks: std::ops::Range<usize>) -> std::io::Result<Vec<Vec<u8>>> {
+        let entries = &self.index[blocks];
+        let chunk_size = entries.len().div_ceil(n_threads()).max(1);
+        std::thread::scope(|scope| {
+            let handles = entries
+                .chunks(chunk_size)
+                .map(|chunk| scope.spawn(|| {
+                    let mut decoder = self.decoder()?;
+                    chunk.iter().map(|entry| decoder.decode(&self.raw_block_at(entry.offset)?)).collect::<std::io::Result<Vec<_>>>()
+                }))
+                .collect::<Vec<_>>();
+            let mut decoded = Vec::with_capacity(entries.len());
+            for handle in handles {
+                decoded.extend(handle.join().unwrap()?);
+            }
+            Ok(decoded)
+        })
+    }
+}
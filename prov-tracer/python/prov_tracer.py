@@ -0,0 +1,49 @@
+"""Markers and pause/resume for Python code running under prov-tracer.
+
+A ctypes shim over include/prov_tracer.h. When the tracer is not preloaded,
+every function here does nothing.
+
+    import prov_tracer
+    prov_tracer.mark("load data")
+    with prov_tracer.paused():
+        hot_loop()
+
+"""
+import contextlib
+import ctypes
+from typing import Callable, Iterator
+
+
+# The preloaded library is in the global namespace, which is what dlopen(NULL) searches.
+_process = ctypes.CDLL(None)
+
+
+def _function(name: str, *argtypes: type) -> Callable[..., None]:
+    try:
+        function = getattr(_process, name)
+    except AttributeError:
+        return lambda *args: None
+    function.argtypes = argtypes
+    function.restype = None
+    return function
+
+
+_mark = _function("prov_tracer_mark", ctypes.c_char_p)
+pause = _function("prov_tracer_pause")
+resume = _function("prov_tracer_resume")
+dump = _function("prov_tracer_dump")
+
+
+def mark(label: str) -> None:
+    """Record label in this thread's trace."""
+    _mark(label.encode(errors="surrogateescape"))
+
+
+@contextlib.contextmanager
+def paused() -> Iterator[None]:
+    """Do not trace this thread's I/O within the block."""
+    pause()
+    try:
+        yield
+    finally:
+        resume()
@@ -0,0 +1,39 @@
+/*
+ * The C API for applications (declared in include/prov_tracer.h; a Python
+ * shim is in python/prov_tracer.py).
+ *
+ * Markers are records in the calling thread's trace, so they are ordered with
+ * its I/O and let an analysis group provenance by application phase. Pausing
+ * is per thread and nests; a paused thread still records its markers, so the
+ * trace shows where the gap is.
+ */
+
+use std::sync::atomic::Ordering;
+use crate::globals::{TRACING, PAUSED};
+use crate::ProvLogger;
+
+/// Records label (a C string) in this thread's trace.
+#[no_mangle]
+pub unsafe extern "C" fn prov_tracer_mark(label: *const libc::c_char) {
+    if label.is_null() || !TRACING.load(Ordering::Relaxed) {
+        return;
+    }
+    let label = std::ffi::CStr::from_ptr(label);
+    // try_with: the logger is gone once this thread's destructors have run.
+    let _ = crate::CALL_LOGGER.try_with(|call_logger| {
+        if let Ok(mut call_logger) = call_logger.try_borrow_mut() {
+            call_logger.inner.prov_logger.mark(label);
+        }
+    });
+}
+
+/// Stops tracing this thread's calls until the matching prov_tracer_resume().
+#[no_mangle]
+pub extern "C" fn prov_tracer_pause() {
+    PAUSED.set(PAUSED.get() + 1);
+}
+
+#[no_mangle]
+pub extern "C" fn prov_tracer_resume() {
+    PAUSED.set(PAUSED.get().saturating_sub(1));
+}
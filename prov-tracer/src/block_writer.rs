@@ -0,0 +1,544 @@
+/*
+ * Buffers trace output in blocks and hands full blocks to a per-process
+ * flusher thread, which compresses and writes them (see trace_format).
+ *
+ * The application thread only ever copies bytes into its current block; it
+ * blocks only if FLUSH_QUEUE_DEPTH blocks are already waiting on the flusher.
+ *
+ * Where the kernel allows it, the flusher writes through io_uring: each block
+ * is encoded into one of POOL_SIZE registered buffers and submitted as a
+ * WRITE_FIXED, and the buffer returns to the pool when the write completes.
+ * So the flusher only waits on the filesystem when every buffer is in flight.
+ * Otherwise (old kernel, seccomp, PROV_TRACER_IO=pwrite) it uses pwrite.
+ *
+ * Writes are positional, so a forked child starts its own trace file rather
+ * than sharing its parent's. An exec'd image carries on its predecessor's
+ * file instead of truncating it (see exec).
+ *
+ * A block that cannot be written (a full disk, say) is counted as dropped
+ * records (see counters), and tracing carries on; if io_uring itself fails,
+ * the flusher finishes what it had in flight with pwrite, and keeps to it.
+ * So are all of a thread's records if its file cannot be created (a read-only
+ * directory, no file descriptors left), with a warning on stderr the first
+ * time in each process.
+ *
+ * Configuration (read once per process):
+ *   PROV_TRACER_FILE        = file name; %p is the pid, %t the thread id (default %p.%t.prov_trace)
+ *   PROV_TRACER_COMPRESSION = zstd (default) | none
+ *   PROV_TRACER_ZSTD_LEVEL  = zstd level (default 1)
+ *   PROV_TRACER_ZSTD_DICT   = builtin (default) | none | path of a dictionary file
+ *   PROV_TRACER_IO          = uring (default) | pwrite
+ *   PROV_TRACER_FSYNC       = 1 to fdatasync at checkpoints (a thread's final flush); default 0
+ */
+
+use std::io::Write;
+use std::os::fd::AsRawFd;
+use std::os::unix::fs::FileExt;
+use std::sync::{Arc, Mutex, MutexGuard, OnceLock};
+use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+use std::sync::mpsc;
+use crate::uring;
+
+const BLOCK_SIZE: usize = 64 * 1024;
+const FLUSH_QUEUE_DEPTH: usize = 64;
+/// Registered buffers count against RLIMIT_MEMLOCK, so keep the pool small.
+const POOL_SIZE: usize = 8;
+/// Blocks are cut at the first end of line past BLOCK_SIZE, so they are
+/// usually just over it; larger ones bypass the pool.
+const MAX_POOLED_BLOCK: usize = 2 * BLOCK_SIZE;
+/// Tags the user_data of a checkpoint's fsync, to tell it from the write it is linked to.
+const FSYNC_TAG: u64 = 1 << 32;
+
+struct Config {
+    compression: trace_format::Compression,
+    level: i32,
+    dictionary: Option<Vec<u8>>,
+    io_uring: bool,
+    fsync: bool,
+}
+
+fn config() -> &'static Config {
+    static CONFIG: OnceLock<Config> = OnceLock::new();
+    CONFIG.get_or_init(|| Config {
+        compression: match std::env::var("PROV_TRACER_COMPRESSION").as_deref() {
+            Ok("none") => trace_format::Compression::None,
+            _ => trace_format::Compression::Zstd,
+        },
+        level: std::env::var("PROV_TRACER_ZSTD_LEVEL").ok().and_then(|level| level.parse().ok()).unwrap_or(1),
+        dictionary: trace_format::load_dictionary(
+            std::env::var("PROV_TRACER_ZSTD_DICT").as_deref().unwrap_or("builtin")
+        ).unwrap(),
+        io_uring: std::env::var("PROV_TRACER_IO").as_deref() != Ok("pwrite"),
+        fsync: std::env::var("PROV_TRACER_FSYNC").as_deref() == Ok("1"),
+    })
+}
+
+struct TraceFile {
+    file: std::fs::File,
+    /// Where the next block goes; only the flusher advances this.
+    offset: AtomicU64,
+}
+
+impl TraceFile {
+    fn reserve(&self, len: usize) -> u64 {
+        self.offset.fetch_add(len as u64, Ordering::Relaxed)
+    }
+}
+
+struct FlushRequest {
+    file: Arc<TraceFile>,
+    block: Vec<u8>,
+    /// Records in block, to count if it is lost
+    records: u64,
+    /// Signalled once this block, and every block before it, is on disk
+    done: Option<mpsc::SyncSender<()>>,
+}
+
+/// The flusher thread, once started; the thread does not survive fork, so fork::child() forgets it.
+static FLUSHER: Mutex<Option<mpsc::SyncSender<FlushRequest>>> = Mutex::new(None);
+
+/// Spent blocks, handed back by the flusher so application threads need not allocate new ones.
+static FREE_BLOCKS: Mutex<Vec<Vec<u8>>> = Mutex::new(Vec::new());
+
+fn lock<T>(mutex: &'static Mutex<T>) -> MutexGuard<'static, T> {
+    mutex.lock().unwrap_or_else(|poisoned| poisoned.into_inner())
+}
+
+/// FLUSHER and FREE_BLOCKS, held across a fork (see fork)
+pub struct ForkLock(MutexGuard<'static, Option<mpsc::SyncSender<FlushRequest>>>, MutexGuard<'static, Vec<Vec<u8>>>);
+
+pub fn lock_for_fork() -> ForkLock {
+    ForkLock(lock(&FLUSHER), lock(&FREE_BLOCKS))
+}
+
+impl ForkLock {
+    /// In the child, which has no flusher thread
+    pub fn reset(mut self) {
+        // Leaked, not dropped: the parent's flusher may have been inside the channel when we forked.
+        std::mem::forget(self.0.take());
+    }
+}
+
+/// A sender to this process's flusher thread, starting it if need be; None if it cannot be started.
+fn flusher() -> Option<mpsc::SyncSender<FlushRequest>> {
+    let mut flusher = lock(&FLUSHER);
+    if flusher.is_none() {
+        let (sender, receiver) = mpsc::sync_channel::<FlushRequest>(FLUSH_QUEUE_DEPTH);
+        std::thread::Builder::new()
+            .name("prov-flusher".to_string())
+            .spawn(move || flush_loop(receiver))
+            .ok()?;
+        *flusher = Some(sender);
+    }
+    flusher.clone()
+}
+
+fn new_block() -> Vec<u8> {
+    lock(&FREE_BLOCKS).pop().unwrap_or_else(|| Vec::with_capacity(BLOCK_SIZE))
+}
+
+fn recycle_block(mut block: Vec<u8>) {
+    let mut free_blocks = lock(&FREE_BLOCKS);
+    if free_blocks.len() < FLUSH_QUEUE_DEPTH {
+        block.clear();
+        free_blocks.push(block);
+    }
+}
+
+/// Retires a request, whether or not its block was written.
+fn finish(request: FlushRequest, written: bool) {
+    if !written {
+        crate::counters::count_dropped(request.records);
+    }
+    crate::counters::count_buffered(-(request.block.len() as isize));
+    if let Some(done) = request.done {
+        let _ = done.send(());
+    }
+    recycle_block(request.block);
+}
+
+fn flush_loop(receiver: mpsc::Receiver<FlushRequest>) {
+    let config = config();
+    let mut encoder = match trace_format::BlockEncoder::new(config.compression, config.level, config.dictionary.as_deref()) {
+        Ok(encoder) => encoder,
+        Err(_) => {
+            for request in receiver {
+                finish(request, false);
+            }
+            return;
+        },
+    };
+    let mut uring = if config.io_uring { UringWriter::new().ok() } else { None };
+    let mut encoded = Vec::with_capacity(BLOCK_SIZE);
+    loop {
+        if uring.as_ref().is_some_and(|ring| ring.failed) {
+            uring.take().unwrap().abandon();
+        }
+        let request = match &mut uring {
+            // Reap completions while nothing new is queued, so buffers go back to the pool.
+            Some(ring) if ring.busy() => match receiver.try_recv() {
+                Ok(request) => request,
+                Err(mpsc::TryRecvError::Empty) => {
+                    let _ = ring.reap(true);
+                    continue;
+                },
+                Err(mpsc::TryRecvError::Disconnected) => break,
+            },
+            _ => match receiver.recv() {
+                Ok(request) => request,
+                Err(_) => break,
+            },
+        };
+        if request.block.is_empty() {
+            // Just a checkpoint, for the blocks before it
+            if let Some(ring) = &mut uring {
+                let _ = ring.drain();
+            }
+            if uring.as_ref().is_some_and(|ring| ring.failed) {
+                uring.take().unwrap().abandon();
+            }
+            if config.fsync {
+                let _ = request.file.file.sync_data();
+            }
+            finish(request, true);
+            continue;
+        }
+        // None if the ring did not take the block
+        let mut written = None;
+        match &mut uring {
+            Some(ring) if request.block.len() <= MAX_POOLED_BLOCK => written = ring.write(&mut encoder, &request, config.fsync).ok(),
+            // A checkpoint covers the pooled blocks before it too.
+            Some(ring) if request.done.is_some() => { let _ = ring.drain(); },
+            _ => {},
+        }
+        if uring.as_ref().is_some_and(|ring| ring.failed) {
+            uring.take().unwrap().abandon();
+        }
+        let written = written.unwrap_or_else(|| write_at(&mut encoder, &mut encoded, &request, config.fsync));
+        finish(request, written);
+    }
+}
+
+/// Encodes and writes a block with pwrite; false if it could not be.
+fn write_at(encoder: &mut trace_format::BlockEncoder, encoded: &mut Vec<u8>, request: &FlushRequest, fsync: bool) -> bool {
+    encoded.clear();
+    if encoder.encode(&request.block, encoded).is_err() {
+        return false;
+    }
+    if request.file.file.write_all_at(encoded, request.file.reserve(encoded.len())).is_err() {
+        return false;
+    }
+    if fsync && request.done.is_some() {
+        let _ = request.file.file.sync_data();
+    }
+    true
+}
+
+struct InFlight {
+    /// Keeps the fd open until the kernel is done with it
+    file: Arc<TraceFile>,
+    offset: u64,
+    len: usize,
+    records: u64,
+    /// Completions still expected: the write, plus its fsync at a checkpoint
+    ops: u32,
+}
+
+struct UringWriter {
+    ring: uring::Uring,
+    /// Registered with the ring; never grown past their initial capacity, so they never move.
+    buffers: Vec<Vec<u8>>,
+    free: Vec<usize>,
+    in_flight: Vec<Option<InFlight>>,
+    /// io_uring_enter failed; the caller should abandon() the ring
+    failed: bool,
+}
+
+impl UringWriter {
+    fn new() -> std::io::Result<Self> {
+        let mut ring = uring::Uring::new(2 * POOL_SIZE as u32)?;
+        let capacity = trace_format::BlockEncoder::max_encoded_len(MAX_POOLED_BLOCK);
+        let buffers: Vec<Vec<u8>> = (0..POOL_SIZE).map(|_| Vec::with_capacity(capacity)).collect();
+        let iovecs: Vec<libc::iovec> = buffers.iter().map(|buffer| libc::iovec {
+            iov_base: buffer.as_ptr() as *mut libc::c_void,
+            iov_len: buffer.capacity(),
+        }).collect();
+        ring.register_buffers(&iovecs)?;
+        Ok(Self {
+            ring,
+            buffers,
+            free: (0..POOL_SIZE).rev().collect(),
+            in_flight: (0..POOL_SIZE).map(|_| None).collect(),
+            failed: false,
+        })
+    }
+
+    fn busy(&self) -> bool {
+        self.free.len() < POOL_SIZE
+    }
+
+    /// Submits the block and returns without waiting for it, unless it is a
+    /// checkpoint (request.done), which waits for it and everything before it.
+    /// Ok(false) if the block could not be encoded; Err if the ring failed
+    /// before taking it. Once taken, the block is written even if the ring
+    /// fails later (see abandon).
+    fn write(&mut self, encoder: &mut trace_format::BlockEncoder, request: &FlushRequest, fsync: bool) -> std::io::Result<bool> {
+        let checkpoint = request.done.is_some();
+        if checkpoint {
+            // Writes complete out of order, and an fsync only covers writes that completed before it.
+            self.drain()?;
+        }
+        let index = loop {
+            match self.free.pop() {
+                Some(index) => break index,
+                None => self.reap(true)?,
+            }
+        };
+        let buffer = &mut self.buffers[index];
+        buffer.clear();
+        if encoder.encode(&request.block, buffer).is_err() {
+            self.free.push(index);
+            return Ok(false);
+        }
+        debug_assert!(buffer.len() <= buffer.capacity());
+        let offset = request.file.reserve(buffer.len());
+        let fd = request.file.file.as_raw_fd();
+        let fsync = fsync && checkpoint;
+        assert!(self.ring.push(uring::Sqe {
+            opcode: uring::IORING_OP_WRITE_FIXED,
+            flags: if fsync { uring::IOSQE_IO_LINK } else { 0 },
+            fd,
+            off: offset,
+            addr: buffer.as_ptr() as u64,
+            len: buffer.len() as u32,
+            buf_index: index as u16,
+            user_data: index as u64,
+            ..Default::default()
+        }));
+        if fsync {
+            assert!(self.ring.push(uring::Sqe {
+                opcode: uring::IORING_OP_FSYNC,
+                fd,
+                op_flags: uring::IORING_FSYNC_DATASYNC,
+                user_data: FSYNC_TAG | index as u64,
+                ..Default::default()
+            }));
+        }
+        self.in_flight[index] = Some(InFlight {
+            file: request.file.clone(),
+            offset,
+            len: buffer.len(),
+            records: request.records,
+            ops: if fsync { 2 } else { 1 },
+        });
+        if self.ring.submit_and_wait(0).is_err() {
+            self.failed = true;
+        } else if checkpoint {
+            let _ = self.drain();
+        }
+        Ok(true)
+    }
+
+    fn drain(&mut self) -> std::io::Result<()> {
+        while self.busy() {
+            self.reap(true)?;
+        }
+        Ok(())
+    }
+
+    /// Handles available completions, first waiting for at least one if wait.
+    fn reap(&mut self, wait: bool) -> std::io::Result<()> {
+        if wait {
+            if let Err(err) = self.ring.submit_and_wait(1) {
+                self.failed = true;
+                return Err(err);
+            }
+        }
+        while let Some(cqe) = self.ring.pop() {
+            let index = (cqe.user_data & !FSYNC_TAG) as usize;
+            let in_flight = self.in_flight[index].as_mut().unwrap();
+            if cqe.user_data & FSYNC_TAG != 0 {
+                if cqe.res < 0 {
+                    // Includes -ECANCELED, when the write it was linked to came up short.
+                    let _ = in_flight.file.file.sync_data();
+                }
+            } else {
+                let written = cqe.res.max(0) as usize;
+                if written < in_flight.len {
+                    // Short or failed write (e.g. EINTR on NFS); finish it synchronously.
+                    let rest = in_flight.file.file.write_all_at(
+                        &self.buffers[index][written..in_flight.len],
+                        in_flight.offset + written as u64,
+                    );
+                    if rest.is_err() {
+                        crate::counters::count_dropped(in_flight.records);
+                    }
+                }
+            }
+            in_flight.ops -= 1;
+            if in_flight.ops == 0 {
+                self.in_flight[index] = None;
+                self.free.push(index);
+            }
+        }
+        Ok(())
+    }
+
+    /// Gives up on the ring: writes whatever is in flight synchronously
+    /// (rewriting the same bytes at the same offsets is harmless if the
+    /// kernel got to some of them), then closes the ring.
+    fn abandon(self) {
+        for (index, in_flight) in self.in_flight.iter().enumerate() {
+            if let Some(in_flight) = in_flight {
+                if in_flight.file.file.write_all_at(&self.buffers[index][..in_flight.len], in_flight.offset).is_err() {
+                    crate::counters::count_dropped(in_flight.records);
+                } else if in_flight.ops > 1 {
+                    let _ = in_flight.file.file.sync_data();
+                }
+            }
+        }
+    }
+}
+
+pub struct BlockWriter {
+    /// None if the file could not be created
+    file: Option<Arc<TraceFile>>,
+    block: Vec<u8>,
+    /// Records in block
+    records: u64,
+    /// fork::forks() when the file was created
+    forks: u64,
+    /// Whether blocks have been shipped since the last flush, which may still be queued
+    unflushed: bool,
+}
+
+impl BlockWriter {
+    /// Creates this thread's trace file (see PROV_TRACER_FILE), or if it cannot, warns (once per process) and drops its records.
+    /// The caller must have tracing disabled, since this opens a file.
+    pub fn create() -> Self {
+        static WARNED: AtomicBool = AtomicBool::new(false);
+        let filename =
+            std::env::var("PROV_TRACER_FILE")
+            .unwrap_or("%p.%t.prov_trace".to_string())
+            .replace("%p", std::process::id().to_string().as_str())
+            .replace("%t", std::thread::current().id().as_u64().to_string().as_str());
+        if crate::exec::resumes_after_exec() {
+            // Carry on after what the image before exec flushed here, if it is ours to extend.
+            if let Ok(mut file) = std::fs::OpenOptions::new().read(true).write(true).open(&filename) {
+                let header = trace_format::Header::read_from(&mut file);
+                if header.is_ok_and(|header| header == Self::header()) {
+                    if let Ok(end) = file.metadata().map(|metadata| metadata.len()) {
+                        return Self::resume(file, end);
+                    }
+                }
+            }
+        }
+        match std::fs::File::create(&filename) {
+            Ok(file) => Self::new(file),
+            Err(err) => {
+                if !WARNED.swap(true, Ordering::Relaxed) {
+                    eprintln!("prov-tracer: cannot create {} ({}); dropping trace records", filename, err);
+                }
+                Self { file: None, block: Vec::new(), records: 0, forks: crate::fork::forks(), unflushed: false }
+            },
+        }
+    }
+
+    fn header() -> trace_format::Header {
+        let config = config();
+        trace_format::Header {
+            compression: config.compression,
+            dictionary_hash: config.dictionary.as_deref().map(trace_format::dictionary_hash).unwrap_or(0),
+        }
+    }
+
+    pub fn new(mut file: std::fs::File) -> Self {
+        // If even the header cannot be written (a full disk), the blocks will fail too, and be counted as dropped.
+        let _ = trace_format::write_header(&mut file, &Self::header());
+        Self::resume(file, trace_format::HEADER_SIZE as u64)
+    }
+
+    /// Writes blocks into file from offset on.
+    fn resume(file: std::fs::File, offset: u64) -> Self {
+        Self {
+            file: Some(Arc::new(TraceFile { file, offset: AtomicU64::new(offset) })),
+            block: new_block(),
+            records: 0,
+            forks: crate::fork::forks(),
+            unflushed: false,
+        }
+    }
+
+    fn ship(&mut self, wait: bool) {
+        let Some(file) = &self.file else { return };
+        let (done_sender, done_receiver) = mpsc::sync_channel(1);
+        let request = FlushRequest {
+            file: file.clone(),
+            block: std::mem::replace(&mut self.block, new_block()),
+            records: std::mem::take(&mut self.records),
+            done: if wait { Some(done_sender) } else { None },
+        };
+        self.unflushed = !wait;
+        let sent = match flusher() {
+            Some(flusher) => flusher.send(request).map_err(|mpsc::SendError(request)| request),
+            None => Err(request),
+        };
+        match sent {
+            Ok(()) => if wait {
+                let _ = done_receiver.recv();
+            },
+            Err(request) => {
+                // The flusher died; forget it, so the next block starts another.
+                *lock(&FLUSHER) = None;
+                finish(request, false);
+            },
+        }
+    }
+}
+
+impl Write for BlockWriter {
+    fn write(&mut self, buf: &[u8]) -> std::io::Result<usize> {
+        if self.forks != crate::fork::forks() {
+            // We are a forked child; the parent still holds (and will flush)
+            // the bytes in our block, and owns the offsets in its file.
+            // Replacing self drops the inherited writer without flushing it (see Drop).
+            let enable_trace = crate::globals::ENABLE_TRACE.replace(false);
+            *self = Self::create();
+            crate::globals::ENABLE_TRACE.set(enable_trace);
+        }
+        if self.file.is_none() {
+            if buf.ends_with(b"\n") {
+                crate::counters::count_dropped(1);
+            }
+            return Ok(buf.len());
+        }
+        self.block.extend_from_slice(buf);
+        crate::counters::count_buffered(buf.len() as isize);
+        if buf.ends_with(b"\n") {
+            self.records += 1;
+            // Only cut blocks at the end of a record, so each block decodes to whole lines.
+            if self.block.len() >= BLOCK_SIZE {
+                self.ship(false);
+            }
+        }
+        Ok(buf.len())
+    }
+
+    fn flush(&mut self) -> std::io::Result<()> {
+        // An inherited writer is the parent's to flush.
+        // An empty block still waits for the blocks shipped before it (exec would cancel them).
+        if self.forks == crate::fork::forks() && (self.unflushed || !self.block.is_empty()) {
+            self.ship(true);
+        }
+        Ok(())
+    }
+}
+
+impl Drop for BlockWriter {
+    fn drop(&mut self) {
+        // Runs from thread-local destructors, including the main thread's at exit();
+        // exec and _exit flush the calling thread's writer first (see exec).
+        // Blocks still in memory at a fatal signal are lost.
+        let _ = self.flush();
+    }
+}
@@ -0,0 +1,184 @@
+/*
+ * Hands trace output to a prov-collector daemon through a shared-memory ring
+ * (see trace_format::shm_ring), instead of writing a file per thread. Useful
+ * where the tracee cannot write files (read-only root), and it leaves one
+ * compacted trace for the whole process tree instead of thousands of files.
+ *
+ * Each thread connects once; after that a record costs a memcpy and a
+ * release store. If the ring is full, the thread waits for the collector; if
+ * the collector has gone away, records are dropped. So are all of a thread's
+ * records if it cannot connect at all (no collector listening, say), with a
+ * warning on stderr the first time in each process; the tracee runs on.
+ *
+ * Configuration (read once per process):
+ *   PROV_TRACER_MODE   = collector
+ *   PROV_TRACER_SOCKET = path of the collector's socket (see prov-collector)
+ */
+
+use std::io::Write;
+use std::os::fd::{AsRawFd, FromRawFd, OwnedFd};
+use std::sync::atomic::{AtomicBool, Ordering};
+use trace_format::shm_ring::ShmRing;
+
+/// How long to sleep between checks of a full ring
+const FULL_RING_SLEEP_NS: libc::c_long = 100_000;
+
+pub fn enabled() -> bool {
+    static ENABLED: std::sync::OnceLock<bool> = std::sync::OnceLock::new();
+    *ENABLED.get_or_init(|| std::env::var("PROV_TRACER_MODE").as_deref() == Ok("collector"))
+}
+
+pub struct CollectorWriter {
+    /// None if this thread could not connect
+    connection: Option<Connection>,
+    /// fork::forks() when this was made
+    forks: u64,
+}
+
+impl CollectorWriter {
+    /// Connects this thread to the collector, or if it cannot, warns (once per process) and drops its records.
+    /// The caller must have tracing disabled, since this opens a socket.
+    pub fn connect() -> Self {
+        static WARNED: AtomicBool = AtomicBool::new(false);
+        let connection = Connection::connect()
+            .inspect_err(|err| if !WARNED.swap(true, Ordering::Relaxed) {
+                eprintln!("prov-tracer: cannot connect to prov-collector ({}); dropping trace records", err);
+            })
+            .ok();
+        Self { connection, forks: crate::fork::forks() }
+    }
+}
+
+struct Connection {
+    socket: std::os::unix::net::UnixStream,
+    ring: ShmRing,
+    map_len: usize,
+    /// Where the next byte goes; published at the end of each record
+    position: u64,
+    /// The collector hung up
+    closed: bool,
+    /// Part of the current record was dropped, so the rest must be too
+    dropping: bool,
+}
+
+impl Connection {
+    fn connect() -> std::io::Result<Self> {
+        let socket_path = std::env::var("PROV_TRACER_SOCKET")
+            .map_err(|_| std::io::Error::other("PROV_TRACER_MODE=collector needs PROV_TRACER_SOCKET"))?;
+        let mut socket = std::os::unix::net::UnixStream::connect(socket_path)?;
+        writeln!(socket, "{} {}", std::process::id(), std::thread::current().id().as_u64())?;
+        let memfd = receive_fd(&socket)?;
+        let mut stat: libc::stat = unsafe { std::mem::zeroed() };
+        if unsafe { libc::fstat(memfd.as_raw_fd(), &mut stat) } != 0 {
+            return Err(std::io::Error::last_os_error());
+        }
+        let map_len = stat.st_size as usize;
+        let base = unsafe {
+            libc::mmap(std::ptr::null_mut(), map_len, libc::PROT_READ | libc::PROT_WRITE, libc::MAP_SHARED, memfd.as_raw_fd(), 0)
+        };
+        if base == libc::MAP_FAILED {
+            return Err(std::io::Error::last_os_error());
+        }
+        let ring = unsafe { ShmRing::from_raw(base as *mut u8, map_len) };
+        Ok(Self { position: ring.written(), socket, ring, map_len, closed: false, dropping: false })
+    }
+
+    /// Waits until the ring has room for len more bytes; false if it never will.
+    fn wait_for_room(&mut self, len: usize) -> bool {
+        // The unpublished part of the current record has to fit too.
+        if (self.position - self.ring.written()) as usize + len > self.ring.capacity() {
+            return false;
+        }
+        while self.position + len as u64 - self.ring.consumed() > self.ring.capacity() as u64 {
+            if self.closed || self.collector_gone() {
+                self.closed = true;
+                return false;
+            }
+            let sleep = libc::timespec { tv_sec: 0, tv_nsec: FULL_RING_SLEEP_NS };
+            unsafe { libc::nanosleep(&sleep, std::ptr::null_mut()) };
+        }
+        true
+    }
+
+    fn collector_gone(&self) -> bool {
+        let mut poll_fd = libc::pollfd { fd: self.socket.as_raw_fd(), events: libc::POLLIN, revents: 0 };
+        // The collector never sends after the ring, so readable means end of file.
+        let ready = unsafe { libc::poll(&mut poll_fd, 1, 0) };
+        ready != 0 && poll_fd.revents & (libc::POLLHUP | libc::POLLERR | libc::POLLIN) != 0
+    }
+}
+
+/// Receives the memfd the collector sends in reply to the greeting.
+fn receive_fd(socket: &std::os::unix::net::UnixStream) -> std::io::Result<OwnedFd> {
+    let mut byte = [0u8; 1];
+    let mut iov = libc::iovec { iov_base: byte.as_mut_ptr() as *mut libc::c_void, iov_len: 1 };
+    let mut control = [0u64; 8];
+    let mut message: libc::msghdr = unsafe { std::mem::zeroed() };
+    message.msg_iov = &mut iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.as_mut_ptr() as *mut libc::c_void;
+    message.msg_controllen = std::mem::size_of_val(&control);
+    if unsafe { libc::recvmsg(socket.as_raw_fd(), &mut message, libc::MSG_CMSG_CLOEXEC) } <= 0 {
+        return Err(std::io::Error::other("prov-collector closed the connection"));
+    }
+    unsafe {
+        let cmsg = libc::CMSG_FIRSTHDR(&message);
+        if cmsg.is_null() || (*cmsg).cmsg_level != libc::SOL_SOCKET || (*cmsg).cmsg_type != libc::SCM_RIGHTS {
+            return Err(std::io::Error::other("prov-collector did not send a ring"));
+        }
+        Ok(OwnedFd::from_raw_fd(std::ptr::read_unaligned(libc::CMSG_DATA(cmsg) as *const libc::c_int)))
+    }
+}
+
+impl Write for CollectorWriter {
+    fn write(&mut self, buf: &[u8]) -> std::io::Result<usize> {
+        if self.forks != crate::fork::forks() {
+            // A forked child needs its own ring; dropping the inherited connection only unmaps our copy.
+            let enable_trace = crate::globals::ENABLE_TRACE.replace(false);
+            *self = Self::connect();
+            crate::globals::ENABLE_TRACE.set(enable_trace);
+        }
+        match &mut self.connection {
+            Some(connection) => connection.write(buf),
+            None => {
+                if buf.ends_with(b"\n") {
+                    crate::counters::count_dropped(1);
+                }
+                Ok(buf.len())
+            },
+        }
+    }
+
+    fn flush(&mut self) -> std::io::Result<()> {
+        // Records are published as they are written; the collector persists them.
+        Ok(())
+    }
+}
+
+impl Connection {
+    fn write(&mut self, buf: &[u8]) -> std::io::Result<usize> {
+        if self.dropping || !self.wait_for_room(buf.len()) {
+            // Drop the whole record rather than publish part of it.
+            if !self.dropping {
+                crate::counters::count_dropped(1);
+            }
+            self.position = self.ring.written();
+            self.dropping = !buf.ends_with(b"\n");
+            return Ok(buf.len());
+        }
+        self.ring.put(self.position, buf);
+        self.position += buf.len() as u64;
+        if buf.ends_with(b"\n") {
+            self.ring.publish(self.position);
+        }
+        Ok(buf.len())
+    }
+}
+
+impl Drop for Connection {
+    fn drop(&mut self) {
+        // Closing the socket (here, or by the kernel at _exit or a crash) tells
+        // the collector to drain the ring and retire it.
+        unsafe { libc::munmap(self.ring.base() as *mut libc::c_void, self.map_len) };
+    }
+}
@@ -0,0 +1,51 @@
+/*
+ * Runtime attach/detach, so a long-lived process (a server, say) can keep the
+ * tracer preloaded and be traced only during some window.
+ *
+ * The toggle signal attaches a detached process at once. Detaching is done by
+ * the next traced call of any thread, outside the signal handler: it flushes
+ * that thread's trace and clears globals::TRACING. Other threads' unshipped
+ * records stay buffered until they exit or trace again.
+ *
+ * Configuration (read once, when the library is loaded):
+ *   PROV_TRACER_START         = on (default) | off, to load detached
+ *   PROV_TRACER_TOGGLE_SIGNAL = signal number which toggles tracing (default 0, none;
+ *                               SIGUSR1 is taken by nginx and Apache)
+ */
+
+use std::sync::atomic::Ordering;
+use crate::globals::{TRACING, DETACH_REQUESTED};
+
+extern "C" fn toggle(_signal: libc::c_int) {
+    if TRACING.load(Ordering::Relaxed) && !DETACH_REQUESTED.load(Ordering::Relaxed) {
+        DETACH_REQUESTED.store(true, Ordering::Relaxed);
+    } else {
+        DETACH_REQUESTED.store(false, Ordering::Relaxed);
+        TRACING.store(true, Ordering::Relaxed);
+    }
+}
+
+/// Serves a pending detach; file is the calling thread's trace.
+pub fn detach_if_requested(file: &mut impl std::io::Write) {
+    if DETACH_REQUESTED.swap(false, Ordering::Relaxed) {
+        TRACING.store(false, Ordering::Relaxed);
+        let enable_trace = crate::globals::ENABLE_TRACE.replace(false);
+        let _ = file.flush();
+        crate::globals::ENABLE_TRACE.set(enable_trace);
+    }
+}
+
+extern "C" fn init() {
+    if std::env::var("PROV_TRACER_START").as_deref() == Ok("off") {
+        TRACING.store(false, Ordering::Relaxed);
+    }
+    let signal = std::env::var("PROV_TRACER_TOGGLE_SIGNAL").ok().and_then(|signal| signal.parse().ok()).unwrap_or(0);
+    if signal != 0 {
+        crate::util::set_signal_handler(signal, toggle, libc::SA_RESTART);
+    }
+}
+
+// Runs when the library is loaded, before any hook can, so a process started detached never touches its logger.
+#[used]
+#[link_section = ".init_array"]
+static INIT: extern "C" fn() = init;
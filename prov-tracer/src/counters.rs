@@ -0,0 +1,130 @@
+/*
+ * Publishes this process's counters (see trace_format::counters) in shared
+ * memory, for prov-top. The page is created when the library is loaded (and
+ * again in each forked child) and unlinked at exit; after that, counting is
+ * plain atomic adds, with no system calls.
+ *
+ * Configuration (read once, when the library is loaded):
+ *   PROV_TRACER_COUNTERS = 1 to publish counters (default 0)
+ */
+
+use std::sync::atomic::{AtomicPtr, Ordering};
+use trace_format::counters::{Counters, COUNTERS_MAGIC};
+
+static COUNTERS: AtomicPtr<Counters> = AtomicPtr::new(std::ptr::null_mut());
+
+#[inline]
+pub fn get() -> Option<&'static Counters> {
+    unsafe { COUNTERS.load(Ordering::Relaxed).as_ref() }
+}
+
+#[inline]
+pub fn count_event(op: usize) {
+    if let Some(counters) = get() {
+        counters.events[op].fetch_add(1, Ordering::Relaxed);
+    }
+}
+
+/// Adds (or with a negative delta, subtracts) bytes held in memory.
+#[inline]
+pub fn count_buffered(delta: isize) {
+    if let Some(counters) = get() {
+        counters.buffered_bytes.fetch_add(delta as u64, Ordering::Relaxed);
+    }
+}
+
+#[inline]
+pub fn count_dropped(records: u64) {
+    if let Some(counters) = get() {
+        counters.dropped.fetch_add(records, Ordering::Relaxed);
+    }
+}
+
+fn shm_name() -> std::ffi::CString {
+    std::ffi::CString::new(trace_format::counters::shm_name(std::process::id())).unwrap()
+}
+
+extern "C" fn publish() {
+    let size = std::mem::size_of::<Counters>();
+    unsafe {
+        let fd = libc::shm_open(shm_name().as_ptr(), libc::O_CREAT | libc::O_TRUNC | libc::O_RDWR | libc::O_CLOEXEC, 0o644);
+        if fd < 0 {
+            return;
+        }
+        let base = if libc::ftruncate(fd, size as libc::off_t) == 0 {
+            libc::mmap(std::ptr::null_mut(), size, libc::PROT_READ | libc::PROT_WRITE, libc::MAP_SHARED, fd, 0)
+        } else {
+            libc::MAP_FAILED
+        };
+        libc::close(fd);
+        if base == libc::MAP_FAILED {
+            COUNTERS.store(std::ptr::null_mut(), Ordering::Relaxed);
+            return;
+        }
+        let counters = &*(base as *const Counters);
+        counters.pid.store(std::process::id() as u64, Ordering::Relaxed);
+        counters.magic.store(COUNTERS_MAGIC, Ordering::Release);
+        COUNTERS.store(base as *mut Counters, Ordering::Relaxed);
+    }
+}
+
+extern "C" fn unpublish() {
+    if get().is_some() {
+        unsafe { libc::shm_unlink(shm_name().as_ptr()) };
+    }
+}
+
+extern "C" fn init() {
+    if std::env::var("PROV_TRACER_COUNTERS").as_deref() == Ok("1") {
+        publish();
+        unsafe {
+            // A forked child gets its own page; the parent's stays mapped, but is no longer written.
+            libc::pthread_atfork(None, None, Some(publish));
+            libc::atexit(unpublish);
+        }
+    }
+}
+
+#[used]
+#[link_section = ".init_array"]
+static INIT: extern "C" fn() = init;
+
+/// Measures the time a traced call spends outside the real function.
+pub struct HookTimer {
+    counters: Option<&'static Counters>,
+    since: u64,
+    spent: u64,
+}
+
+impl HookTimer {
+    #[inline]
+    pub fn start() -> Self {
+        let counters = get();
+        Self { counters, since: if counters.is_some() { crate::util::timestamp_ns() } else { 0 }, spent: 0 }
+    }
+
+    /// Call before the real function.
+    #[inline]
+    pub fn pause(&mut self) {
+        if self.counters.is_some() {
+            self.spent += crate::util::timestamp_ns() - self.since;
+        }
+    }
+
+    /// Call after the real function.
+    #[inline]
+    pub fn resume(&mut self) {
+        if self.counters.is_some() {
+            self.since = crate::util::timestamp_ns();
+        }
+    }
+
+    #[inline]
+    pub fn stop(mut self) {
+        self.pause();
+        if let Some(counters) = self.counters {
+            counters.hook_calls.fetch_add(1, Ordering::Relaxed);
+            counters.hook_ns.fetch_add(self.spent, Ordering::Relaxed);
+        }
+    }
+}
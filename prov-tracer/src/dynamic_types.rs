@@ -31,4 +31,5 @@ pub enum CPrimType {
     Ftw64FuncT,
     NftwFuncT,
     Nftw64FuncT,
+    Struct,
 }
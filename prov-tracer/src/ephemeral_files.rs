@@ -0,0 +1,419 @@
+/*
+ * Elides files that are created and deleted within the traced run, such as
+ * the temporaries of builds and benchmarks like Postmark. For provenance
+ * they are noise, yet their opens, closes and stats can dominate a trace.
+ *
+ * A file's lifetime starts when this thread creates or truncates it (open
+ * for Overwrite) and ends when this thread unlinks it, or renames another
+ * file over it. While any such file is live, the thread's records are held
+ * in order instead of written, and those naming the file (or an fd opened
+ * on it) are remembered. When its lifetime ends, they are removed, along
+ * with the unlink, and by policy replaced with
+ *
+ *   TS ephemeral file: (DIRFD "path") created: TS records: N
+ *
+ * The same bookkeeping folds the atomic-replace idiom of editors, pip and
+ * the like, writing foo.tmpXXXX and renaming it over foo: when a live file
+ * is renamed, its records so far and the Move are replaced with
+ *
+ *   TS wrote file: (DIRFD "foo") created: TS records: N
+ *
+ * so the temporary name never reaches the trace. The file stays live under
+ * its new name (and so may still turn out to be ephemeral).
+ *
+ * Records are held for at most PROV_TRACER_EPHEMERAL_MS, and at most
+ * MAX_HELD_BYTES of them; once one of a file's records is written, the file
+ * can no longer be elided. Files are known by (dirfd, path) as the program
+ * spelled them, and only within one thread, so a file that one process
+ * writes and another deletes (like gcc's /tmp/cc*.s) is not elided. Held
+ * records are not in a flight recorder's ring until they are released.
+ *
+ * Configuration (read once per process):
+ *   PROV_TRACER_EPHEMERAL    = record (default) to log each elided file as one record,
+ *                              drop to leave no trace of it, or off (which also stops
+ *                              folding renames)
+ *   PROV_TRACER_EPHEMERAL_MS = how long records may be held (default 1000)
+ */
+
+use std::collections::{HashMap, VecDeque};
+use std::io::Write;
+use std::rc::Rc;
+
+const MAX_HELD_BYTES: usize = 8 << 20;
+
+#[derive(Clone, Copy, PartialEq)]
+enum Policy {
+    Record,
+    Drop,
+    Off,
+}
+
+struct Config {
+    policy: Policy,
+    window_ns: u64,
+}
+
+fn config() -> &'static Config {
+    static CONFIG: std::sync::OnceLock<Config> = std::sync::OnceLock::new();
+    CONFIG.get_or_init(|| Config {
+        policy: match std::env::var("PROV_TRACER_EPHEMERAL").as_deref() {
+            Ok("drop") => Policy::Drop,
+            Ok("off") => Policy::Off,
+            _ => Policy::Record,
+        },
+        window_ns: std::env::var("PROV_TRACER_EPHEMERAL_MS").ok().and_then(|ms| ms.parse::<u64>().ok()).unwrap_or(1000) * 1_000_000,
+    })
+}
+
+struct Live {
+    id: u64,
+    dirfd: libc::c_int,
+    created: u64,
+    /// Sequence numbers of its held records
+    records: Vec<u64>,
+}
+
+struct Held {
+    timestamp: u64,
+    /// Id of the live file it names
+    file: Option<u64>,
+    /// None once elided
+    record: Option<Vec<u8>>,
+}
+
+/// Writes records to inner, except those of files that turn out to be ephemeral.
+pub struct EphemeralFiles<W: Write> {
+    inner: W,
+    /// Live files, by name
+    live: HashMap<Rc<[u8]>, Live>,
+    /// Names of live files, by id
+    names: HashMap<u64, Rc<[u8]>>,
+    next_id: u64,
+    /// Which live file each fd of this thread is open on
+    fds: HashMap<libc::c_int, u64>,
+    held: VecDeque<Held>,
+    /// Sequence number of held[0]
+    first_seq: u64,
+    held_bytes: usize,
+    /// The record being written, while holding
+    partial: Vec<u8>,
+    /// The live file the next record names
+    next_file: Option<u64>,
+    /// fork::forks() as of the last record
+    forks: u64,
+}
+
+impl<W: Write> EphemeralFiles<W> {
+    pub fn new(inner: W) -> Self {
+        Self {
+            inner,
+            live: HashMap::new(),
+            names: HashMap::new(),
+            next_id: 0,
+            fds: HashMap::new(),
+            held: VecDeque::new(),
+            first_seq: 0,
+            held_bytes: 0,
+            partial: Vec::new(),
+            next_file: None,
+            forks: crate::fork::forks(),
+        }
+    }
+
+    fn holding(&mut self) -> bool {
+        if !self.live.is_empty() && self.forks != crate::fork::forks() {
+            // A forked child: what we hold is the parent's, and so are its files.
+            self.forget_live();
+            self.held.clear();
+            self.held_bytes = 0;
+            self.forks = crate::fork::forks();
+        }
+        !self.live.is_empty()
+    }
+
+    fn forget_live(&mut self) {
+        self.live.clear();
+        self.names.clear();
+        self.fds.clear();
+        self.next_file = None;
+    }
+
+    fn live_file(&self, dirfd: libc::c_int, path: &[u8]) -> Option<u64> {
+        self.live.get(path).filter(|live| live.dirfd == dirfd).map(|live| live.id)
+    }
+
+    /// The next record creates or truncates path, open as fd.
+    pub fn created(&mut self, dirfd: libc::c_int, path: &[u8], fd: libc::c_int, timestamp: u64) {
+        if config().policy == Policy::Off {
+            return;
+        }
+        self.holding();
+        let id = match self.live_file(dirfd, path) {
+            Some(id) => id,
+            None => {
+                let id = self.next_id;
+                self.next_id += 1;
+                let name: Rc<[u8]> = path.into();
+                self.names.insert(id, name.clone());
+                self.live.insert(name, Live { id, dirfd, created: timestamp, records: Vec::new() });
+                id
+            },
+        };
+        self.fds.insert(fd, id);
+        self.next_file = Some(id);
+    }
+
+    /// The next record names path, and opens it as fd if any.
+    pub fn touched(&mut self, dirfd: libc::c_int, path: &[u8], fd: Option<libc::c_int>) {
+        if self.holding() {
+            self.next_file = self.live_file(dirfd, path);
+            if let (Some(id), Some(fd)) = (self.next_file, fd) {
+                self.fds.insert(fd, id);
+            }
+        }
+    }
+
+    /// The next record closes fd.
+    pub fn closed(&mut self, fd: libc::c_int) {
+        if self.holding() {
+            self.next_file = self.fds.remove(&fd);
+        }
+    }
+
+    /// The next record duplicates old as new.
+    pub fn duped(&mut self, old: libc::c_int, new: libc::c_int) {
+        if self.holding() {
+            self.next_file = self.fds.get(&old).copied();
+            if let Some(id) = self.next_file {
+                self.fds.insert(new, id);
+            }
+        }
+    }
+
+    /// path was unlinked; true if that ended a live file, whose records (this one included) are gone.
+    pub fn unlinked(&mut self, dirfd: libc::c_int, path: &std::ffi::CStr, timestamp: u64) -> bool {
+        if !self.holding() {
+            return false;
+        }
+        let Some(id) = self.live_file(dirfd, path.to_bytes()) else { return false };
+        self.elide(id, dirfd, path, timestamp, 1);
+        true
+    }
+
+    /// from was renamed to to; true if from was a live file, whose records (the rename included) were folded into one.
+    pub fn renamed(&mut self, dirfd0: libc::c_int, from: &[u8], dirfd1: libc::c_int, to: &std::ffi::CStr, timestamp: u64) -> bool {
+        if !self.holding() {
+            return false;
+        }
+        if let Some(id) = self.live_file(dirfd1, to.to_bytes()) {
+            // Whatever was there is gone.
+            self.elide(id, dirfd1, to, timestamp, 0);
+        }
+        let Some(id) = self.live_file(dirfd0, from) else { return false };
+        let mut live = self.live.remove(from).unwrap();
+        let folded = live.records.len() + 1;
+        self.drop_records(&live.records);
+        live.dirfd = dirfd1;
+        live.records.clear();
+        let created = live.created;
+        let name: Rc<[u8]> = to.to_bytes().into();
+        self.names.insert(id, name.clone());
+        self.live.insert(name, live);
+        self.next_file = Some(id);
+        let record = format!("{} wrote file: ({:?} {:?}) created: {} records: {}\n", timestamp, dirfd1, to, created, folded);
+        self.hold(record.into_bytes());
+        true
+    }
+
+    /// The files at from and to were swapped; both live on, so neither can be elided.
+    pub fn exchanged(&mut self, dirfd0: libc::c_int, from: &[u8], dirfd1: libc::c_int, to: &[u8]) {
+        if self.holding() {
+            for id in [self.live_file(dirfd0, from), self.live_file(dirfd1, to)].into_iter().flatten() {
+                self.escape(id);
+            }
+            self.release_if_idle();
+        }
+    }
+
+    /// Ends a file's lifetime; ending_records is how many records doing so took (an unlink's, but not a rename's).
+    fn elide(&mut self, id: u64, dirfd: libc::c_int, path: &std::ffi::CStr, timestamp: u64, ending_records: usize) {
+        let name = self.names.remove(&id).unwrap();
+        let live = self.live.remove(&name).unwrap();
+        self.fds.retain(|_, open| *open != id);
+        self.drop_records(&live.records);
+        if config().policy == Policy::Record {
+            let record = format!("{} ephemeral file: ({:?} {:?}) created: {} records: {}\n", timestamp, dirfd, path, live.created, live.records.len() + ending_records);
+            self.hold(record.into_bytes());
+        }
+        self.release_if_idle();
+    }
+
+    fn drop_records(&mut self, records: &[u64]) {
+        for seq in records {
+            if let Some(held) = seq.checked_sub(self.first_seq).and_then(|i| self.held.get_mut(i as usize)) {
+                if let Some(record) = held.record.take() {
+                    self.held_bytes -= record.len();
+                    crate::counters::count_buffered(-(record.len() as isize));
+                }
+            }
+        }
+    }
+
+    /// A file's records can no longer be elided.
+    fn escape(&mut self, id: u64) {
+        if let Some(name) = self.names.remove(&id) {
+            self.live.remove(&name);
+            self.fds.retain(|_, open| *open != id);
+        }
+    }
+
+    fn hold(&mut self, record: Vec<u8>) {
+        let timestamp = std::str::from_utf8(&record[..record.iter().position(|byte| *byte == b' ').unwrap_or(0)])
+            .ok().and_then(|timestamp| timestamp.parse().ok()).unwrap_or(0);
+        let file = self.next_file.take();
+        if let Some(live) = file.and_then(|id| self.names.get(&id)).and_then(|name| self.live.get_mut(name)) {
+            live.records.push(self.first_seq + self.held.len() as u64);
+        }
+        self.held_bytes += record.len();
+        crate::counters::count_buffered(record.len() as isize);
+        self.held.push_back(Held { timestamp, file, record: Some(record) });
+        while self.held_bytes > MAX_HELD_BYTES || self.held.front().is_some_and(|held| held.timestamp + config().window_ns < timestamp) {
+            self.release_one();
+        }
+        self.release_if_idle();
+    }
+
+    fn release_one(&mut self) {
+        let Some(held) = self.held.pop_front() else { return };
+        self.first_seq += 1;
+        if let Some(record) = held.record {
+            self.held_bytes -= record.len();
+            crate::counters::count_buffered(-(record.len() as isize));
+            self.inner.write_all(&record).unwrap();
+            if let Some(id) = held.file {
+                self.escape(id);
+            }
+        }
+    }
+
+    fn release_if_idle(&mut self) {
+        if self.live.is_empty() {
+            self.release_all();
+        }
+    }
+
+    fn release_all(&mut self) {
+        while !self.held.is_empty() {
+            self.release_one();
+        }
+    }
+}
+
+impl<W: Write> Write for EphemeralFiles<W> {
+    fn write(&mut self, buf: &[u8]) -> std::io::Result<usize> {
+        if self.partial.is_empty() && !self.holding() {
+            return self.inner.write(buf);
+        }
+        self.partial.extend_from_slice(buf);
+        if buf.ends_with(b"\n") {
+            let record = std::mem::take(&mut self.partial);
+            self.hold(record);
+        }
+        Ok(buf.len())
+    }
+
+    fn flush(&mut self) -> std::io::Result<()> {
+        self.holding();
+        // Whatever is live now outlives what the caller is flushing for.
+        self.forget_live();
+        self.release_all();
+        self.inner.flush()
+    }
+}
+
+impl<W: Write> Drop for EphemeralFiles<W> {
+    fn drop(&mut self) {
+        if self.forks == crate::fork::forks() {
+            self.release_all();
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    const CWD: libc::c_int = libc::AT_FDCWD;
+
+    fn lines(files: &EphemeralFiles<Vec<u8>>) -> Vec<String> {
+        String::from_utf8(files.inner.clone()).unwrap().lines().map(str::to_string).collect()
+    }
+
+    #[test]
+    fn a_file_deleted_again_leaves_one_record() {
+        let mut files = EphemeralFiles::new(Vec::new());
+        write!(files, "1 open mode: Read file: (-100 \"/in\") fd: 3\n").unwrap();
+        files.created(CWD, b"/tmp/scratch", 4, 2);
+        write!(files, "2 open mode: Overwrite file: (-100 \"/tmp/scratch\") fd: 4\n").unwrap();
+        files.touched(CWD, b"/other", None);
+        write!(files, "3 op code: MetadataRead file: (-100 \"/other\")\n").unwrap();
+        // Held in order behind the live file
+        assert_eq!(lines(&files).len(), 1);
+        files.closed(4);
+        write!(files, "4 close fd: 4\n").unwrap();
+        assert!(files.unlinked(CWD, c"/tmp/scratch", 5));
+        assert_eq!(lines(&files), [
+            "1 open mode: Read file: (-100 \"/in\") fd: 3",
+            "3 op code: MetadataRead file: (-100 \"/other\")",
+            "5 ephemeral file: (-100 \"/tmp/scratch\") created: 2 records: 3",
+        ]);
+    }
+
+    #[test]
+    fn a_temporary_renamed_into_place_is_written() {
+        let mut files = EphemeralFiles::new(Vec::new());
+        files.created(CWD, b"/d/foo.tmp123", 4, 1);
+        write!(files, "1 open mode: Overwrite file: (-100 \"/d/foo.tmp123\") fd: 4\n").unwrap();
+        files.closed(4);
+        write!(files, "2 close fd: 4\n").unwrap();
+        assert!(files.renamed(CWD, b"/d/foo.tmp123", CWD, c"/d/foo", 3));
+        files.flush().unwrap();
+        assert_eq!(lines(&files), ["3 wrote file: (-100 \"/d/foo\") created: 1 records: 3"]);
+        // Flushing ended its lifetime, so the unlink is an ordinary record now.
+        assert!(!files.unlinked(CWD, c"/d/foo", 4));
+    }
+
+    #[test]
+    fn a_file_whose_records_were_written_is_not_elided() {
+        let mut files = EphemeralFiles::new(Vec::new());
+        files.created(CWD, b"/tmp/slow", 4, 1);
+        write!(files, "1 open mode: Overwrite file: (-100 \"/tmp/slow\") fd: 4\n").unwrap();
+        let later = 1 + config().window_ns + 1;
+        write!(files, "{} op code: MetadataRead file: (-100 \"/other\")\n", later).unwrap();
+        assert_eq!(lines(&files).len(), 2);
+        assert!(!files.unlinked(CWD, c"/tmp/slow", later + 1));
+    }
+
+    #[test]
+    fn a_forked_child_drops_what_its_parent_held() {
+        let mut files = EphemeralFiles::new(Vec::new());
+        files.created(CWD, b"/tmp/parents", 4, 1);
+        write!(files, "1 open mode: Overwrite file: (-100 \"/tmp/parents\") fd: 4\n").unwrap();
+        match unsafe { libc::fork() } {
+            0 => {
+                write!(files, "2 op code: MetadataRead file: (-100 \"/childs\")\n").unwrap();
+                let ok = lines(&files) == ["2 op code: MetadataRead file: (-100 \"/childs\")"]
+                    && !files.unlinked(CWD, c"/tmp/parents", 3);
+                unsafe { libc::_exit(if ok { 0 } else { 1 }) };
+            },
+            child => {
+                assert!(child > 0);
+                let mut status = 0;
+                assert_eq!(unsafe { libc::waitpid(child, &mut status, 0) }, child);
+                assert!(libc::WIFEXITED(status) && libc::WEXITSTATUS(status) == 0, "child failed");
+            },
+        }
+        assert!(files.unlinked(CWD, c"/tmp/parents", 3));
+        assert_eq!(lines(&files), ["3 ephemeral file: (-100 \"/tmp/parents\") created: 1 records: 2"]);
+    }
+}
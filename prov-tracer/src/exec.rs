@@ -0,0 +1,169 @@
+/*
+ * Ships the calling thread's records before the process image goes away
+ * without running exit handlers or thread-local destructors: at exec, and at
+ * _exit (which is how the forked children of shells, make and the gcc driver
+ * usually end). Otherwise a short-lived process loses whatever is still in
+ * its block (see block_writer).
+ *
+ * glibc's exec functions each make the execve system call themselves, so
+ * each is hooked; execl, execlp and execle are variadic, so they are
+ * reimplemented over execv, execvp and execve, as musl does.
+ *
+ * The new image keeps the pid, and would truncate the file its main thread's
+ * records were just flushed to (see PROV_TRACER_FILE). So each exec from a
+ * thread that is tracing adds PROV_TRACER_EXEC=<pid> to the new environment,
+ * and block_writer carries on at the end of a file made under the same pid
+ * instead; the pid keeps the mark from applying to the new image's children.
+ * Other execs (tracing detached, or no logger yet, so no file to carry on)
+ * pass the environment through as it is.
+ *
+ * vfork is replaced with fork: a vforked child borrows its parent's memory,
+ * so its hooks would write into the parent's logger, and flushing before its
+ * exec would hand the parent's block to the parent's flusher.
+ *
+ * Records other threads still hold are lost at exec and _exit, as at exit.
+ */
+
+use std::sync::atomic::Ordering;
+use libc::{c_char, c_int};
+
+/// Whether this thread is tracing and has a logger.
+fn logging() -> bool {
+    crate::globals::TRACING.load(Ordering::Relaxed) && crate::globals::LOGGER_STARTED.get()
+}
+
+/// Flushes this thread's logger, if it has one; never creates one.
+fn flush_before_exit() {
+    if !logging() {
+        return;
+    }
+    let _ = crate::CALL_LOGGER.try_with(|call_logger| {
+        if let Ok(mut call_logger) = call_logger.try_borrow_mut() {
+            call_logger.inner.prov_logger.flush();
+        }
+    });
+}
+
+const EXEC_MARK: &str = "PROV_TRACER_EXEC";
+
+/// Whether this process image was exec'd by a traced one with the same pid.
+pub fn resumes_after_exec() -> bool {
+    std::env::var(EXEC_MARK).is_ok_and(|pid| pid == std::process::id().to_string())
+}
+
+/// envp, less any old mark, plus ours if this thread is logging (else envp as it is); the CString keeps the mark alive.
+unsafe fn marked(envp: *const *const c_char) -> (Vec<*const c_char>, Option<std::ffi::CString>) {
+    let mark = logging().then(|| std::ffi::CString::new(format!("{}={}", EXEC_MARK, std::process::id())).unwrap());
+    let mut marked = Vec::new();
+    let mut var = envp;
+    while !envp.is_null() && !(*var).is_null() {
+        if mark.is_none() || !std::ffi::CStr::from_ptr(*var).to_bytes().starts_with(EXEC_MARK.as_bytes()) {
+            marked.push(*var);
+        }
+        var = var.add(1);
+    }
+    if let Some(mark) = &mark {
+        marked.push(mark.as_ptr());
+    }
+    marked.push(std::ptr::null());
+    (marked, mark)
+}
+
+extern "C" {
+    static environ: *const *const c_char;
+}
+
+redhook::hook! {
+    unsafe fn execve(path: *const c_char, argv: *const *const c_char, envp: *const *const c_char) -> c_int => __traced_execve {
+        flush_before_exit();
+        let (envp, _mark) = marked(envp);
+        redhook::real!(execve)(path, argv, envp.as_ptr())
+    }
+}
+
+redhook::hook! {
+    unsafe fn execv(path: *const c_char, argv: *const *const c_char) -> c_int => __traced_execv {
+        flush_before_exit();
+        let (envp, _mark) = marked(environ);
+        redhook::real!(execve)(path, argv, envp.as_ptr())
+    }
+}
+
+redhook::hook! {
+    unsafe fn execvp(file: *const c_char, argv: *const *const c_char) -> c_int => __traced_execvp {
+        flush_before_exit();
+        let (envp, _mark) = marked(environ);
+        redhook::real!(execvpe)(file, argv, envp.as_ptr())
+    }
+}
+
+redhook::hook! {
+    unsafe fn execvpe(file: *const c_char, argv: *const *const c_char, envp: *const *const c_char) -> c_int => __traced_execvpe {
+        flush_before_exit();
+        let (envp, _mark) = marked(envp);
+        redhook::real!(execvpe)(file, argv, envp.as_ptr())
+    }
+}
+
+redhook::hook! {
+    unsafe fn execveat(dirfd: c_int, path: *const c_char, argv: *const *const c_char, envp: *const *const c_char, flags: c_int) -> c_int => __traced_execveat {
+        flush_before_exit();
+        let (envp, _mark) = marked(envp);
+        redhook::real!(execveat)(dirfd, path, argv, envp.as_ptr(), flags)
+    }
+}
+
+redhook::hook! {
+    unsafe fn fexecve(fd: c_int, argv: *const *const c_char, envp: *const *const c_char) -> c_int => __traced_fexecve {
+        flush_before_exit();
+        let (envp, _mark) = marked(envp);
+        redhook::real!(fexecve)(fd, argv, envp.as_ptr())
+    }
+}
+
+redhook::hook! {
+    unsafe fn _exit(status: c_int) => __traced__exit {
+        flush_before_exit();
+        redhook::real!(_exit)(status)
+    }
+}
+
+redhook::hook! {
+    unsafe fn _Exit(status: c_int) => __traced__Exit {
+        flush_before_exit();
+        redhook::real!(_Exit)(status)
+    }
+}
+
+/// The arguments of an execl-style call from arg on, with the null that ends them.
+unsafe fn argv_from(arg: *const c_char, args: &mut std::ffi::VaListImpl) -> Vec<*const c_char> {
+    let mut argv = vec![arg];
+    while !argv.last().unwrap().is_null() {
+        argv.push(args.arg::<*const c_char>());
+    }
+    argv
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn execl(path: *const c_char, arg: *const c_char, mut args: ...) -> c_int {
+    let argv = argv_from(arg, &mut args);
+    __traced_execv(path, argv.as_ptr())
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn execlp(file: *const c_char, arg: *const c_char, mut args: ...) -> c_int {
+    let argv = argv_from(arg, &mut args);
+    __traced_execvp(file, argv.as_ptr())
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn execle(path: *const c_char, arg: *const c_char, mut args: ...) -> c_int {
+    let argv = argv_from(arg, &mut args);
+    let envp = args.arg::<*const *const c_char>();
+    __traced_execve(path, argv.as_ptr(), envp)
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn vfork() -> libc::pid_t {
+    libc::fork()
+}
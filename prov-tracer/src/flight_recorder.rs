@@ -0,0 +1,429 @@
+/*
+ * Flight-recorder mode: each thread keeps its last PROV_TRACER_RING_MB of
+ * trace in memory, overwriting the oldest records, and nothing reaches the
+ * disk unless something asks for a dump:
+ *
+ *   - the process exits with a non-zero status (through exit or returning
+ *     from main; _exit skips this),
+ *   - it gets a fatal signal (SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT),
+ *   - it gets PROV_TRACER_DUMP_SIGNAL, if set, which is served by the next
+ *     traced call of any thread (the application's own handler for that
+ *     signal, if it had one, still runs),
+ *   - or the application calls prov_tracer_dump().
+ *
+ * A dump writes one uncompressed trace file per thread (see trace_format),
+ * named by PROV_TRACER_FILE, where %d is the number of the dump; the default
+ * is %p.%t.%d.prov_trace. Dumped rings are emptied, so successive dumps hold
+ * disjoint records.
+ *
+ * Rings are registered process-wide, so a dump includes threads which have
+ * already exited (at exit, thread-locals are destroyed before on_exit
+ * handlers run). When a thread exits, its ring shrinks to what it holds, and
+ * only the last PROV_TRACER_RETIRED_RINGS exited threads' rings are kept, so
+ * a process that churns through threads does not keep a ring for each.
+ * Records which refer to a definition written earlier (stacks, search
+ * dir lists) would be left dangling once the ring overwrote it, so those
+ * definitions are written again after each dump and each 1/GENERATIONS of
+ * the ring (see generation); only records in about the oldest 2/GENERATIONS
+ * of a dump can refer to one it lost.
+ * Dumps neither allocate nor go through libc's file functions,
+ * so the same code runs in a fatal-signal handler, where it only try_locks:
+ * a ring whose owner was interrupted mid-write is skipped.
+ *
+ * The steady-state cost is one uncontended lock and a memcpy per record.
+ *
+ * Configuration (read once per process):
+ *   PROV_TRACER_MODE        = flight (see sink)
+ *   PROV_TRACER_RING_MB     = size of each thread's ring (default 4)
+ *   PROV_TRACER_RETIRED_RINGS = how many exited threads' rings to keep (default 16; at least 1)
+ *   PROV_TRACER_DUMP_SIGNAL = signal number which requests a dump (default 0, none)
+ */
+
+use std::io::Write;
+use std::sync::{Arc, Mutex, MutexGuard, OnceLock};
+use std::sync::atomic::{AtomicBool, AtomicU32, AtomicU64, Ordering};
+
+const FATAL_SIGNALS: [libc::c_int; 5] = [libc::SIGSEGV, libc::SIGBUS, libc::SIGILL, libc::SIGFPE, libc::SIGABRT];
+const MAX_PATH_LEN: usize = 4096;
+/// How many times per ring's worth of records the definitions are written again
+const GENERATIONS: usize = 16;
+
+extern "C" {
+    // glibc; unlike atexit, the handler gets the exit status.
+    fn on_exit(function: extern "C" fn(libc::c_int, *mut libc::c_void), arg: *mut libc::c_void) -> libc::c_int;
+}
+
+struct Config {
+    ring_size: usize,
+    retired_rings: usize,
+    file_pattern: String,
+    dump_signal: libc::c_int,
+}
+
+fn config() -> &'static Config {
+    static CONFIG: OnceLock<Config> = OnceLock::new();
+    CONFIG.get_or_init(|| Config {
+        ring_size: std::env::var("PROV_TRACER_RING_MB").ok().and_then(|mb| mb.parse::<usize>().ok()).unwrap_or(4) << 20,
+        // At least the main thread's, which exits before the on_exit dump
+        retired_rings: std::env::var("PROV_TRACER_RETIRED_RINGS").ok().and_then(|rings| rings.parse::<usize>().ok()).unwrap_or(16).max(1),
+        file_pattern: std::env::var("PROV_TRACER_FILE").unwrap_or("%p.%t.%d.prov_trace".to_string()),
+        dump_signal: std::env::var("PROV_TRACER_DUMP_SIGNAL").ok().and_then(|signal| signal.parse().ok()).unwrap_or(0),
+    })
+}
+
+/// True if PROV_TRACER_MODE=flight.
+pub fn enabled() -> bool {
+    static ENABLED: OnceLock<bool> = OnceLock::new();
+    *ENABLED.get_or_init(|| std::env::var("PROV_TRACER_MODE").as_deref() == Ok("flight"))
+}
+
+struct Ring {
+    buffer: Box<[u8]>,
+    /// Bytes written since the ring was last emptied; the next byte goes at written % capacity.
+    written: usize,
+    /// The dump file name with %p and %t filled in, and where %d was, if anywhere
+    path: Vec<u8>,
+    number_at: Option<usize>,
+    /// See generation()
+    generation: Arc<AtomicU64>,
+}
+
+impl Ring {
+    fn push(&mut self, mut data: &[u8]) {
+        let capacity = self.buffer.len();
+        let per_generation = (capacity / GENERATIONS).max(1);
+        if self.written / per_generation != (self.written + data.len()) / per_generation {
+            self.generation.fetch_add(1, Ordering::Relaxed);
+        }
+        crate::counters::count_buffered((self.written + data.len()).min(capacity) as isize - self.written.min(capacity) as isize);
+        if data.len() > capacity {
+            self.written += data.len() - capacity;
+            data = &data[data.len() - capacity..];
+        }
+        let start = self.written % capacity;
+        let first = data.len().min(capacity - start);
+        self.buffer[start..start + first].copy_from_slice(&data[..first]);
+        self.buffer[..data.len() - first].copy_from_slice(&data[first..]);
+        self.written += data.len();
+    }
+
+    /// The contents, oldest first, trimmed to whole records.
+    fn contents(&self) -> (&[u8], &[u8]) {
+        let capacity = self.buffer.len();
+        let (mut older, mut newer): (&[u8], &[u8]) = if self.written <= capacity {
+            (&self.buffer[..self.written], &[])
+        } else {
+            let start = self.written % capacity;
+            (&self.buffer[start..], &self.buffer[..start])
+        };
+        if self.written > capacity {
+            // The oldest record was partly overwritten
+            match older.iter().position(|byte| *byte == b'\n') {
+                Some(end) => older = &older[end + 1..],
+                None => {
+                    let end = newer.iter().position(|byte| *byte == b'\n').map_or(newer.len(), |end| end + 1);
+                    older = &[];
+                    newer = &newer[end..];
+                },
+            }
+        }
+        // The newest record may be half-written (writeln! writes in pieces)
+        match newer.iter().rposition(|byte| *byte == b'\n') {
+            Some(end) => newer = &newer[..end + 1],
+            None => {
+                newer = &[];
+                older = &older[..older.iter().rposition(|byte| *byte == b'\n').map_or(0, |end| end + 1)];
+            },
+        }
+        (older, newer)
+    }
+
+    /// Writes the ring to its dump file with raw syscalls (no allocation, no locks), and empties it.
+    fn dump(&mut self, dump_number: u32) {
+        let (older, newer) = self.contents();
+        if older.is_empty() && newer.is_empty() {
+            return;
+        }
+        let mut path = [0u8; MAX_PATH_LEN];
+        let mut number = [0u8; 10];
+        let mut number_len = 0;
+        let mut n = dump_number;
+        loop {
+            number[number_len] = b'0' + (n % 10) as u8;
+            number_len += 1;
+            n /= 10;
+            if n == 0 { break; }
+        }
+        number[..number_len].reverse();
+        let parts: [&[u8]; 4] = match self.number_at {
+            Some(at) => [&self.path[..at], &number[..number_len], &self.path[at..], b"\0"],
+            None => [&self.path, &[], &[], b"\0"],
+        };
+        let mut len = 0;
+        for part in parts {
+            if len + part.len() >= MAX_PATH_LEN {
+                return;
+            }
+            path[len..len + part.len()].copy_from_slice(part);
+            len += part.len();
+        }
+        let fd = unsafe {
+            libc::syscall(
+                libc::SYS_openat, libc::AT_FDCWD, path.as_ptr(),
+                libc::O_WRONLY | libc::O_CREAT | libc::O_TRUNC | libc::O_CLOEXEC, 0o644,
+            )
+        } as libc::c_int;
+        if fd < 0 {
+            return;
+        }
+        let header = trace_format::Header { compression: trace_format::Compression::None, dictionary_hash: 0 }.to_bytes();
+        // One block, so it decodes to whole lines even though the ring wraps in the middle of one
+        let data_len = (older.len() + newer.len()) as u32;
+        let mut block_header = [0u8; trace_format::BLOCK_HEADER_SIZE];
+        block_header[0..4].copy_from_slice(&data_len.to_le_bytes());
+        block_header[4..8].copy_from_slice(&data_len.to_le_bytes());
+        for mut chunk in [&header[..], &block_header[..], older, newer] {
+            while !chunk.is_empty() {
+                let ret = unsafe { libc::syscall(libc::SYS_write, fd, chunk.as_ptr(), chunk.len()) };
+                if ret < 0 {
+                    if errno::errno().0 == libc::EINTR { continue; }
+                    break;
+                }
+                chunk = &chunk[ret as usize..];
+            }
+        }
+        unsafe { libc::syscall(libc::SYS_close, fd) };
+        crate::counters::count_buffered(-(self.written.min(self.buffer.len()) as isize));
+        self.written = 0;
+        self.generation.fetch_add(1, Ordering::Relaxed);
+    }
+}
+
+struct Registered {
+    ring: Arc<Mutex<Ring>>,
+    /// Whether its thread has exited
+    retired: bool,
+}
+
+/// Every live thread's ring in this process, and the last few exited threads' (in the order they exited);
+/// fork::child() empties it, since the parent's rings are the parent's to dump.
+static RINGS: Mutex<Vec<Registered>> = Mutex::new(Vec::new());
+static DUMPS: AtomicU32 = AtomicU32::new(0);
+static DUMP_REQUESTED: AtomicBool = AtomicBool::new(false);
+
+thread_local! {
+    /// The generation of this thread's ring, if it has one
+    static GENERATION: std::cell::RefCell<Option<Arc<AtomicU64>>> = const { std::cell::RefCell::new(None) };
+}
+
+/// Changes whenever this thread's ring may have lost a definition that later records refer to:
+/// it was dumped, or has taken another 1/GENERATIONS of its size since. Always 0 outside flight mode.
+pub fn generation() -> u64 {
+    GENERATION.try_with(|generation| {
+        generation.borrow().as_ref().map_or(0, |generation| generation.load(Ordering::Relaxed))
+    }).unwrap_or(0)
+}
+
+fn lock<T>(mutex: &Mutex<T>) -> MutexGuard<'_, T> {
+    mutex.lock().unwrap_or_else(|poisoned| poisoned.into_inner())
+}
+
+/// RINGS, held across a fork (see fork)
+pub struct ForkLock(MutexGuard<'static, Vec<Registered>>);
+
+pub fn lock_for_fork() -> ForkLock {
+    ForkLock(lock(&RINGS))
+}
+
+impl ForkLock {
+    /// In the child
+    pub fn reset(mut self) {
+        self.0.clear();
+    }
+}
+
+/// Dumps every thread's ring; in a signal handler (blocking = false), busy rings are skipped.
+fn dump_all(blocking: bool) {
+    let dump_number = DUMPS.fetch_add(1, Ordering::Relaxed);
+    let rings = if blocking {
+        lock(&RINGS)
+    } else {
+        match RINGS.try_lock() {
+            Ok(rings) => rings,
+            Err(_) => return,
+        }
+    };
+    for Registered { ring, .. } in rings.iter() {
+        let mut ring = if blocking {
+            lock(ring)
+        } else {
+            match ring.try_lock() {
+                Ok(ring) => ring,
+                Err(_) => continue,
+            }
+        };
+        ring.dump(dump_number);
+    }
+}
+
+/// Dumps every thread's ring now (see prov_tracer_dump).
+pub fn dump() {
+    if enabled() {
+        let enable_trace = crate::globals::ENABLE_TRACE.replace(false);
+        dump_all(true);
+        crate::globals::ENABLE_TRACE.set(enable_trace);
+    }
+}
+
+/// For applications: dump the flight recorder now (a no-op when not in flight mode).
+#[no_mangle]
+pub extern "C" fn prov_tracer_dump() {
+    dump();
+}
+
+extern "C" fn dump_on_failure(status: libc::c_int, _arg: *mut libc::c_void) {
+    if status != 0 {
+        dump_all(true);
+    }
+}
+
+static OLD_ACTIONS: Mutex<Vec<(libc::c_int, libc::sigaction)>> = Mutex::new(Vec::new());
+
+extern "C" fn dump_on_fatal_signal(signal: libc::c_int) {
+    dump_all(false);
+    // Put back whatever was there before us and re-raise, so the process dies (or the application handles it) as it would have.
+    if let Ok(old_actions) = OLD_ACTIONS.try_lock() {
+        for (old_signal, old_action) in old_actions.iter() {
+            if *old_signal == signal {
+                unsafe { libc::sigaction(signal, old_action, std::ptr::null_mut()) };
+            }
+        }
+    }
+    unsafe { libc::raise(signal) };
+}
+
+/// The dump signal's action before ours, which request_dump chains to.
+static OLD_DUMP_ACTION: OnceLock<libc::sigaction> = OnceLock::new();
+
+extern "C" fn request_dump(signal: libc::c_int, info: *mut libc::siginfo_t, context: *mut libc::c_void) {
+    DUMP_REQUESTED.store(true, Ordering::Relaxed);
+    if let Some(old_action) = OLD_DUMP_ACTION.get() {
+        if old_action.sa_sigaction != libc::SIG_DFL && old_action.sa_sigaction != libc::SIG_IGN {
+            unsafe {
+                if old_action.sa_flags & libc::SA_SIGINFO != 0 {
+                    let handler: extern "C" fn(libc::c_int, *mut libc::siginfo_t, *mut libc::c_void) = std::mem::transmute(old_action.sa_sigaction);
+                    handler(signal, info, context);
+                } else {
+                    let handler: extern "C" fn(libc::c_int) = std::mem::transmute(old_action.sa_sigaction);
+                    handler(signal);
+                }
+            }
+        }
+    }
+}
+
+/// Installs the dump triggers, once per process (on_exit handlers and signal dispositions survive fork).
+fn install_triggers() {
+    static INSTALLED: OnceLock<()> = OnceLock::new();
+    INSTALLED.get_or_init(|| {
+        unsafe { on_exit(dump_on_failure, std::ptr::null_mut()) };
+        let mut old_actions = OLD_ACTIONS.lock().unwrap();
+        for signal in FATAL_SIGNALS {
+            old_actions.push((signal, crate::util::set_signal_handler(signal, dump_on_fatal_signal, libc::SA_RESETHAND | libc::SA_NODEFER)));
+        }
+        if config().dump_signal != 0 {
+            unsafe {
+                // Save the old action before installing ours, so a signal in between is not lost to the application.
+                let mut old_action: libc::sigaction = std::mem::zeroed();
+                libc::sigaction(config().dump_signal, std::ptr::null(), &mut old_action);
+                let _ = OLD_DUMP_ACTION.set(old_action);
+                let mut action: libc::sigaction = std::mem::zeroed();
+                action.sa_sigaction = request_dump as libc::sighandler_t;
+                action.sa_flags = libc::SA_SIGINFO | libc::SA_RESTART;
+                libc::sigemptyset(&mut action.sa_mask);
+                libc::sigaction(config().dump_signal, &action, std::ptr::null_mut());
+            }
+        }
+    });
+}
+
+pub struct FlightRecorder {
+    ring: Arc<Mutex<Ring>>,
+    /// fork::forks() when the ring was made
+    forks: u64,
+}
+
+impl FlightRecorder {
+    pub fn new() -> Self {
+        install_triggers();
+        let config = config();
+        let pattern = config.file_pattern
+            .replace("%p", std::process::id().to_string().as_str())
+            .replace("%t", std::thread::current().id().as_u64().to_string().as_str());
+        let number_at = pattern.find("%d");
+        let generation = Arc::new(AtomicU64::new(0));
+        GENERATION.with(|current| *current.borrow_mut() = Some(generation.clone()));
+        let ring = Arc::new(Mutex::new(Ring {
+            buffer: vec![0u8; config.ring_size.max(1)].into_boxed_slice(),
+            written: 0,
+            path: pattern.replacen("%d", "", 1).into_bytes(),
+            number_at,
+            generation,
+        }));
+        lock(&RINGS).push(Registered { ring: ring.clone(), retired: false });
+        Self { ring, forks: crate::fork::forks() }
+    }
+
+    /// Keeps the ring of this (exiting) thread for later dumps, shrunk to its contents,
+    /// and frees the rings of the threads that exited longest ago beyond PROV_TRACER_RETIRED_RINGS.
+    fn retire(&self) {
+        {
+            let mut ring = lock(&self.ring);
+            let (older, newer) = ring.contents();
+            let kept = [older, newer].concat().into_boxed_slice();
+            crate::counters::count_buffered(kept.len() as isize - ring.written.min(ring.buffer.len()) as isize);
+            ring.written = kept.len();
+            ring.buffer = kept;
+        }
+        let mut rings = lock(&RINGS);
+        if let Some(index) = rings.iter().position(|registered| Arc::ptr_eq(&registered.ring, &self.ring)) {
+            let mut registered = rings.remove(index);
+            registered.retired = true;
+            rings.push(registered);
+        }
+        while rings.iter().filter(|registered| registered.retired).count() > config().retired_rings {
+            let index = rings.iter().position(|registered| registered.retired).unwrap();
+            let evicted = rings.remove(index);
+            crate::counters::count_buffered(-(lock(&evicted.ring).buffer.len() as isize));
+        }
+    }
+}
+
+impl Drop for FlightRecorder {
+    fn drop(&mut self) {
+        // Runs as the thread exits. A forked child's inherited recorder was never in its RINGS.
+        if self.forks == crate::fork::forks() {
+            self.retire();
+        }
+    }
+}
+
+impl Write for FlightRecorder {
+    fn write(&mut self, buf: &[u8]) -> std::io::Result<usize> {
+        if self.forks != crate::fork::forks() {
+            // A forked child: the parent's rings are the parent's to dump.
+            let enable_trace = crate::globals::ENABLE_TRACE.replace(false);
+            *self = Self::new();
+            crate::globals::ENABLE_TRACE.set(enable_trace);
+        }
+        lock(&self.ring).push(buf);
+        if DUMP_REQUESTED.load(Ordering::Relaxed) && buf.ends_with(b"\n") && DUMP_REQUESTED.swap(false, Ordering::Relaxed) {
+            dump();
+        }
+        Ok(buf.len())
+    }
+
+    fn flush(&mut self) -> std::io::Result<()> {
+        Ok(())
+    }
+}
@@ -0,0 +1,70 @@
+/*
+ * Keeps the tracer's process-wide state usable across fork.
+ *
+ * fork copies only the calling thread, so a lock that another thread held at
+ * that moment would stay locked in the child for good. Around each fork, the
+ * tracer's process-wide locks (block_writer's FLUSHER and FREE_BLOCKS,
+ * flight_recorder's RINGS, stacks' MODULES) are taken before it, and released
+ * after it in both processes; in the child, first the state of the parent's
+ * other threads (the flusher, their rings) is forgotten.
+ *
+ * A forked child's copy of a thread's writer, held records, stacks and so on
+ * belongs to the parent too, and has to be replaced before the child traces
+ * anything. Comparing a remembered pid with getpid would do, but that is a
+ * system call per record; instead the child handler bumps FORKS, and each
+ * holder remembers the value it was made under.
+ *
+ * vfork, which runs no atfork handlers, is replaced with fork (see exec).
+ */
+
+use std::sync::atomic::{AtomicU64, Ordering};
+
+static FORKS: AtomicU64 = AtomicU64::new(0);
+
+/// How many forks made this process; differs from the value under which some state was made iff it was inherited.
+#[inline]
+pub fn forks() -> u64 {
+    FORKS.load(Ordering::Relaxed)
+}
+
+struct Held {
+    modules: crate::stacks::ForkLock,
+    rings: crate::flight_recorder::ForkLock,
+    flusher: crate::block_writer::ForkLock,
+}
+
+thread_local! {
+    /// The locks prepare() took, until parent() or child() (on the same thread) releases them
+    static HELD: std::cell::RefCell<Option<Held>> = const { std::cell::RefCell::new(None) };
+}
+
+extern "C" fn prepare() {
+    // Always in this order; no other code holds two of them at once.
+    HELD.set(Some(Held {
+        modules: crate::stacks::lock_for_fork(),
+        rings: crate::flight_recorder::lock_for_fork(),
+        flusher: crate::block_writer::lock_for_fork(),
+    }));
+}
+
+extern "C" fn parent() {
+    drop(HELD.take());
+}
+
+extern "C" fn child() {
+    FORKS.fetch_add(1, Ordering::Relaxed);
+    if let Some(held) = HELD.take() {
+        held.flusher.reset();
+        held.rings.reset();
+        drop(held.modules);
+    }
+}
+
+extern "C" fn init() {
+    unsafe { libc::pthread_atfork(Some(prepare), Some(parent), Some(child)) };
+}
+
+// Runs when the library is loaded, so no fork can slip by before the handlers are in place.
+#[used]
+#[link_section = ".init_array"]
+static INIT: extern "C" fn() = init;
@@ -10,4 +10,20 @@ thread_local!{
      *
      * */
     pub static ENABLE_TRACE: std::cell::Cell<bool> = false.into();
+
+    /** Depth of this thread's prov_tracer_pause() calls not yet matched by prov_tracer_resume() (see api). */
+    pub static PAUSED: std::cell::Cell<u32> = const { std::cell::Cell::new(0) };
+
+    /** Whether this thread's logger exists yet, so exec can flush it without creating one. */
+    pub static LOGGER_STARTED: std::cell::Cell<bool> = const { std::cell::Cell::new(false) };
 }
+
+/** Process-wide switch for tracing, flipped at runtime (see control).
+ *
+ * Every hook tests this first, so a detached process pays one load and one
+ * predictable branch per call.
+ * */
+pub static TRACING: std::sync::atomic::AtomicBool = std::sync::atomic::AtomicBool::new(true);
+
+/** Set by the toggle signal; the next traced call flushes and clears TRACING. */
+pub static DETACH_REQUESTED: std::sync::atomic::AtomicBool = std::sync::atomic::AtomicBool::new(false);
@@ -1,9 +1,23 @@
 #![feature(iter_intersperse)]
 #![feature(thread_id_value)]
 #![feature(absolute_path)]
+#![feature(c_variadic)]
 #![allow(unused_imports)]
 mod util;
 mod globals;
+mod fork;
+mod exec;
+mod block_writer;
+mod flight_recorder;
+mod collector_writer;
+mod sink;
+mod control;
+mod api;
+mod counters;
+mod search_coalescer;
+mod ephemeral_files;
+mod stacks;
+mod uring;
 
 extern crate project_specific_macros;
 project_specific_macros::populate_libc_calls_and_hook_fns!{
@@ -11,13 +25,13 @@ project_specific_macros::populate_libc_calls_and_hook_fns!{
     FILE * fopen (const char *filename, const char *opentype) {
         self.prov_logger.pre_open(OpenMode::parse_fopen_str(opentype), libc::AT_FDCWD, filename);
     } {
-        let fd = if ret.is_null() { 0 } else { unsafe {libc::fileno(ret)} };
+        let fd = if ret.is_null() { -1 } else { unsafe {libc::fileno(ret)} };
         self.prov_logger.post_open(OpenMode::parse_fopen_str(opentype), libc::AT_FDCWD, filename, fd, this_errno);
     }
     FILE * fopen64 (const char *filename, const char *opentype) {
         self.prov_logger.pre_open(OpenMode::parse_fopen_str(opentype), libc::AT_FDCWD, filename);
     } {
-        let fd = if ret.is_null() { 0 } else { unsafe {libc::fileno(ret)} };
+        let fd = if ret.is_null() { -1 } else { unsafe {libc::fileno(ret)} };
         self.prov_logger.post_open(OpenMode::parse_fopen_str(opentype), libc::AT_FDCWD, filename, fd, this_errno);
     }
     FILE * freopen (const char *filename, const char *opentype, FILE *stream) {
@@ -28,7 +42,7 @@ project_specific_macros::populate_libc_calls_and_hook_fns!{
         // TODO: consider the case where the close succeeds but the open fails, etc.
         let emulated_ret = if ret.is_null() { -1 } else { 0 };
         self.prov_logger.post_close(self.tmp_fd, emulated_ret, this_errno);
-        let fd = if ret.is_null() { 0 } else { unsafe {libc::fileno(ret)} };
+        let fd = if ret.is_null() { -1 } else { unsafe {libc::fileno(ret)} };
         self.prov_logger.post_open(OpenMode::parse_fopen_str(opentype), libc::AT_FDCWD, filename, fd, this_errno);
     }
     FILE * freopen64 (const char *filename, const char *opentype, FILE *stream) {
@@ -39,7 +53,7 @@ project_specific_macros::populate_libc_calls_and_hook_fns!{
         // TODO: consider the case where the close succeeds but the open fails, etc.
         let emulated_ret = if ret.is_null() { -1 } else { 0 };
         self.prov_logger.post_close(self.tmp_fd, emulated_ret, this_errno);
-        let fd = if ret.is_null() { 0 } else { unsafe {libc::fileno(ret)} };
+        let fd = if ret.is_null() { -1 } else { unsafe {libc::fileno(ret)} };
         self.prov_logger.post_open(OpenMode::parse_fopen_str(opentype), libc::AT_FDCWD, filename, fd, this_errno);
     }
 
@@ -84,14 +98,14 @@ project_specific_macros::populate_libc_calls_and_hook_fns!{
         self.prov_logger.post_open(OpenMode::parse_open_bits(flags), libc::AT_FDCWD, filename, ret, this_errno);
     }
     int creat (const char *filename, mode_t mode) {
-        self.prov_logger.pre_open(OpenMode::WritePart, libc::AT_FDCWD, filename);
+        self.prov_logger.pre_open(OpenMode::Overwrite, libc::AT_FDCWD, filename);
     } {
-        self.prov_logger.post_open(OpenMode::WritePart, libc::AT_FDCWD, filename, ret, this_errno);
+        self.prov_logger.post_open(OpenMode::Overwrite, libc::AT_FDCWD, filename, ret, this_errno);
     }
     int creat64 (const char *filename, mode_t mode) {
-        self.prov_logger.pre_open(OpenMode::WritePart, libc::AT_FDCWD, filename);
+        self.prov_logger.pre_open(OpenMode::Overwrite, libc::AT_FDCWD, filename);
     } {
-        self.prov_logger.post_open(OpenMode::WritePart, libc::AT_FDCWD, filename, ret, this_errno);
+        self.prov_logger.post_open(OpenMode::Overwrite, libc::AT_FDCWD, filename, ret, this_errno);
     }
     int close (int filedes) guard_call {
         self.prov_logger.pre_close(filedes);
@@ -208,6 +222,44 @@ project_specific_macros::populate_libc_calls_and_hook_fns!{
         self.prov_logger.post_op2(BinaryFileOp::Hardlink, oldfd, oldname, newfd, newname, ret, this_errno);
     }
 
+    // https://www.gnu.org/software/libc/manual/html_node/Deleting-Files.html
+    int unlink (const char *filename) {
+        self.prov_logger.pre_op(UnaryFileOp::Unlink, libc::AT_FDCWD, filename);
+    } {
+        self.prov_logger.post_op(UnaryFileOp::Unlink, libc::AT_FDCWD, filename, ret, this_errno);
+    }
+    int remove (const char *filename) {
+        self.prov_logger.pre_op(UnaryFileOp::Unlink, libc::AT_FDCWD, filename);
+    } {
+        self.prov_logger.post_op(UnaryFileOp::Unlink, libc::AT_FDCWD, filename, ret, this_errno);
+    }
+
+    // https://www.man7.org/linux/man-pages/man2/unlink.2.html
+    int unlinkat (int dirfd, const char *pathname, int flags) {
+        self.prov_logger.pre_op(UnaryFileOp::Unlink, dirfd, pathname);
+    } {
+        self.prov_logger.post_op(UnaryFileOp::Unlink, dirfd, pathname, ret, this_errno);
+    }
+
+    // https://www.gnu.org/software/libc/manual/html_node/Renaming-Files.html
+    int rename (const char *oldname, const char *newname) {
+        self.prov_logger.pre_op2(BinaryFileOp::Move, libc::AT_FDCWD, oldname, libc::AT_FDCWD, newname);
+    } {
+        self.prov_logger.post_op2(BinaryFileOp::Move, libc::AT_FDCWD, oldname, libc::AT_FDCWD, newname, ret, this_errno);
+    }
+
+    // https://www.man7.org/linux/man-pages/man2/rename.2.html
+    int renameat (int olddirfd, const char *oldpath, int newdirfd, const char *newpath) {
+        self.prov_logger.pre_op2(BinaryFileOp::Move, olddirfd, oldpath, newdirfd, newpath);
+    } {
+        self.prov_logger.post_op2(BinaryFileOp::Move, olddirfd, oldpath, newdirfd, newpath, ret, this_errno);
+    }
+    int renameat2 (int olddirfd, const char *oldpath, int newdirfd, const char *newpath, unsigned int flags) {
+        self.prov_logger.pre_op2(BinaryFileOp::rename_flags(flags), olddirfd, oldpath, newdirfd, newpath);
+    } {
+        self.prov_logger.post_op2(BinaryFileOp::rename_flags(flags), olddirfd, oldpath, newdirfd, newpath, ret, this_errno);
+    }
+
     // https://www.gnu.org/software/libc/manual/html_node/Symbolic-Links.html
     int symlink (const char *oldname, const char *newname) {
         self.prov_logger.pre_op2(BinaryFileOp::Symlink, libc::AT_FDCWD, oldname, libc::AT_FDCWD, newname);
@@ -235,6 +287,93 @@ project_specific_macros::populate_libc_calls_and_hook_fns!{
         let emulated_ret = if ret > 0 { 0 } else { -1 };
         self.prov_logger.post_op(UnaryFileOp::MetadataRead, dirfd, filename, emulated_ret, this_errno);
     }
+
+    // These are guarded, since std stats files (e.g. while creating the trace file).
+    // https://www.gnu.org/software/libc/manual/html_node/Reading-Attributes.html
+    int stat (const char *filename, struct stat *buf) guard_call {
+        self.prov_logger.pre_op(UnaryFileOp::MetadataRead, libc::AT_FDCWD, filename);
+    } {
+        self.prov_logger.post_op(UnaryFileOp::MetadataRead, libc::AT_FDCWD, filename, ret, this_errno);
+    }
+    int stat64 (const char *filename, struct stat64 *buf) guard_call {
+        self.prov_logger.pre_op(UnaryFileOp::MetadataRead, libc::AT_FDCWD, filename);
+    } {
+        self.prov_logger.post_op(UnaryFileOp::MetadataRead, libc::AT_FDCWD, filename, ret, this_errno);
+    }
+    int lstat (const char *filename, struct stat *buf) guard_call {
+        self.prov_logger.pre_op(UnaryFileOp::MetadataRead, libc::AT_FDCWD, filename);
+    } {
+        self.prov_logger.post_op(UnaryFileOp::MetadataRead, libc::AT_FDCWD, filename, ret, this_errno);
+    }
+    int lstat64 (const char *filename, struct stat64 *buf) guard_call {
+        self.prov_logger.pre_op(UnaryFileOp::MetadataRead, libc::AT_FDCWD, filename);
+    } {
+        self.prov_logger.post_op(UnaryFileOp::MetadataRead, libc::AT_FDCWD, filename, ret, this_errno);
+    }
+
+    // https://www.man7.org/linux/man-pages/man2/stat.2.html
+    int fstatat (int dirfd, const char *pathname, struct stat *buf, int flags) guard_call {
+        self.prov_logger.pre_op(UnaryFileOp::MetadataRead, dirfd, pathname);
+    } {
+        self.prov_logger.post_op(UnaryFileOp::MetadataRead, dirfd, pathname, ret, this_errno);
+    }
+    int fstatat64 (int dirfd, const char *pathname, struct stat64 *buf, int flags) guard_call {
+        self.prov_logger.pre_op(UnaryFileOp::MetadataRead, dirfd, pathname);
+    } {
+        self.prov_logger.post_op(UnaryFileOp::MetadataRead, dirfd, pathname, ret, this_errno);
+    }
+
+    // https://www.man7.org/linux/man-pages/man2/statx.2.html
+    int statx (int dirfd, const char *pathname, int flags, unsigned int mask, struct statx *buf) guard_call {
+        self.prov_logger.pre_op(UnaryFileOp::MetadataRead, dirfd, pathname);
+    } {
+        self.prov_logger.post_op(UnaryFileOp::MetadataRead, dirfd, pathname, ret, this_errno);
+    }
+
+    // What programs built against glibc before 2.33 call for stat, lstat and fstatat
+    // https://refspecs.linuxfoundation.org/LSB_5.0.0/LSB-Core-generic/LSB-Core-generic/baselib-xstat-1.html
+    int __xstat (int ver, const char *filename, struct stat *buf) guard_call {
+        self.prov_logger.pre_op(UnaryFileOp::MetadataRead, libc::AT_FDCWD, filename);
+    } {
+        self.prov_logger.post_op(UnaryFileOp::MetadataRead, libc::AT_FDCWD, filename, ret, this_errno);
+    }
+    int __xstat64 (int ver, const char *filename, struct stat64 *buf) guard_call {
+        self.prov_logger.pre_op(UnaryFileOp::MetadataRead, libc::AT_FDCWD, filename);
+    } {
+        self.prov_logger.post_op(UnaryFileOp::MetadataRead, libc::AT_FDCWD, filename, ret, this_errno);
+    }
+    int __lxstat (int ver, const char *filename, struct stat *buf) guard_call {
+        self.prov_logger.pre_op(UnaryFileOp::MetadataRead, libc::AT_FDCWD, filename);
+    } {
+        self.prov_logger.post_op(UnaryFileOp::MetadataRead, libc::AT_FDCWD, filename, ret, this_errno);
+    }
+    int __lxstat64 (int ver, const char *filename, struct stat64 *buf) guard_call {
+        self.prov_logger.pre_op(UnaryFileOp::MetadataRead, libc::AT_FDCWD, filename);
+    } {
+        self.prov_logger.post_op(UnaryFileOp::MetadataRead, libc::AT_FDCWD, filename, ret, this_errno);
+    }
+    int __fxstatat (int ver, int dirfd, const char *pathname, struct stat *buf, int flags) guard_call {
+        self.prov_logger.pre_op(UnaryFileOp::MetadataRead, dirfd, pathname);
+    } {
+        self.prov_logger.post_op(UnaryFileOp::MetadataRead, dirfd, pathname, ret, this_errno);
+    }
+    int __fxstatat64 (int ver, int dirfd, const char *pathname, struct stat64 *buf, int flags) guard_call {
+        self.prov_logger.pre_op(UnaryFileOp::MetadataRead, dirfd, pathname);
+    } {
+        self.prov_logger.post_op(UnaryFileOp::MetadataRead, dirfd, pathname, ret, this_errno);
+    }
+
+    // https://www.gnu.org/software/libc/manual/html_node/Testing-File-Access.html
+    int access (const char *filename, int how) guard_call {
+        self.prov_logger.pre_op(UnaryFileOp::MetadataRead, libc::AT_FDCWD, filename);
+    } {
+        self.prov_logger.post_op(UnaryFileOp::MetadataRead, libc::AT_FDCWD, filename, ret, this_errno);
+    }
+    int faccessat (int dirfd, const char *pathname, int how, int flags) guard_call {
+        self.prov_logger.pre_op(UnaryFileOp::MetadataRead, dirfd, pathname);
+    } {
+        self.prov_logger.post_op(UnaryFileOp::MetadataRead, dirfd, pathname, ret, this_errno);
+    }
 }
 
 struct NullCallLogger();
@@ -264,6 +403,16 @@ enum OpenMode {
 }
 
 impl OpenMode {
+    /// As it prints, without allocating
+    fn name(&self) -> &'static str {
+        match self {
+            OpenMode::Read => "Read",
+            OpenMode::ReadWrite => "ReadWrite",
+            OpenMode::Overwrite => "Overwrite",
+            OpenMode::WritePart => "WritePart",
+        }
+    }
+
     fn parse_fopen_str(opentype: *const libc::c_char) -> OpenMode {
         let first_char  = unsafe { (opentype.offset(0).read()) as u8 as char };
         let second_char = unsafe { (opentype.offset(1).read()) as u8 as char };
@@ -326,14 +475,36 @@ impl OpenMode {
 // https://unix.stackexchange.com/questions/248408/file-descriptors-across-exec
 // TODO: Note that file descriptors can be shared across execs.
 
-#[derive(Debug)]
+#[derive(Debug, Clone, Copy)]
 enum UnaryFileOp {
-    Chdir, Opendir, Walk, MetadataRead, MetadataWritePart, Readlink
+    Chdir, Opendir, Walk, MetadataRead, MetadataWritePart, Readlink, Unlink
 }
 
-#[derive(Debug)]
+impl UnaryFileOp {
+    /// As it prints, without allocating
+    fn name(self) -> &'static str {
+        match self {
+            UnaryFileOp::Chdir => "Chdir",
+            UnaryFileOp::Opendir => "Opendir",
+            UnaryFileOp::Walk => "Walk",
+            UnaryFileOp::MetadataRead => "MetadataRead",
+            UnaryFileOp::MetadataWritePart => "MetadataWritePart",
+            UnaryFileOp::Readlink => "Readlink",
+            UnaryFileOp::Unlink => "Unlink",
+        }
+    }
+}
+
+#[derive(Debug, Clone, Copy)]
 enum BinaryFileOp {
-    Hardlink, Symlink, Move
+    Hardlink, Symlink, Move, Exchange
+}
+
+impl BinaryFileOp {
+    fn rename_flags(flags: libc::c_uint) -> BinaryFileOp {
+        // RENAME_EXCHANGE swaps the two files, so both live on.
+        if flags & libc::RENAME_EXCHANGE != 0 { BinaryFileOp::Exchange } else { BinaryFileOp::Move }
+    }
 }
 
 use std::path::PathBuf;
@@ -386,6 +557,9 @@ trait ProvLogger {
         dirfd1: libc::c_int, path1: *const libc::c_char,
         ret: libc::c_int, this_errno: errno::Errno,
     ) { }
+    /// An application's marker (see api)
+    #[allow(unused_variables)]
+    fn mark(&mut self, label: &std::ffi::CStr) { }
 }
 
 struct CallLoggerToProvLogger<MyProvLogger> {
@@ -402,23 +576,54 @@ impl<MyProvLogger: ProvLogger> CallLoggerToProvLogger<MyProvLogger> {
     }
 }
 
+impl CallLoggerToProvLogger<VerboseProvLogger> {
+    fn detach_if_requested(&mut self) {
+        self.prov_logger.search.flush(&mut self.prov_logger.file);
+        control::detach_if_requested(&mut self.prov_logger.file);
+    }
+}
+
 use std::io::Write;
 struct VerboseProvLogger {
-    file: std::fs::File,
+    file: ephemeral_files::EphemeralFiles<sink::TraceSink>,
+    search: search_coalescer::SearchCoalescer,
+    stacks: stacks::Stacks,
 }
 impl VerboseProvLogger {
     fn new() -> Self {
         println!("(VerboseProvLogger::new");
         crate::globals::ENABLE_TRACE.set(false);
-        let filename =
-            std::env::var("PROV_TRACER_FILE")
-            .unwrap_or("%p.%t.prov_trace".to_string())
-            .replace("%p", std::process::id().to_string().as_str())
-            .replace("%t", std::thread::current().id().as_u64().to_string().as_str());
-        let file = std::fs::File::create(filename).unwrap();
+        let file = ephemeral_files::EphemeralFiles::new(sink::TraceSink::create());
         crate::globals::ENABLE_TRACE.set(true);
+        crate::globals::LOGGER_STARTED.set(true);
         println!(")");
-        Self { file }
+        Self { file, search: Default::default(), stacks: stacks::Stacks::new() }
+    }
+
+    /// Ships everything this thread holds, before the process image goes away (see exec).
+    fn flush(&mut self) {
+        self.search.flush(&mut self.file);
+        let enable_trace = crate::globals::ENABLE_TRACE.replace(false);
+        let _ = self.file.flush();
+        crate::globals::ENABLE_TRACE.set(enable_trace);
+    }
+
+    /// Logs a failed lookup, which may be part of a search (see search_coalescer).
+    fn failed_lookup(
+        &mut self, kind: search_coalescer::Kind, dirfd: libc::c_int, path: *const libc::c_char,
+        this_errno: errno::Errno, stack: stacks::Tag,
+    ) {
+        let timestamp = util::timestamp_ns();
+        let path = util::short_cstr(path);
+        let probe = search_coalescer::Probe { kind, dirfd, path: path.to_bytes(), timestamp, stack };
+        if !self.search.miss(&mut self.file, &probe, this_errno) {
+            kind.write_record(&mut self.file, timestamp, dirfd, path, this_errno, stack);
+        }
+    }
+}
+impl Drop for VerboseProvLogger {
+    fn drop(&mut self) {
+        self.search.flush(&mut self.file);
     }
 }
 impl ProvLogger for VerboseProvLogger {
@@ -427,10 +632,19 @@ impl ProvLogger for VerboseProvLogger {
         dirfd: libc::c_int, path: *const libc::c_char,
         fd: libc::c_int, this_errno: errno::Errno,
     ) {
+        counters::count_event(0);
+        let stack = self.stacks.capture(&mut self.file);
         if fd == -1 {
-            writeln!(self.file, "open mode: {:?} file: ({:?} {:?}) err: {:?}", mode, dirfd, util::short_cstr(path), this_errno).unwrap();
+            self.failed_lookup(search_coalescer::Kind::Open(mode.name()), dirfd, path, this_errno, stack);
         } else {
-            writeln!(self.file, "open mode: {:?} file: ({:?} {:?}) fd: {:?}", mode, dirfd, util::short_cstr(path), fd).unwrap();
+            self.search.flush(&mut self.file);
+            let timestamp = util::timestamp_ns();
+            let path_bytes = util::short_cstr(path).to_bytes();
+            match mode {
+                OpenMode::Overwrite => self.file.created(dirfd, path_bytes, fd, timestamp),
+                _ => self.file.touched(dirfd, path_bytes, Some(fd)),
+            }
+            writeln!(self.file, "{} open mode: {:?} file: ({:?} {:?}) fd: {:?}{}", timestamp, mode, dirfd, util::short_cstr(path), fd, stack).unwrap();
         }
     }
     fn post_close(
@@ -438,10 +652,14 @@ impl ProvLogger for VerboseProvLogger {
         fd: libc::c_int,
         ret: libc::c_int, this_errno: errno::Errno,
     ) {
+        counters::count_event(1);
+        let stack = self.stacks.capture(&mut self.file);
+        self.search.flush(&mut self.file);
+        self.file.closed(fd);
         if ret == -1 {
-            writeln!(self.file, "close fd: {:?} err: {:?}", fd, this_errno).unwrap();
+            writeln!(self.file, "{} close fd: {:?} err: {:?}{}", util::timestamp_ns(), fd, this_errno, stack).unwrap();
         } else {
-            writeln!(self.file, "close fd: {:?}", fd).unwrap();
+            writeln!(self.file, "{} close fd: {:?}{}", util::timestamp_ns(), fd, stack).unwrap();
         }
     }
     fn post_dup(
@@ -449,10 +667,14 @@ impl ProvLogger for VerboseProvLogger {
         old: libc::c_int, new: libc::c_int,
         ret: libc::c_int, this_errno: errno::Errno
     ) {
+        counters::count_event(2);
+        let stack = self.stacks.capture(&mut self.file);
+        self.search.flush(&mut self.file);
+        self.file.duped(old, new);
         if ret == -1 {
-            writeln!(self.file, "dup fd0: {:?} fd1: {:?} err: {:?}", old, new, this_errno).unwrap();
+            writeln!(self.file, "{} dup fd0: {:?} fd1: {:?} err: {:?}{}", util::timestamp_ns(), old, new, this_errno, stack).unwrap();
         } else {
-            writeln!(self.file, "dup fd0: {:?} fd1: {:?}", old, new).unwrap();
+            writeln!(self.file, "{} dup fd0: {:?} fd1: {:?}{}", util::timestamp_ns(), old, new, stack).unwrap();
         }
     }
     fn post_op(
@@ -460,10 +682,18 @@ impl ProvLogger for VerboseProvLogger {
         dirfd: libc::c_int, path: *const libc::c_char,
         ret: libc::c_int, this_errno: errno::Errno,
     ) {
+        counters::count_event(trace_format::counters::FIRST_UNARY_OP + op_code as usize);
+        let stack = self.stacks.capture(&mut self.file);
         if ret == -1 {
-            writeln!(self.file, "op code: {:?} file: ({:?} {:?}) err: {:?}", op_code, dirfd, util::short_cstr(path), this_errno).unwrap();
+            self.failed_lookup(search_coalescer::Kind::Op(op_code.name()), dirfd, path, this_errno, stack);
         } else {
-            writeln!(self.file, "op code: {:?} file: ({:?} {:?})", op_code, dirfd, util::short_cstr(path)).unwrap();
+            self.search.flush(&mut self.file);
+            let timestamp = util::timestamp_ns();
+            match op_code {
+                UnaryFileOp::Unlink if self.file.unlinked(dirfd, util::short_cstr(path), timestamp) => return,
+                _ => self.file.touched(dirfd, util::short_cstr(path).to_bytes(), None),
+            }
+            writeln!(self.file, "{} op code: {:?} file: ({:?} {:?}){}", timestamp, op_code, dirfd, util::short_cstr(path), stack).unwrap();
         }
     }
     fn post_op2(
@@ -473,12 +703,27 @@ impl ProvLogger for VerboseProvLogger {
         dirfd1: libc::c_int, path1: *const libc::c_char,
         ret: libc::c_int, this_errno: errno::Errno,
     ) {
+        counters::count_event(trace_format::counters::FIRST_BINARY_OP + op_code as usize);
+        let stack = self.stacks.capture(&mut self.file);
+        self.search.flush(&mut self.file);
         if ret == -1 {
-            writeln!(self.file, "op code: {:?} file0: ({:?} {:?}) file1: ({:?} {:?}) err: {:?}", op_code, dirfd0, util::short_cstr(path0), dirfd1, util::short_cstr(path1), this_errno).unwrap();
+            writeln!(self.file, "{} op code: {:?} file0: ({:?} {:?}) file1: ({:?} {:?}) err: {:?}{}", util::timestamp_ns(), op_code, dirfd0, util::short_cstr(path0), dirfd1, util::short_cstr(path1), this_errno, stack).unwrap();
         } else {
-            writeln!(self.file, "op code: {:?} file0: ({:?} {:?}) file1: ({:?} {:?})", op_code, dirfd0, util::short_cstr(path0), dirfd1, util::short_cstr(path1)).unwrap();
+            let timestamp = util::timestamp_ns();
+            match op_code {
+                BinaryFileOp::Move if self.file.renamed(dirfd0, util::short_cstr(path0).to_bytes(), dirfd1, util::short_cstr(path1), timestamp) => return,
+                BinaryFileOp::Exchange => self.file.exchanged(dirfd0, util::short_cstr(path0).to_bytes(), dirfd1, util::short_cstr(path1).to_bytes()),
+                _ => (),
+            }
+            writeln!(self.file, "{} op code: {:?} file0: ({:?} {:?}) file1: ({:?} {:?}){}", timestamp, op_code, dirfd0, util::short_cstr(path0), dirfd1, util::short_cstr(path1), stack).unwrap();
         }
     }
+    fn mark(&mut self, label: &std::ffi::CStr) {
+        counters::count_event(trace_format::counters::MARK);
+        let stack = self.stacks.capture(&mut self.file);
+        self.search.flush(&mut self.file);
+        writeln!(self.file, "{} mark label: {:?}{}", util::timestamp_ns(), label, stack).unwrap();
+    }
 }
 
 // pub struct SemanticCallLogger {
@@ -0,0 +1,302 @@
+/*
+ * Folds search-path probing into one record. Compilers (include dirs), the
+ * dynamic loader (LD_LIBRARY_PATH) and Python (sys.path) look a name up in
+ * directory after directory, and most of those lookups fail; logged one by
+ * one, they dominate the trace.
+ *
+ * A run is consecutive failed lookups (open, stat, access, ...) of the same
+ * kind, dirfd, error and basename in different directories, each within
+ * WINDOW_NS of the last. A run of at least MIN_RUN is logged as
+ *
+ *   TS dirs id: N list: ("dir0" "dir1" ...)
+ *   TS search op: KIND name: "basename" dirfd: D dirs: N err: E
+ *
+ * where the dirs record is only written the first time this thread probes
+ * that list of directories (ids are per trace file, i.e. per thread; a
+ * basename with no directory is listed as "", and one in the root as "/"), and TS
+ * is the time of the first probe (as the stack, if any, is its stack). A
+ * lookup that ends the run by succeeding, i.e. the final hit, is logged as
+ * usual, right after the search record. Shorter runs are logged as the
+ * records they replaced, which are only rendered then.
+ *
+ * A forked child drops the run and the dir list ids it inherited: the run's
+ * probes are the parent's to log, and the ids were defined in its file. In
+ * flight mode, ids are dropped (and lists defined again) whenever the ring
+ * may have overwritten their definitions (see flight_recorder::generation).
+ *
+ * Configuration (read once per process):
+ *   PROV_TRACER_SEARCH_COALESCE = 0 to log every failed probe (default 1)
+ */
+
+use std::collections::HashMap;
+use std::io::Write;
+
+/// Longest gap between two probes of one run
+const WINDOW_NS: u64 = 1_000_000;
+const MIN_RUN: usize = 2;
+
+pub fn enabled() -> bool {
+    static ENABLED: std::sync::OnceLock<bool> = std::sync::OnceLock::new();
+    *ENABLED.get_or_init(|| std::env::var("PROV_TRACER_SEARCH_COALESCE").as_deref() != Ok("0"))
+}
+
+/// What a lookup did; only probes of one kind form a run
+#[derive(Clone, Copy, PartialEq, Eq)]
+pub enum Kind {
+    /// open, in this mode (as OpenMode prints)
+    Open(&'static str),
+    /// This unary op (as UnaryFileOp prints)
+    Op(&'static str),
+}
+
+impl Kind {
+    /// Writes the record of one failed lookup of this kind.
+    pub fn write_record(
+        self, out: &mut impl Write, timestamp: u64, dirfd: libc::c_int, path: &std::ffi::CStr,
+        err: errno::Errno, stack: crate::stacks::Tag,
+    ) {
+        match self {
+            Kind::Open(mode) => writeln!(out, "{} open mode: {} file: ({:?} {:?}) err: {:?}{}", timestamp, mode, dirfd, path, err, stack),
+            Kind::Op(op_code) => writeln!(out, "{} op code: {} file: ({:?} {:?}) err: {:?}{}", timestamp, op_code, dirfd, path, err, stack),
+        }.unwrap();
+    }
+}
+
+impl std::fmt::Display for Kind {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        match self {
+            Kind::Open(mode) => write!(f, "open({})", mode),
+            Kind::Op(op_code) => f.write_str(op_code),
+        }
+    }
+}
+
+/// A lookup, as the coalescer sees it
+pub struct Probe<'a> {
+    pub kind: Kind,
+    pub dirfd: libc::c_int,
+    pub path: &'a [u8],
+    pub timestamp: u64,
+    pub stack: crate::stacks::Tag,
+}
+
+struct Run {
+    kind: Kind,
+    dirfd: libc::c_int,
+    name: Vec<u8>,
+    err: errno::Errno,
+    /// Each probe's directory, with its trailing slash if it had one
+    dirs: Vec<Vec<u8>>,
+    /// Each probe's time and stack, to log it by itself if the run stays short
+    probes: Vec<(u64, crate::stacks::Tag)>,
+    last: u64,
+}
+
+#[derive(Default)]
+pub struct SearchCoalescer {
+    run: Option<Run>,
+    dir_lists: HashMap<Vec<Vec<u8>>, usize>,
+    /// fork::forks() when run and dir_lists were last valid
+    forks: u64,
+    /// flight_recorder::generation() when dir_lists was last valid
+    generation: u64,
+}
+
+/// The directory (keeping its trailing slash, so the path can be put back together) and basename of path
+fn split(path: &[u8]) -> (&[u8], &[u8]) {
+    match path.iter().rposition(|byte| *byte == b'/') {
+        Some(slash) => (&path[..slash + 1], &path[slash + 1..]),
+        None => (b"", path),
+    }
+}
+
+/// As the dirs record lists it: "/" stays, so that probes of the root are not taken for relative ones
+fn without_slash(dir: &[u8]) -> &[u8] {
+    match dir {
+        b"/" => dir,
+        _ => dir.strip_suffix(b"/").unwrap_or(dir),
+    }
+}
+
+fn is_miss(err: errno::Errno) -> bool {
+    err.0 == libc::ENOENT || err.0 == libc::ENOTDIR
+}
+
+impl SearchCoalescer {
+    /// Drops what a fork, or the flight recorder's ring, made stale.
+    fn forget_stale(&mut self) {
+        if self.forks != crate::fork::forks() {
+            self.run = None;
+            self.dir_lists.clear();
+            self.forks = crate::fork::forks();
+        }
+        if self.generation != crate::flight_recorder::generation() {
+            self.dir_lists.clear();
+            self.generation = crate::flight_recorder::generation();
+        }
+    }
+
+    /// Offers a failed lookup; false if the caller should write its record
+    /// (see Kind::write_record) itself.
+    pub fn miss(&mut self, out: &mut impl Write, probe: &Probe, err: errno::Errno) -> bool {
+        self.forget_stale();
+        if !enabled() || !is_miss(err) {
+            self.flush(out);
+            return false;
+        }
+        let (dir, name) = split(probe.path);
+        let continues = self.run.as_ref().is_some_and(|run| {
+            run.kind == probe.kind && run.dirfd == probe.dirfd && run.err == err && run.name == name
+                && probe.timestamp - run.last <= WINDOW_NS
+                && !run.dirs.iter().any(|seen| seen == dir)
+        });
+        if !continues {
+            self.flush(out);
+            self.run = Some(Run {
+                kind: probe.kind,
+                dirfd: probe.dirfd,
+                name: name.to_vec(),
+                err,
+                dirs: Vec::new(),
+                probes: Vec::new(),
+                last: probe.timestamp,
+            });
+        }
+        let run = self.run.as_mut().unwrap();
+        run.dirs.push(dir.to_vec());
+        run.probes.push((probe.timestamp, probe.stack));
+        run.last = probe.timestamp;
+        true
+    }
+
+    /// Ends the current run, if any, writing it out; call before writing any other record.
+    pub fn flush(&mut self, out: &mut impl Write) {
+        self.forget_stale();
+        let Some(run) = self.run.take() else { return };
+        if run.dirs.len() < MIN_RUN {
+            for (dir, (timestamp, stack)) in run.dirs.iter().zip(run.probes) {
+                let path = std::ffi::CString::new([dir.as_slice(), &run.name].concat()).unwrap();
+                run.kind.write_record(out, timestamp, run.dirfd, &path, run.err, stack);
+            }
+            return;
+        }
+        let (first, stack) = run.probes[0];
+        let next_id = self.dir_lists.len();
+        let id = match self.dir_lists.get(&run.dirs) {
+            Some(id) => *id,
+            None => {
+                write!(out, "{} dirs id: {} list: (", first, next_id).unwrap();
+                for (i, dir) in run.dirs.iter().enumerate() {
+                    let dir = std::ffi::CString::new(without_slash(dir)).unwrap();
+                    write!(out, "{}{:?}", if i == 0 { "" } else { " " }, dir).unwrap();
+                }
+                writeln!(out, ")").unwrap();
+                self.dir_lists.insert(run.dirs, next_id);
+                next_id
+            },
+        };
+        let name = std::ffi::CString::new(run.name).unwrap();
+        writeln!(out, "{} search op: {} name: {:?} dirfd: {:?} dirs: {} err: {:?}{}", first, run.kind, name, run.dirfd, id, run.err, stack).unwrap();
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    const ENOENT: errno::Errno = errno::Errno(libc::ENOENT);
+
+    fn probe(path: &[u8], timestamp: u64) -> Probe<'_> {
+        Probe { kind: Kind::Open("Read"), dirfd: libc::AT_FDCWD, path, timestamp, stack: Default::default() }
+    }
+
+    /// Probes name in each of dirs, 1us apart from timestamp on, and flushes.
+    fn search(coalescer: &mut SearchCoalescer, out: &mut Vec<u8>, dirs: &[&str], name: &str, timestamp: u64) {
+        for (i, dir) in dirs.iter().enumerate() {
+            let path = format!("{}{}", dir, name);
+            assert!(coalescer.miss(out, &probe(path.as_bytes(), timestamp + i as u64 * 1000), ENOENT));
+        }
+        coalescer.flush(out);
+    }
+
+    fn lines(out: &[u8]) -> Vec<String> {
+        String::from_utf8(out.to_vec()).unwrap().lines().map(str::to_string).collect()
+    }
+
+    #[test]
+    fn a_short_run_is_logged_as_its_probes() {
+        let mut coalescer = SearchCoalescer::default();
+        let mut out = Vec::new();
+        search(&mut coalescer, &mut out, &["/usr/include/"], "stdio.h", 5);
+        let lines = lines(&out);
+        assert_eq!(lines.len(), 1);
+        assert!(lines[0].starts_with("5 open mode: Read file: (-100 \"/usr/include/stdio.h\") err: "), "{}", lines[0]);
+    }
+
+    #[test]
+    fn a_long_run_is_one_search_record() {
+        let mut coalescer = SearchCoalescer::default();
+        let mut out = Vec::new();
+        search(&mut coalescer, &mut out, &["/usr/local/include/", "/", "", "sub/"], "x.h", 5);
+        let lines = lines(&out);
+        assert_eq!(lines.len(), 2);
+        assert_eq!(lines[0], "5 dirs id: 0 list: (\"/usr/local/include\" \"/\" \"\" \"sub\")");
+        assert!(lines[1].starts_with("5 search op: open(Read) name: \"x.h\" dirfd: -100 dirs: 0 err: "), "{}", lines[1]);
+    }
+
+    #[test]
+    fn runs_end_at_a_gap_a_repeated_directory_or_another_error() {
+        let mut coalescer = SearchCoalescer::default();
+        let mut out = Vec::new();
+        assert!(coalescer.miss(&mut out, &probe(b"/a/x", 0), ENOENT));
+        assert!(coalescer.miss(&mut out, &probe(b"/b/x", WINDOW_NS + 1), ENOENT));
+        assert!(coalescer.miss(&mut out, &probe(b"/b/x", WINDOW_NS + 2), ENOENT));
+        assert!(!coalescer.miss(&mut out, &probe(b"/c/x", WINDOW_NS + 3), errno::Errno(libc::EACCES)));
+        // Three runs of one probe each, none coalesced
+        assert_eq!(lines(&out).len(), 3);
+        assert!(lines(&out).iter().all(|line| line.contains(" open mode: ")));
+    }
+
+    #[test]
+    fn a_dir_list_is_defined_once() {
+        let mut coalescer = SearchCoalescer::default();
+        let mut out = Vec::new();
+        search(&mut coalescer, &mut out, &["/a/", "/b/"], "x.h", 1_000_000_000);
+        search(&mut coalescer, &mut out, &["/a/", "/b/"], "y.h", 2_000_000_000);
+        search(&mut coalescer, &mut out, &["/b/", "/a/"], "x.h", 3_000_000_000);
+        let lines = lines(&out);
+        assert_eq!(lines.len(), 5);
+        assert!(lines[2].starts_with("2000000000 search op: open(Read) name: \"y.h\" dirfd: -100 dirs: 0 "), "{}", lines[2]);
+        assert_eq!(lines[3], "3000000000 dirs id: 1 list: (\"/b\" \"/a\")");
+    }
+
+    #[test]
+    fn a_forked_child_defines_its_lists_again() {
+        let mut coalescer = SearchCoalescer::default();
+        let mut out = Vec::new();
+        search(&mut coalescer, &mut out, &["/a/", "/b/"], "x.h", 1_000_000_000);
+        // Pending in the parent when it forks
+        assert!(coalescer.miss(&mut out, &probe(b"/a/z.h", 2_000_000_000), ENOENT));
+        assert!(coalescer.miss(&mut out, &probe(b"/b/z.h", 2_000_001_000), ENOENT));
+        match unsafe { libc::fork() } {
+            0 => {
+                let mut child_out = Vec::new();
+                coalescer.flush(&mut child_out);
+                let dropped_run = child_out.is_empty();
+                search(&mut coalescer, &mut child_out, &["/a/", "/b/"], "x.h", 3_000_000_000);
+                let lines = lines(&child_out);
+                let ok = dropped_run && lines.len() == 2 && lines[0] == "3000000000 dirs id: 0 list: (\"/a\" \"/b\")";
+                unsafe { libc::_exit(if ok { 0 } else { 1 }) };
+            },
+            child => {
+                assert!(child > 0);
+                let mut status = 0;
+                assert_eq!(unsafe { libc::waitpid(child, &mut status, 0) }, child);
+                assert!(libc::WIFEXITED(status) && libc::WEXITSTATUS(status) == 0, "child failed");
+            },
+        }
+        // The parent's run and ids are intact.
+        coalescer.flush(&mut out);
+        assert!(lines(&out).last().unwrap().starts_with("2000000000 search op: open(Read) name: \"z.h\" dirfd: -100 dirs: 0 "));
+    }
+}
@@ -0,0 +1,51 @@
+/*
+ * Where VerboseProvLogger's records go, by PROV_TRACER_MODE:
+ *   stream (default) = a trace file per thread (block_writer)
+ *   flight           = an in-memory ring, dumped on demand (flight_recorder)
+ *   collector        = a prov-collector daemon (collector_writer)
+ */
+
+use std::io::Write;
+use crate::block_writer::BlockWriter;
+use crate::flight_recorder::FlightRecorder;
+use crate::collector_writer::CollectorWriter;
+
+pub enum TraceSink {
+    Stream(BlockWriter),
+    Flight(FlightRecorder),
+    Collector(CollectorWriter),
+}
+
+impl TraceSink {
+    /// The caller must have tracing disabled, since this may open a file or a socket.
+    pub fn create() -> Self {
+        if crate::flight_recorder::enabled() {
+            TraceSink::Flight(FlightRecorder::new())
+        } else if crate::collector_writer::enabled() {
+            TraceSink::Collector(CollectorWriter::connect())
+        } else {
+            TraceSink::Stream(BlockWriter::create())
+        }
+    }
+}
+
+impl Write for TraceSink {
+    fn write(&mut self, buf: &[u8]) -> std::io::Result<usize> {
+        if let Some(counters) = crate::counters::get() {
+            counters.bytes_logged.fetch_add(buf.len() as u64, std::sync::atomic::Ordering::Relaxed);
+        }
+        match self {
+            TraceSink::Stream(writer) => writer.write(buf),
+            TraceSink::Flight(recorder) => recorder.write(buf),
+            TraceSink::Collector(writer) => writer.write(buf),
+        }
+    }
+
+    fn flush(&mut self) -> std::io::Result<()> {
+        match self {
+            TraceSink::Stream(writer) => writer.flush(),
+            TraceSink::Flight(recorder) => recorder.flush(),
+            TraceSink::Collector(writer) => writer.flush(),
+        }
+    }
+}
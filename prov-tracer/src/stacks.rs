@@ -0,0 +1,349 @@
+/*
+ * Attributes each record to the call stack it came from, to answer "which
+ * part of the program opened that?" without a debugger.
+ *
+ * The stack is taken by walking frame pointers up from the hook, skipping
+ * frames in this library, for at most PROV_TRACER_STACKS frames. That is a
+ * few loads per frame (no unwind tables, no libunwind), so it stays well
+ * under 100ns; but past the first frame (the call site of the hooked
+ * function, which is always right) it needs the program and its libraries
+ * built with frame pointers (-fno-omit-frame-pointer, the default on recent
+ * Fedora and Ubuntu). Where the chain breaks, the stack is cut short. Each
+ * step is checked to stay on this thread's stack, so a broken chain cannot
+ * fault.
+ *
+ * A stack is written out once per trace file (i.e. per thread, like
+ * search_coalescer's dir lists), the first time it is seen, as
+ *
+ *   TS stack id: N frames: (0xRETURN_ADDRESS ...)
+ *
+ * innermost first, and records taken at that stack end with " stack: N".
+ * Before the first stack with a frame in some module (the executable, a
+ * shared library), the module is written, from dl_iterate_phdr:
+ *
+ *   TS module base: 0xLOAD_BIAS start: 0xSTART end: 0xEND path: "path"
+ *
+ * so stacks can be symbolized offline (see prov-stacks) against the files
+ * that were mapped. In flight mode, stacks and modules are written again
+ * whenever the ring may have overwritten them (see flight_recorder::generation).
+ *
+ * Configuration (read once per process):
+ *   PROV_TRACER_STACKS = how many frames to take (default 0, no stacks; at most 16)
+ */
+
+use std::collections::{HashMap, HashSet};
+use std::io::Write;
+
+const MAX_DEPTH: usize = 16;
+/// Frames of this library between the capture and the hooked call site, at most
+const MAX_SKIPPED: usize = 32;
+
+type Frames = [usize; MAX_DEPTH];
+
+pub fn depth() -> usize {
+    static DEPTH: std::sync::OnceLock<usize> = std::sync::OnceLock::new();
+    *DEPTH.get_or_init(|| {
+        if !cfg!(any(target_arch = "x86_64", target_arch = "aarch64")) {
+            return 0;
+        }
+        std::env::var("PROV_TRACER_STACKS").ok().and_then(|depth| depth.parse::<usize>().ok()).unwrap_or(0).min(MAX_DEPTH)
+    })
+}
+
+/// Ends a record taken at some stack: " stack: N", or nothing when stacks are off.
+#[derive(Clone, Copy, Default)]
+pub struct Tag(Option<u32>);
+
+impl std::fmt::Display for Tag {
+    fn fmt(&self, f: &mut std::fmt::Formatter) -> std::fmt::Result {
+        match self.0 {
+            Some(id) => write!(f, " stack: {}", id),
+            None => Ok(()),
+        }
+    }
+}
+
+/// A loaded object, as dl_iterate_phdr reported it
+struct Module {
+    /// Distinguishes a module from one loaded later at the same place
+    serial: u64,
+    base: usize,
+    start: usize,
+    end: usize,
+    path: std::ffi::CString,
+}
+
+/// (base, start, end, path), as found by dl_iterate_phdr
+type Found = Vec<(usize, usize, usize, std::ffi::CString)>;
+
+#[derive(Default)]
+struct Modules {
+    list: Vec<Module>,
+    /// dlpi_adds and dlpi_subs as of the last scan
+    generation: (u64, u64),
+    next_serial: u64,
+}
+
+static MODULES: std::sync::Mutex<Modules> = std::sync::Mutex::new(Modules { list: Vec::new(), generation: (0, 0), next_serial: 0 });
+
+/// MODULES, held across a fork (see fork); the list stays good in the child, which has the same mappings.
+pub struct ForkLock(#[allow(dead_code)] std::sync::MutexGuard<'static, Modules>);
+
+pub fn lock_for_fork() -> ForkLock {
+    ForkLock(MODULES.lock().unwrap_or_else(|poisoned| poisoned.into_inner()))
+}
+
+fn generation() -> (u64, u64) {
+    unsafe extern "C" fn first(info: *mut libc::dl_phdr_info, _size: libc::size_t, data: *mut libc::c_void) -> libc::c_int {
+        *(data as *mut (u64, u64)) = ((*info).dlpi_adds, (*info).dlpi_subs);
+        1
+    }
+    let mut generation = (0, 0);
+    unsafe { libc::dl_iterate_phdr(Some(first), &mut generation as *mut _ as *mut libc::c_void) };
+    generation
+}
+
+impl Modules {
+    /// Rescans the loaded objects if any were loaded or unloaded since the last scan.
+    fn refresh(&mut self) {
+        let generation = generation();
+        if generation == self.generation && !self.list.is_empty() {
+            return;
+        }
+        unsafe extern "C" fn each(info: *mut libc::dl_phdr_info, _size: libc::size_t, data: *mut libc::c_void) -> libc::c_int {
+            let (info, found) = (&*info, &mut *(data as *mut Found));
+            let segments = std::slice::from_raw_parts(info.dlpi_phdr, info.dlpi_phnum as usize);
+            let loaded = segments.iter().filter(|segment| segment.p_type == libc::PT_LOAD);
+            let start = loaded.clone().map(|segment| segment.p_vaddr as usize).min();
+            let end = loaded.map(|segment| (segment.p_vaddr + segment.p_memsz) as usize).max();
+            if let (Some(start), Some(end)) = (start, end) {
+                let base = info.dlpi_addr as usize;
+                let path = if info.dlpi_name.is_null() { Default::default() } else { std::ffi::CStr::from_ptr(info.dlpi_name).into() };
+                found.push((base, base + start, base + end, path));
+            }
+            0
+        }
+        let mut found: Found = Vec::new();
+        unsafe { libc::dl_iterate_phdr(Some(each), &mut found as *mut _ as *mut libc::c_void) };
+        let mut list = Vec::with_capacity(found.len());
+        for (base, start, end, mut path) in found {
+            if path.is_empty() {
+                // The executable
+                path = executable();
+            }
+            let serial = match self.list.iter().find(|module| module.base == base && module.path == path) {
+                Some(module) => module.serial,
+                None => {
+                    self.next_serial += 1;
+                    self.next_serial
+                },
+            };
+            list.push(Module { serial, base, start, end, path });
+        }
+        self.list = list;
+        self.generation = generation;
+    }
+
+    fn containing(&self, address: usize) -> Option<&Module> {
+        self.list.iter().find(|module| module.start <= address && address < module.end)
+    }
+}
+
+fn executable() -> std::ffi::CString {
+    // Not std::fs::read_link, whose readlink would be our hook.
+    let mut buffer = [0u8; libc::PATH_MAX as usize];
+    let len = unsafe {
+        libc::syscall(libc::SYS_readlinkat, libc::AT_FDCWD, c"/proc/self/exe".as_ptr(), buffer.as_mut_ptr(), buffer.len())
+    };
+    std::ffi::CString::new(&buffer[..len.max(0) as usize]).unwrap_or_default()
+}
+
+/// Where this library's code is, so its frames can be skipped
+fn tracer_text() -> (usize, usize) {
+    static TEXT: std::sync::OnceLock<(usize, usize)> = std::sync::OnceLock::new();
+    *TEXT.get_or_init(|| {
+        let mut modules = MODULES.lock().unwrap();
+        modules.refresh();
+        modules.containing(tracer_text as usize).map(|module| (module.start, module.end)).unwrap_or((0, 0))
+    })
+}
+
+/// The lowest address this thread's frames can be at, and the top of its stack
+fn stack_bounds() -> (usize, usize) {
+    extern "C" {
+        static __libc_stack_end: *mut libc::c_void;
+    }
+    unsafe {
+        if libc::gettid() == libc::getpid() {
+            // pthread_getattr_np would read /proc/self/maps for the main thread, and it grows.
+            let mut limit: libc::rlimit = std::mem::zeroed();
+            libc::getrlimit(libc::RLIMIT_STACK, &mut limit);
+            let top = __libc_stack_end as usize;
+            let size = if limit.rlim_cur == libc::RLIM_INFINITY { 1 << 30 } else { limit.rlim_cur as usize };
+            (top.saturating_sub(size), top)
+        } else {
+            let mut attr: libc::pthread_attr_t = std::mem::zeroed();
+            if libc::pthread_getattr_np(libc::pthread_self(), &mut attr) != 0 {
+                return (0, 0);
+            }
+            let (mut low, mut size) = (std::ptr::null_mut(), 0);
+            libc::pthread_attr_getstack(&attr, &mut low, &mut size);
+            libc::pthread_attr_destroy(&mut attr);
+            (low as usize, low as usize + size)
+        }
+    }
+}
+
+#[inline(always)]
+fn frame_pointer() -> usize {
+    let fp: usize;
+    #[cfg(target_arch = "x86_64")]
+    unsafe { std::arch::asm!("mov {}, rbp", out(reg) fp, options(nomem, nostack, preserves_flags)) };
+    #[cfg(target_arch = "aarch64")]
+    unsafe { std::arch::asm!("mov {}, x29", out(reg) fp, options(nomem, nostack, preserves_flags)) };
+    #[cfg(not(any(target_arch = "x86_64", target_arch = "aarch64")))]
+    { fp = 0; }
+    fp
+}
+
+/// Return addresses of the innermost callers outside this library; how many were found, and their hash.
+///
+/// This library is built with frame pointers (see .cargo/config.toml), so the
+/// chain from here to the hooked call site is intact. On both x86_64 and
+/// aarch64, a frame pointer points at the caller's frame pointer, followed by
+/// the return address.
+#[inline(never)]
+fn walk(frames: &mut Frames, depth: usize, (low, high): (usize, usize), (text_start, text_end): (usize, usize)) -> (usize, u64) {
+    let mut fp = frame_pointer();
+    if fp < low || fp >= high {
+        // On a signal stack
+        return (0, 0);
+    }
+    let (mut found, mut skipped, mut hash) = (0, 0, 0);
+    while found < depth && fp % std::mem::align_of::<usize>() == 0 && fp + 2 * std::mem::size_of::<usize>() <= high {
+        let (caller_fp, return_address) = unsafe { (*(fp as *const usize), *((fp as *const usize).add(1))) };
+        if return_address == 0 {
+            break;
+        }
+        if found == 0 && text_start <= return_address && return_address < text_end {
+            skipped += 1;
+            if skipped > MAX_SKIPPED {
+                break;
+            }
+        } else {
+            frames[found] = return_address;
+            found += 1;
+            hash = mix(hash, return_address as u64);
+        }
+        // Frames grow down, so the chain must go up, or it is broken.
+        if caller_fp <= fp {
+            break;
+        }
+        fp = caller_fp;
+    }
+    (found, hash)
+}
+
+/// Folds a return address into the hash of a stack
+fn mix(hash: u64, value: u64) -> u64 {
+    (hash.rotate_left(5) ^ value).wrapping_mul(0x51_7c_c1_b7_27_22_0a_95)
+}
+
+/// For keys that are already hashes
+#[derive(Default)]
+struct IdentityHasher(u64);
+
+impl std::hash::Hasher for IdentityHasher {
+    fn finish(&self) -> u64 {
+        self.0
+    }
+
+    fn write(&mut self, _bytes: &[u8]) {
+        unreachable!()
+    }
+
+    fn write_u64(&mut self, value: u64) {
+        self.0 = value;
+    }
+}
+
+/// One thread's stacks
+pub struct Stacks {
+    /// Ids of the stacks seen, by hash; hashed during the walk, so a capture never hashes the whole array
+    ids: HashMap<u64, u32, std::hash::BuildHasherDefault<IdentityHasher>>,
+    /// Frames of the stacks seen, by id
+    stacks: Vec<Frames>,
+    /// Serials of the modules written to this thread's trace
+    modules_written: HashSet<u64>,
+    /// From stack_bounds(), once needed
+    bounds: Option<(usize, usize)>,
+    /// fork::forks() as of the last capture
+    forks: u64,
+    /// flight_recorder::generation() as of the last capture
+    generation: u64,
+}
+
+impl Stacks {
+    pub fn new() -> Self {
+        Self { ids: Default::default(), stacks: Vec::new(), modules_written: HashSet::new(), bounds: None, forks: crate::fork::forks(), generation: crate::flight_recorder::generation() }
+    }
+
+    /// Takes the current stack, writing it to out if this thread has not seen it before.
+    #[inline]
+    pub fn capture(&mut self, out: &mut impl Write) -> Tag {
+        let depth = depth();
+        if depth == 0 {
+            return Tag(None);
+        }
+        let bounds = *self.bounds.get_or_insert_with(stack_bounds);
+        let mut frames = [0; MAX_DEPTH];
+        let (found, hash) = walk(&mut frames, depth, bounds, tracer_text());
+        if found == 0 {
+            return Tag(None);
+        }
+        let forks = crate::fork::forks();
+        let generation = crate::flight_recorder::generation();
+        if self.forks != forks || self.generation != generation {
+            // A forked child's trace has none of the parent's stacks, and a flight recorder's ring may have lost them.
+            self.ids.clear();
+            self.stacks.clear();
+            self.modules_written.clear();
+            self.forks = forks;
+            self.generation = generation;
+        }
+        if let Some(id) = self.ids.get(&hash) {
+            if self.stacks[*id as usize] == frames {
+                return Tag(Some(*id));
+            }
+        }
+        let id = self.stacks.len() as u32;
+        // On a collision, the stack already in ids keeps its place (and this one is written again next time).
+        self.ids.entry(hash).or_insert(id);
+        self.stacks.push(frames);
+        self.write_stack(out, id, &frames[..found]);
+        Tag(Some(id))
+    }
+
+    #[cold]
+    fn write_stack(&mut self, out: &mut impl Write, id: u32, frames: &[usize]) {
+        let timestamp = crate::util::timestamp_ns();
+        {
+            let mut modules = MODULES.lock().unwrap();
+            if frames.iter().any(|frame| modules.containing(*frame).is_none()) {
+                // Maybe in something dlopen()ed since
+                modules.refresh();
+            }
+            for frame in frames {
+                let Some(module) = modules.containing(*frame) else { continue };
+                if self.modules_written.insert(module.serial) {
+                    writeln!(out, "{} module base: {:#x} start: {:#x} end: {:#x} path: {:?}", timestamp, module.base, module.start, module.end, module.path).unwrap();
+                }
+            }
+        }
+        write!(out, "{} stack id: {} frames: (", timestamp, id).unwrap();
+        for (i, frame) in frames.iter().enumerate() {
+            write!(out, "{}{:#x}", if i == 0 { "" } else { " " }, frame).unwrap();
+        }
+        writeln!(out, ")").unwrap();
+    }
+}
@@ -0,0 +1,261 @@
+/*
+ * Just enough of io_uring for the flusher: a ring, registered buffers,
+ * WRITE_FIXED, and FSYNC.
+ *
+ * We use the raw syscalls rather than liburing so the tracer does not pull
+ * another shared library into every traced process. Struct layouts and
+ * constants are from <linux/io_uring.h>.
+ */
+
+use std::sync::atomic::{AtomicU32, Ordering};
+
+const IORING_OFF_SQ_RING: libc::off_t = 0;
+const IORING_OFF_CQ_RING: libc::off_t = 0x8000000;
+const IORING_OFF_SQES: libc::off_t = 0x10000000;
+const IORING_FEAT_SINGLE_MMAP: u32 = 1 << 0;
+const IORING_ENTER_GETEVENTS: u32 = 1 << 0;
+const IORING_REGISTER_BUFFERS: u32 = 0;
+
+pub const IORING_OP_FSYNC: u8 = 3;
+pub const IORING_OP_WRITE_FIXED: u8 = 5;
+pub const IOSQE_IO_LINK: u8 = 1 << 2;
+pub const IORING_FSYNC_DATASYNC: u32 = 1 << 0;
+
+#[repr(C)]
+#[derive(Default)]
+struct SqringOffsets {
+    head: u32,
+    tail: u32,
+    ring_mask: u32,
+    ring_entries: u32,
+    flags: u32,
+    dropped: u32,
+    array: u32,
+    resv1: u32,
+    user_addr: u64,
+}
+
+#[repr(C)]
+#[derive(Default)]
+struct CqringOffsets {
+    head: u32,
+    tail: u32,
+    ring_mask: u32,
+    ring_entries: u32,
+    overflow: u32,
+    cqes: u32,
+    flags: u32,
+    resv1: u32,
+    user_addr: u64,
+}
+
+#[repr(C)]
+#[derive(Default)]
+struct Params {
+    sq_entries: u32,
+    cq_entries: u32,
+    flags: u32,
+    sq_thread_cpu: u32,
+    sq_thread_idle: u32,
+    features: u32,
+    wq_fd: u32,
+    resv: [u32; 3],
+    sq_off: SqringOffsets,
+    cq_off: CqringOffsets,
+}
+
+#[repr(C)]
+#[derive(Default, Clone, Copy)]
+pub struct Sqe {
+    pub opcode: u8,
+    pub flags: u8,
+    pub ioprio: u16,
+    pub fd: i32,
+    pub off: u64,
+    pub addr: u64,
+    pub len: u32,
+    /// rw_flags, fsync_flags, etc., depending on opcode
+    pub op_flags: u32,
+    pub user_data: u64,
+    pub buf_index: u16,
+    pub personality: u16,
+    pub splice_fd_in: i32,
+    pub addr3: u64,
+    pub pad: u64,
+}
+
+#[repr(C)]
+#[derive(Clone, Copy)]
+pub struct Cqe {
+    pub user_data: u64,
+    pub res: i32,
+    pub flags: u32,
+}
+
+struct Mmap {
+    ptr: *mut libc::c_void,
+    len: usize,
+}
+
+impl Mmap {
+    fn new(fd: libc::c_int, len: usize, offset: libc::off_t) -> std::io::Result<Self> {
+        let ptr = unsafe {
+            libc::mmap(
+                std::ptr::null_mut(), len, libc::PROT_READ | libc::PROT_WRITE,
+                libc::MAP_SHARED | libc::MAP_POPULATE, fd, offset,
+            )
+        };
+        if ptr == libc::MAP_FAILED {
+            Err(std::io::Error::last_os_error())
+        } else {
+            Ok(Self { ptr, len })
+        }
+    }
+
+    unsafe fn at<T>(&self, offset: u32) -> *mut T {
+        unsafe { (self.ptr as *mut u8).add(offset as usize) as *mut T }
+    }
+}
+
+impl Drop for Mmap {
+    fn drop(&mut self) {
+        unsafe { libc::munmap(self.ptr, self.len) };
+    }
+}
+
+pub struct Uring {
+    fd: libc::c_int,
+    // Only held so they are unmapped on drop; the pointers below point into them.
+    _sq_ring: Mmap,
+    _cq_ring: Option<Mmap>,
+    _sqes_map: Mmap,
+    sq_tail: *const AtomicU32,
+    sq_head: *const AtomicU32,
+    sq_mask: u32,
+    sq_entries: u32,
+    sq_array: *mut u32,
+    sqes: *mut Sqe,
+    cq_head: *const AtomicU32,
+    cq_tail: *const AtomicU32,
+    cq_mask: u32,
+    cqes: *const Cqe,
+    /// SQEs pushed but not yet passed to io_uring_enter
+    unsubmitted: u32,
+}
+
+// The ring is only used by the flusher thread, but it is created before that thread starts.
+unsafe impl Send for Uring {}
+
+impl Uring {
+    pub fn new(entries: u32) -> std::io::Result<Self> {
+        let mut params = Params::default();
+        let fd = unsafe {
+            libc::syscall(libc::SYS_io_uring_setup, entries, &mut params as *mut Params)
+        };
+        if fd < 0 {
+            return Err(std::io::Error::last_os_error());
+        }
+        let fd = fd as libc::c_int;
+        let result = Self::map(fd, &params);
+        if result.is_err() {
+            unsafe { libc::close(fd) };
+        }
+        result
+    }
+
+    fn map(fd: libc::c_int, params: &Params) -> std::io::Result<Self> {
+        let sq_len = params.sq_off.array as usize + params.sq_entries as usize * std::mem::size_of::<u32>();
+        let cq_len = params.cq_off.cqes as usize + params.cq_entries as usize * std::mem::size_of::<Cqe>();
+        let single_mmap = params.features & IORING_FEAT_SINGLE_MMAP != 0;
+        let sq_ring = Mmap::new(fd, if single_mmap { sq_len.max(cq_len) } else { sq_len }, IORING_OFF_SQ_RING)?;
+        let cq_ring = if single_mmap { None } else { Some(Mmap::new(fd, cq_len, IORING_OFF_CQ_RING)?) };
+        let sqes_map = Mmap::new(fd, params.sq_entries as usize * std::mem::size_of::<Sqe>(), IORING_OFF_SQES)?;
+        unsafe {
+            let cq = cq_ring.as_ref().unwrap_or(&sq_ring);
+            Ok(Self {
+                fd,
+                sq_tail: sq_ring.at(params.sq_off.tail),
+                sq_head: sq_ring.at(params.sq_off.head),
+                sq_mask: *sq_ring.at::<u32>(params.sq_off.ring_mask),
+                sq_entries: params.sq_entries,
+                sq_array: sq_ring.at(params.sq_off.array),
+                sqes: sqes_map.ptr as *mut Sqe,
+                cq_head: cq.at(params.cq_off.head),
+                cq_tail: cq.at(params.cq_off.tail),
+                cq_mask: *cq.at::<u32>(params.cq_off.ring_mask),
+                cqes: cq.at(params.cq_off.cqes),
+                unsubmitted: 0,
+                _sq_ring: sq_ring,
+                _cq_ring: cq_ring,
+                _sqes_map: sqes_map,
+            })
+        }
+    }
+
+    /// The buffers must stay allocated, and must not move, for the life of the ring.
+    pub fn register_buffers(&mut self, buffers: &[libc::iovec]) -> std::io::Result<()> {
+        let ret = unsafe {
+            libc::syscall(
+                libc::SYS_io_uring_register, self.fd, IORING_REGISTER_BUFFERS,
+                buffers.as_ptr(), buffers.len() as libc::c_uint,
+            )
+        };
+        if ret < 0 { Err(std::io::Error::last_os_error()) } else { Ok(()) }
+    }
+
+    /// Queues sqe; returns false if the submission queue is full.
+    pub fn push(&mut self, sqe: Sqe) -> bool {
+        unsafe {
+            let tail = (*self.sq_tail).load(Ordering::Relaxed);
+            if tail.wrapping_sub((*self.sq_head).load(Ordering::Acquire)) >= self.sq_entries {
+                return false;
+            }
+            let index = tail & self.sq_mask;
+            *self.sqes.add(index as usize) = sqe;
+            *self.sq_array.add(index as usize) = index;
+            (*self.sq_tail).store(tail.wrapping_add(1), Ordering::Release);
+        }
+        self.unsubmitted += 1;
+        true
+    }
+
+    /// Submits queued SQEs and waits until at least min_complete completions are available.
+    pub fn submit_and_wait(&mut self, min_complete: u32) -> std::io::Result<()> {
+        loop {
+            let flags = if min_complete > 0 { IORING_ENTER_GETEVENTS } else { 0 };
+            let ret = unsafe {
+                libc::syscall(
+                    libc::SYS_io_uring_enter, self.fd, self.unsubmitted, min_complete, flags,
+                    std::ptr::null::<libc::sigset_t>(), 0usize,
+                )
+            };
+            if ret >= 0 {
+                self.unsubmitted -= ret as u32;
+                return Ok(());
+            }
+            let err = std::io::Error::last_os_error();
+            if err.kind() != std::io::ErrorKind::Interrupted {
+                return Err(err);
+            }
+        }
+    }
+
+    pub fn pop(&mut self) -> Option<Cqe> {
+        unsafe {
+            let head = (*self.cq_head).load(Ordering::Relaxed);
+            if head == (*self.cq_tail).load(Ordering::Acquire) {
+                return None;
+            }
+            let cqe = *self.cqes.add((head & self.cq_mask) as usize);
+            (*self.cq_head).store(head.wrapping_add(1), Ordering::Release);
+            Some(cqe)
+        }
+    }
+}
+
+impl Drop for Uring {
+    fn drop(&mut self) {
+        // Closing the fd cancels whatever is still in flight; callers drain first.
+        unsafe { libc::close(self.fd) };
+    }
+}
@@ -22,3 +22,24 @@ pub fn short_cstr(const_ptr_char: *const libc::c_char) -> &'static std::ffi::CSt
 	});
 	unsafe { std::ffi::CStr::from_ptr(const_ptr_char) }
 }
+
+/// CLOCK_MONOTONIC in nanoseconds. This is comparable across the processes of
+/// one machine, so per-thread traces can be merged by it (see prov-compact).
+pub fn timestamp_ns() -> u64 {
+	let mut ts = libc::timespec { tv_sec: 0, tv_nsec: 0 };
+	unsafe { libc::clock_gettime(libc::CLOCK_MONOTONIC, &mut ts) };
+	ts.tv_sec as u64 * 1_000_000_000 + ts.tv_nsec as u64
+}
+
+/// Installs handler for signal, returning the previous action.
+pub fn set_signal_handler(signal: libc::c_int, handler: extern "C" fn(libc::c_int), flags: libc::c_int) -> libc::sigaction {
+	unsafe {
+		let mut action: libc::sigaction = std::mem::zeroed();
+		action.sa_sigaction = handler as libc::sighandler_t;
+		action.sa_flags = flags;
+		libc::sigemptyset(&mut action.sa_mask);
+		let mut old_action: libc::sigaction = std::mem::zeroed();
+		libc::sigaction(signal, &action, &mut old_action);
+		old_action
+	}
+}
@@ -0,0 +1,18 @@
+set -e -x
+
+# Compares the per-process startup cost of the tracer across build profiles.
+# Run from this directory.
+
+n=2000
+
+gcc -Wall -Wextra -O2 -o startup_bench startup_bench.c
+
+(cd .. && cargo build && cargo build --release && cargo build --profile slim)
+
+echo ============ no LD_PRELOAD ============
+./startup_bench $n
+for profile in debug release slim; do
+    echo ============ $profile ============
+    ls -l ../target/$profile/libprov_tracer.so
+    ./startup_bench $n $PWD/../target/$profile/libprov_tracer.so
+done
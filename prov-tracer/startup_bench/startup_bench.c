@@ -0,0 +1,128 @@
+/*
+ * Startup latency of short-lived processes, with and without a preloaded library.
+ *
+ * Usage:
+ *
+ *     startup_bench N [LD_PRELOAD_VALUE]
+ *
+ * Runs each of these N times and prints the median and 90th percentile:
+ *
+ *   - exec-to-main: time from just before execve until main() of this same
+ *     binary (in --target mode) starts. This is the dynamic linking,
+ *     relocation, and constructor cost that a preloaded library adds.
+ *
+ *   - true: time to fork, execve /bin/true, and reap it.
+ *
+ * LD_PRELOAD is only set in the child's environment, so the harness itself is
+ * never traced.
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#define unlikely(x)    __builtin_expect(!!(x), 0)
+
+#define EXPECT_POSITIVE(expr) ({\
+            long ret = expr; \
+            if (unlikely(ret < 0)) { \
+                fprintf(stderr, "failure on line %d: %s\nreturned a negative, %ld\nstrerror: %s\n", __LINE__, #expr, ret, strerror(errno)); \
+                abort(); \
+            } \
+            ret; \
+    })
+
+static int64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int compare_int64(const void* a, const void* b) {
+    int64_t x = *(const int64_t*) a, y = *(const int64_t*) b;
+    return (x > y) - (x < y);
+}
+
+static void report(const char* label, int64_t* samples, int n) {
+    qsort(samples, (size_t) n, sizeof(int64_t), compare_int64);
+    printf("%-14s median %8.1f us   p90 %8.1f us\n", label, samples[n / 2] / 1e3, samples[n * 9 / 10] / 1e3);
+}
+
+/* Fork and exec argv with envp; returns ns from just before execve until the
+ * child writes to fd 3 (if wait_for_report) or until the child is reaped. */
+static int64_t time_exec(char** argv, char** envp, int wait_for_report) {
+    int report_pipe[2];
+    EXPECT_POSITIVE(pipe(report_pipe));
+    int64_t start = now_ns();
+    pid_t pid = EXPECT_POSITIVE(fork());
+    if (pid == 0) {
+        close(report_pipe[0]);
+        dup2(report_pipe[1], 3);
+        execve(argv[0], argv, envp);
+        _exit(127);
+    }
+    close(report_pipe[1]);
+    int64_t stop = 0;
+    if (wait_for_report) {
+        if (read(report_pipe[0], &stop, sizeof(stop)) != sizeof(stop)) {
+            fprintf(stderr, "%s did not report its start time\n", argv[0]);
+            exit(1);
+        }
+    }
+    int wstatus;
+    EXPECT_POSITIVE(waitpid(pid, &wstatus, 0));
+    if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0) {
+        fprintf(stderr, "%s failed\n", argv[0]);
+        exit(1);
+    }
+    if (!wait_for_report) {
+        stop = now_ns();
+    }
+    close(report_pipe[0]);
+    return stop - start;
+}
+
+int main(int argc, char** argv) {
+    if (argc == 2 && strcmp(argv[1], "--target") == 0) {
+        int64_t start = now_ns();
+        return write(3, &start, sizeof(start)) == sizeof(start) ? 0 : 1;
+    }
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "Usage: %s N [LD_PRELOAD_VALUE]\n", argv[0]);
+        return 2;
+    }
+    int n = atoi(argv[1]);
+    if (n < 1) {
+        fprintf(stderr, "N must be positive\n");
+        return 2;
+    }
+    char ld_preload[4096] = "";
+    if (argc == 3) {
+        snprintf(ld_preload, sizeof(ld_preload), "LD_PRELOAD=%s", argv[2]);
+    }
+    char* envp[] = {argc == 3 ? ld_preload : NULL, NULL};
+
+    char self[4096];
+    ssize_t self_len = EXPECT_POSITIVE(readlink("/proc/self/exe", self, sizeof(self) - 1));
+    self[self_len] = '\0';
+    char* target_argv[] = {self, "--target", NULL};
+    char* true_argv[] = {"/bin/true", NULL};
+
+    int64_t* samples = calloc((size_t) n, sizeof(int64_t));
+    for (int i = 0; i < n; ++i) {
+        samples[i] = time_exec(target_argv, envp, 1);
+    }
+    report("exec-to-main", samples, n);
+    for (int i = 0; i < n; ++i) {
+        samples[i] = time_exec(true_argv, envp, 0);
+    }
+    report("/bin/true", samples, n);
+    free(samples);
+    return 0;
+}
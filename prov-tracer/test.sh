@@ -10,6 +10,7 @@ cmds=(
 )
 
 cargo build
+(cd prov_tools && cargo build)
 if [ ! -d tmp ]; then
     mkdir tmp
 fi
@@ -23,7 +24,7 @@ for cmd in "${cmds[@]}"; do
     if [ -n "$(ls tmp)" ]; then
         for file in tmp/*; do
             chmod 644 $file
-            cat $file
+            prov_tools/target/debug/prov-cat $file
             rm $file
         done
     fi
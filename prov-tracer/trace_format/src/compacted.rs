@@ -0,0 +1,227 @@
+/*
+ * A compacted trace: the records of many per-thread traces merged by
+ * timestamp into one file (see prov-compact).
+ *
+ *     header: COMPACTED_MAGIC, then as in a per-thread trace
+ *     record blocks: lines are "timestamp pid tid record", where every quoted
+ *         path in record is replaced by @id
+ *     path blocks: line id is the quoted path with that id
+ *     index: one IndexEntry per record block
+ *     footer: Footer
+ *
+ * Blocks are framed and compressed as in a per-thread trace. Readers start
+ * from the footer, so the path table and the index can be written after the
+ * records, in one streaming pass.
+ */
+
+pub const COMPACTED_MAGIC: &[u8; 8] = b"PROVCMP\0";
+pub const INDEX_ENTRY_SIZE: usize = 32;
+pub const FOOTER_SIZE: usize = 40;
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct IndexEntry {
+    /// File offset of the block
+    pub offset: u64,
+    pub first_timestamp: u64,
+    pub last_timestamp: u64,
+    pub records: u32,
+}
+
+impl IndexEntry {
+    pub fn to_bytes(&self) -> [u8; INDEX_ENTRY_SIZE] {
+        let mut bytes = [0u8; INDEX_ENTRY_SIZE];
+        bytes[0..8].copy_from_slice(&self.offset.to_le_bytes());
+        bytes[8..16].copy_from_slice(&self.first_timestamp.to_le_bytes());
+        bytes[16..24].copy_from_slice(&self.last_timestamp.to_le_bytes());
+        bytes[24..28].copy_from_slice(&self.records.to_le_bytes());
+        bytes
+    }
+
+    pub fn from_bytes(bytes: &[u8]) -> Self {
+        Self {
+            offset: u64::from_le_bytes(bytes[0..8].try_into().unwrap()),
+            first_timestamp: u64::from_le_bytes(bytes[8..16].try_into().unwrap()),
+            last_timestamp: u64::from_le_bytes(bytes[16..24].try_into().unwrap()),
+            records: u32::from_le_bytes(bytes[24..28].try_into().unwrap()),
+        }
+    }
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct Footer {
+    pub paths_offset: u64,
+    pub index_offset: u64,
+    pub blocks: u64,
+    pub paths: u64,
+}
+
+impl Footer {
+    pub fn to_bytes(&self) -> [u8; FOOTER_SIZE] {
+        let mut bytes = [0u8; FOOTER_SIZE];
+        bytes[0..8].copy_from_slice(&self.paths_offset.to_le_bytes());
+        bytes[8..16].copy_from_slice(&self.index_offset.to_le_bytes());
+        bytes[16..24].copy_from_slice(&self.blocks.to_le_bytes());
+        bytes[24..32].copy_from_slice(&self.paths.to_le_bytes());
+        bytes[32..40].copy_from_slice(COMPACTED_MAGIC);
+        bytes
+    }
+
+    pub fn from_bytes(bytes: &[u8; FOOTER_SIZE]) -> std::io::Result<Self> {
+        if &bytes[32..40] != COMPACTED_MAGIC {
+            return Err(super::invalid_data("compacted trace is truncated (bad footer)".to_string()));
+        }
+        Ok(Self {
+            paths_offset: u64::from_le_bytes(bytes[0..8].try_into().unwrap()),
+            index_offset: u64::from_le_bytes(bytes[8..16].try_into().unwrap()),
+            blocks: u64::from_le_bytes(bytes[16..24].try_into().unwrap()),
+            paths: u64::from_le_bytes(bytes[24..32].try_into().unwrap()),
+        })
+    }
+}
+
+/// The leading timestamp of a record line.
+pub fn timestamp(line: &[u8]) -> Option<u64> {
+    let end = line.iter().position(|byte| *byte == b' ').unwrap_or(line.len());
+    std::str::from_utf8(&line[..end]).ok()?.parse().ok()
+}
+
+/// Length of the quoted string (Rust Debug syntax) at the start of bytes, including quotes.
+fn quoted_len(bytes: &[u8]) -> Option<usize> {
+    let mut i = 1;
+    while i < bytes.len() {
+        match bytes[i] {
+            b'\\' => i += 2,
+            b'"' => return Some(i + 1),
+            _ => i += 1,
+        }
+    }
+    None
+}
+
+/// Appends line to output with every quoted path replaced by @intern(path).
+pub fn intern_paths(line: &[u8], mut intern: impl FnMut(&[u8]) -> u32, output: &mut Vec<u8>) {
+    let mut rest = line;
+    while let Some(start) = rest.iter().position(|byte| *byte == b'"') {
+        output.extend_from_slice(&rest[..start]);
+        rest = &rest[start..];
+        match quoted_len(rest) {
+            Some(len) => {
+                output.push(b'@');
+                output.extend_from_slice(intern(&rest[..len]).to_string().as_bytes());
+                rest = &rest[len..];
+            },
+            None => break,
+        }
+    }
+    output.extend_from_slice(rest);
+}
+
+/// The inverse of intern_paths.
+pub fn expand_paths(line: &[u8], paths: &[Vec<u8>], output: &mut Vec<u8>) -> std::io::Result<()> {
+    let mut rest = line;
+    while let Some(start) = rest.iter().position(|byte| *byte == b'@') {
+        output.extend_from_slice(&rest[..start]);
+        rest = &rest[start + 1..];
+        let digits = rest.iter().take_while(|byte| byte.is_ascii_digit()).count();
+        let id: usize = std::str::from_utf8(&rest[..digits]).unwrap().parse()
+            .map_err(|_| super::invalid_data("bad path reference in compacted trace".to_string()))?;
+        output.extend_from_slice(paths.get(id).ok_or_else(|| {
+            super::invalid_data(format!("path @{} is not in the path table", id))
+        })?);
+        rest = &rest[digits..];
+    }
+    output.extend_from_slice(rest);
+    Ok(())
+}
+
+/// The bytes of a quoted path, as the tracer prints a CStr: `\t \r \n \\ \' \"` and `\xNN` escapes.
+pub fn unquote(quoted: &[u8]) -> Vec<u8> {
+    let inner = quoted.strip_prefix(b"\"").and_then(|inner| inner.strip_suffix(b"\"")).unwrap_or(quoted);
+    let mut output = Vec::with_capacity(inner.len());
+    let mut i = 0;
+    while i < inner.len() {
+        if inner[i] != b'\\' || i + 1 == inner.len() {
+            output.push(inner[i]);
+            i += 1;
+            continue;
+        }
+        match inner[i + 1] {
+            b't' => output.push(b'\t'),
+            b'r' => output.push(b'\r'),
+            b'n' => output.push(b'\n'),
+            b'0' => output.push(0),
+            b'x' if i + 3 < inner.len() => {
+                let hex = std::str::from_utf8(&inner[i + 2..i + 4]).ok().and_then(|hex| u8::from_str_radix(hex, 16).ok());
+                if let Some(byte) = hex {
+                    output.push(byte);
+                    i += 4;
+                    continue;
+                }
+                output.push(b'x');
+            },
+            other => output.push(other),
+        }
+        i += 2;
+    }
+    output
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    /// A path as the tracer quotes it
+    fn quoted(path: &[u8]) -> Vec<u8> {
+        format!("{:?}", std::ffi::CString::new(path).unwrap()).into_bytes()
+    }
+
+    #[test]
+    fn unquote_inverts_the_tracers_quoting() {
+        let every_byte: Vec<u8> = (1..=255).collect();
+        for path in [&b"/usr/include/stdio.h"[..], b"", b"tab\there\nnewline", b"quote\" and 'apostrophe' \\ backslash", &every_byte] {
+            assert_eq!(unquote(&quoted(path)), path);
+        }
+    }
+
+    #[test]
+    fn expand_paths_inverts_intern_paths() {
+        let line = [
+            &b"123 op code: Move file0: (-100 "[..], &quoted(b"/tmp/a b"), b") file1: (-100 ",
+            &quoted(b"/tmp/\xffx\"@1"), b") stack: 2\n",
+        ].concat();
+        let mut paths: Vec<Vec<u8>> = vec![b"\"/already/there\"".to_vec()];
+        let mut interned = Vec::new();
+        intern_paths(&line, |path| {
+            paths.push(path.to_vec());
+            (paths.len() - 1) as u32
+        }, &mut interned);
+        assert_eq!(interned, b"123 op code: Move file0: (-100 @1) file1: (-100 @2) stack: 2\n");
+        let mut expanded = Vec::new();
+        expand_paths(&interned, &paths, &mut expanded).unwrap();
+        assert_eq!(expanded, line);
+        assert_eq!(unquote(&paths[2]), b"/tmp/\xffx\"@1");
+    }
+
+    #[test]
+    fn expand_paths_rejects_unknown_ids() {
+        assert!(expand_paths(b"1 open file: (-100 @7)\n", &[], &mut Vec::new()).is_err());
+    }
+
+    #[test]
+    fn index_entries_and_footers_round_trip() {
+        let entry = IndexEntry { offset: 1 << 40, first_timestamp: 5, last_timestamp: u64::MAX - 1, records: 65536 };
+        assert_eq!(IndexEntry::from_bytes(&entry.to_bytes()), entry);
+        let footer = Footer { paths_offset: 1, index_offset: 2, blocks: 3, paths: 4 };
+        assert_eq!(Footer::from_bytes(&footer.to_bytes()).unwrap(), footer);
+        let mut truncated = footer.to_bytes();
+        truncated[FOOTER_SIZE - 1] ^= 1;
+        assert!(Footer::from_bytes(&truncated).is_err());
+    }
+
+    #[test]
+    fn timestamp_is_the_leading_number() {
+        assert_eq!(timestamp(b"1700000000123 open mode: Read"), Some(1700000000123));
+        assert_eq!(timestamp(b"42"), Some(42));
+        assert_eq!(timestamp(b"nope 1"), None);
+    }
+}
@@ -0,0 +1,48 @@
+/*
+ * The page of counters a traced process publishes for prov-top
+ * (PROV_TRACER_COUNTERS=1). It is the POSIX shared memory object
+ * shm_name(pid), i.e. /dev/shm/prov-tracer.PID, holding one Counters.
+ *
+ * The tracee only ever adds to the counters (buffered_bytes also goes down),
+ * with relaxed atomics; readers take differences between two snapshots.
+ * magic is stored last, so a reader that sees it sees pid too.
+ */
+
+use std::sync::atomic::AtomicU64;
+
+pub const COUNTERS_MAGIC: u64 = u64::from_le_bytes(*b"PROVCNT\0");
+pub const SHM_PREFIX: &str = "prov-tracer.";
+
+/// Records by kind, named as in the trace: open, close and dup, the
+/// UnaryFileOps and BinaryFileOps in declaration order, then application markers.
+pub const OPS: [&str; 15] = [
+    "open", "close", "dup",
+    "Chdir", "Opendir", "Walk", "MetadataRead", "MetadataWritePart", "Readlink", "Unlink",
+    "Hardlink", "Symlink", "Move", "Exchange",
+    "mark",
+];
+pub const FIRST_UNARY_OP: usize = 3;
+pub const FIRST_BINARY_OP: usize = 10;
+pub const MARK: usize = 14;
+
+#[repr(C)]
+pub struct Counters {
+    pub magic: AtomicU64,
+    pub pid: AtomicU64,
+    /// Records written, by OPS index
+    pub events: [AtomicU64; OPS.len()],
+    /// Bytes of trace text written
+    pub bytes_logged: AtomicU64,
+    /// Bytes of trace text held in memory, not yet handed to the kernel or the collector
+    pub buffered_bytes: AtomicU64,
+    /// Records lost (when the collector goes away, or a trace file cannot be written)
+    pub dropped: AtomicU64,
+    /// Traced calls, and the time spent in them outside the real libc function
+    pub hook_calls: AtomicU64,
+    pub hook_ns: AtomicU64,
+}
+
+/// Name for shm_open
+pub fn shm_name(pid: u32) -> String {
+    format!("/{}{}", SHM_PREFIX, pid)
+}
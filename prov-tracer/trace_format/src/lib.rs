@@ -0,0 +1,219 @@
+/*
+ * On-disk format of the tracer's output, shared by the tracer and by the tools
+ * which read traces.
+ *
+ * A trace file is a header followed by blocks (all integers little-endian):
+ *
+ *     header: MAGIC (8 bytes) | version: u32 | compression: u32 | dictionary hash: u64
+ *     block:  payload length: u32 | uncompressed length: u32 | payload
+ *
+ * Every block holds whole lines of the text trace and is compressed on its
+ * own (one zstd frame), so readers can decode blocks independently and in
+ * parallel.
+ */
+
+use std::io::{Read, Write};
+
+pub mod compacted;
+pub mod counters;
+pub mod shm_ring;
+
+pub const MAGIC: &[u8; 8] = b"PROVTRC\0";
+pub const VERSION: u32 = 1;
+pub const HEADER_SIZE: usize = 24;
+pub const BLOCK_HEADER_SIZE: usize = 8;
+
+/// Raw-content dictionary of path prefixes and record fragments that show up
+/// in most traces (Nix store, Spack prefixes, the tracer's own line format).
+/// zstd treats any bytes without the dictionary magic as raw content, so this
+/// is plain text rather than the output of `zstd --train`.
+pub static BUILTIN_DICTIONARY: &[u8] = include_bytes!("paths.dict");
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Compression {
+    None = 0,
+    Zstd = 1,
+}
+
+impl Compression {
+    fn from_u32(value: u32) -> std::io::Result<Self> {
+        match value {
+            0 => Ok(Compression::None),
+            1 => Ok(Compression::Zstd),
+            _ => Err(invalid_data(format!("unknown compression {}", value))),
+        }
+    }
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct Header {
+    pub compression: Compression,
+    /// dictionary_hash of the dictionary the blocks were compressed with, or 0 for none.
+    pub dictionary_hash: u64,
+}
+
+impl Header {
+    pub fn to_bytes(&self) -> [u8; HEADER_SIZE] {
+        self.to_bytes_with_magic(MAGIC)
+    }
+
+    /// Header of a file type other than a per-thread trace (see compacted).
+    pub fn to_bytes_with_magic(&self, magic: &[u8; 8]) -> [u8; HEADER_SIZE] {
+        let mut bytes = [0u8; HEADER_SIZE];
+        bytes[0..8].copy_from_slice(magic);
+        bytes[8..12].copy_from_slice(&VERSION.to_le_bytes());
+        bytes[12..16].copy_from_slice(&(self.compression as u32).to_le_bytes());
+        bytes[16..24].copy_from_slice(&self.dictionary_hash.to_le_bytes());
+        bytes
+    }
+
+    pub fn read_from<R: Read>(reader: &mut R) -> std::io::Result<Self> {
+        let mut bytes = [0u8; HEADER_SIZE];
+        reader.read_exact(&mut bytes)?;
+        Self::from_bytes(&bytes, MAGIC)
+    }
+
+    pub fn from_bytes(bytes: &[u8; HEADER_SIZE], magic: &[u8; 8]) -> std::io::Result<Self> {
+        if &bytes[0..8] != magic {
+            return Err(invalid_data("not a prov-tracer trace (bad magic)".to_string()));
+        }
+        let version = u32::from_le_bytes(bytes[8..12].try_into().unwrap());
+        if version != VERSION {
+            return Err(invalid_data(format!("unsupported trace version {}", version)));
+        }
+        Ok(Header {
+            compression: Compression::from_u32(u32::from_le_bytes(bytes[12..16].try_into().unwrap()))?,
+            dictionary_hash: u64::from_le_bytes(bytes[16..24].try_into().unwrap()),
+        })
+    }
+}
+
+/// FNV-1a; only used to check that a reader has the same dictionary as the writer.
+pub fn dictionary_hash(dictionary: &[u8]) -> u64 {
+    dictionary.iter().fold(0xcbf29ce484222325u64, |hash, byte| {
+        (hash ^ (*byte as u64)).wrapping_mul(0x100000001b3)
+    })
+}
+
+/// Parses a dictionary setting: "none", "builtin", or the path of a dictionary file.
+pub fn load_dictionary(setting: &str) -> std::io::Result<Option<Vec<u8>>> {
+    match setting {
+        "none" => Ok(None),
+        "builtin" => Ok(Some(BUILTIN_DICTIONARY.to_vec())),
+        path => std::fs::read(path).map(Some),
+    }
+}
+
+pub struct BlockEncoder {
+    compressor: Option<zstd::bulk::Compressor<'static>>,
+}
+
+impl BlockEncoder {
+    pub fn new(compression: Compression, level: i32, dictionary: Option<&[u8]>) -> std::io::Result<Self> {
+        Ok(Self {
+            compressor: match compression {
+                Compression::None => None,
+                Compression::Zstd => Some(match dictionary {
+                    Some(dictionary) => zstd::bulk::Compressor::with_dictionary(level, dictionary)?,
+                    None => zstd::bulk::Compressor::new(level)?,
+                }),
+            },
+        })
+    }
+
+    /// Upper bound on what encode appends for data_len bytes of data.
+    pub fn max_encoded_len(data_len: usize) -> usize {
+        BLOCK_HEADER_SIZE + zstd::zstd_safe::compress_bound(data_len)
+    }
+
+    /// Appends data, framed as one block, to output.
+    pub fn encode(&mut self, data: &[u8], output: &mut Vec<u8>) -> std::io::Result<()> {
+        let start = output.len();
+        output.extend_from_slice(&[0u8; BLOCK_HEADER_SIZE]);
+        match &mut self.compressor {
+            None => output.extend_from_slice(data),
+            Some(compressor) => {
+                let payload_start = output.len();
+                output.resize(payload_start + zstd::zstd_safe::compress_bound(data.len()), 0);
+                let payload_len = compressor.compress_to_buffer(data, &mut output[payload_start..])?;
+                output.truncate(payload_start + payload_len);
+            },
+        }
+        let payload_len = (output.len() - start - BLOCK_HEADER_SIZE) as u32;
+        output[start..start + 4].copy_from_slice(&payload_len.to_le_bytes());
+        output[start + 4..start + 8].copy_from_slice(&(data.len() as u32).to_le_bytes());
+        Ok(())
+    }
+}
+
+pub struct RawBlock {
+    pub uncompressed_len: u32,
+    pub payload: Vec<u8>,
+}
+
+/// Reads the next block, or None at end of file.
+pub fn read_block<R: Read>(reader: &mut R) -> std::io::Result<Option<RawBlock>> {
+    let mut header = [0u8; BLOCK_HEADER_SIZE];
+    match reader.read_exact(&mut header) {
+        Err(err) if err.kind() == std::io::ErrorKind::UnexpectedEof => return Ok(None),
+        other => other?,
+    }
+    let payload_len = u32::from_le_bytes(header[0..4].try_into().unwrap());
+    let uncompressed_len = u32::from_le_bytes(header[4..8].try_into().unwrap());
+    let mut payload = vec![0u8; payload_len as usize];
+    reader.read_exact(&mut payload)?;
+    Ok(Some(RawBlock { uncompressed_len, payload }))
+}
+
+pub struct BlockDecoder {
+    decompressor: Option<zstd::bulk::Decompressor<'static>>,
+}
+
+impl BlockDecoder {
+    /// dictionary must be the one the trace was written with (see Header::dictionary_hash).
+    pub fn new(header: &Header, dictionary: Option<&[u8]>) -> std::io::Result<Self> {
+        let expected_hash = dictionary.map(dictionary_hash).unwrap_or(0);
+        if header.dictionary_hash != expected_hash {
+            return Err(invalid_data(if header.dictionary_hash == dictionary_hash(BUILTIN_DICTIONARY) {
+                "trace was compressed with the builtin dictionary".to_string()
+            } else {
+                format!("trace was compressed with a different dictionary (hash {:016x})", header.dictionary_hash)
+            }));
+        }
+        Ok(Self {
+            decompressor: match header.compression {
+                Compression::None => None,
+                Compression::Zstd => Some(match dictionary {
+                    Some(dictionary) => zstd::bulk::Decompressor::with_dictionary(dictionary)?,
+                    None => zstd::bulk::Decompressor::new()?,
+                }),
+            },
+        })
+    }
+
+    pub fn decode(&mut self, block: &RawBlock) -> std::io::Result<Vec<u8>> {
+        match &mut self.decompressor {
+            None => Ok(block.payload.clone()),
+            Some(decompressor) => decompressor.decompress(&block.payload, block.uncompressed_len as usize),
+        }
+    }
+}
+
+/// Picks the dictionary for a trace: the builtin one if the header says so, else dictionary_path.
+pub fn dictionary_for(header: &Header, dictionary_path: Option<&str>) -> std::io::Result<Option<Vec<u8>>> {
+    if header.dictionary_hash == 0 {
+        Ok(None)
+    } else if header.dictionary_hash == dictionary_hash(BUILTIN_DICTIONARY) {
+        Ok(Some(BUILTIN_DICTIONARY.to_vec()))
+    } else {
+        load_dictionary(dictionary_path.unwrap_or("none"))
+    }
+}
+
+pub fn write_header<W: Write>(writer: &mut W, header: &Header) -> std::io::Result<()> {
+    writer.write_all(&header.to_bytes())
+}
+
+fn invalid_data(msg: String) -> std::io::Error {
+    std::io::Error::new(std::io::ErrorKind::InvalidData, msg)
+}
@@ -0,0 +1,154 @@
+/*
+ * The shared-memory ring through which a traced thread hands its records to
+ * prov-collector (PROV_TRACER_MODE=collector).
+ *
+ * The collector creates one memfd per traced thread and passes it over the
+ * Unix socket; both sides map it whole:
+ *
+ *     0:   write: u64, bytes the tracee has published (only the tracee stores it)
+ *     64:  read: u64, bytes the collector has consumed (only the collector stores it)
+ *     128: data, used circularly: byte n is at RING_HEADER_SIZE + n % capacity
+ *
+ * The counters are on separate cache lines and only ever increase. The
+ * tracee publishes only at the end of a record, so a tracee that dies
+ * mid-write leaves at most an unpublished partial record, which is never
+ * read; and since every thread has its own memfd, it cannot touch anyone
+ * else's records.
+ *
+ * The handshake: the tracee connects and sends "pid tid\n"; the collector
+ * replies with one byte carrying the memfd (SCM_RIGHTS).
+ */
+
+use std::sync::atomic::{AtomicU64, Ordering};
+
+pub const RING_HEADER_SIZE: usize = 128;
+const WRITE_OFFSET: usize = 0;
+const READ_OFFSET: usize = 64;
+
+/// A mapped ring; the mapping must outlive it.
+pub struct ShmRing {
+    base: *mut u8,
+    capacity: usize,
+}
+
+// Both counters are atomics, and each side only writes the data it owns.
+unsafe impl Send for ShmRing {}
+
+impl ShmRing {
+    /// # Safety
+    /// base must point to a mapping of len bytes, 8-byte aligned, which outlives the ShmRing.
+    pub unsafe fn from_raw(base: *mut u8, len: usize) -> Self {
+        assert!(len > RING_HEADER_SIZE);
+        Self { base, capacity: len - RING_HEADER_SIZE }
+    }
+
+    pub fn base(&self) -> *mut u8 {
+        self.base
+    }
+
+    pub fn capacity(&self) -> usize {
+        self.capacity
+    }
+
+    fn counter(&self, offset: usize) -> &AtomicU64 {
+        unsafe { &*(self.base.add(offset) as *const AtomicU64) }
+    }
+
+    pub fn written(&self) -> u64 {
+        self.counter(WRITE_OFFSET).load(Ordering::Acquire)
+    }
+
+    pub fn consumed(&self) -> u64 {
+        self.counter(READ_OFFSET).load(Ordering::Acquire)
+    }
+
+    /// Tracee: makes everything up to position visible to the collector.
+    pub fn publish(&self, position: u64) {
+        self.counter(WRITE_OFFSET).store(position, Ordering::Release);
+    }
+
+    /// Collector: frees everything up to position for the tracee.
+    pub fn consume(&self, position: u64) {
+        self.counter(READ_OFFSET).store(position, Ordering::Release);
+    }
+
+    /// Tracee: copies data in at position; the caller has checked there is room.
+    pub fn put(&self, position: u64, data: &[u8]) {
+        let start = (position % self.capacity as u64) as usize;
+        let first = data.len().min(self.capacity - start);
+        unsafe {
+            let data_start = self.base.add(RING_HEADER_SIZE);
+            std::ptr::copy_nonoverlapping(data.as_ptr(), data_start.add(start), first);
+            std::ptr::copy_nonoverlapping(data.as_ptr().add(first), data_start, data.len() - first);
+        }
+    }
+
+    /// Collector: appends the bytes in [from, to) to output.
+    pub fn get(&self, from: u64, to: u64, output: &mut Vec<u8>) {
+        let len = (to - from) as usize;
+        let start = (from % self.capacity as u64) as usize;
+        let first = len.min(self.capacity - start);
+        unsafe {
+            let data_start = self.base.add(RING_HEADER_SIZE) as *const u8;
+            output.extend_from_slice(std::slice::from_raw_parts(data_start.add(start), first));
+            output.extend_from_slice(std::slice::from_raw_parts(data_start, len - first));
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    /// A heap mapping standing in for the memfd; u64s keep it 8-byte aligned.
+    fn ring(capacity: usize) -> (Vec<u64>, ShmRing) {
+        let mut mapping = vec![0u64; (RING_HEADER_SIZE + capacity) / 8];
+        let ring = unsafe { ShmRing::from_raw(mapping.as_mut_ptr() as *mut u8, mapping.len() * 8) };
+        (mapping, ring)
+    }
+
+    #[test]
+    fn records_survive_wraparound() {
+        let (_mapping, ring) = ring(64);
+        let mut position = 0;
+        let mut received = Vec::new();
+        let mut sent = Vec::new();
+        // Records of 6 to 8 bytes in a 64-byte ring straddle its end at many offsets.
+        for i in 0..200 {
+            let record = format!("{} rec\n", i).into_bytes();
+            assert!(position + record.len() as u64 - ring.consumed() <= ring.capacity() as u64);
+            ring.put(position, &record);
+            position += record.len() as u64;
+            ring.publish(position);
+            sent.extend_from_slice(&record);
+            ring.get(ring.consumed(), ring.written(), &mut received);
+            ring.consume(ring.written());
+        }
+        assert_eq!(received, sent);
+        assert_eq!(ring.written(), sent.len() as u64);
+        assert!(ring.written() > 10 * ring.capacity() as u64);
+    }
+
+    #[test]
+    fn a_record_as_big_as_the_ring_fits() {
+        let (_mapping, ring) = ring(64);
+        ring.put(0, &[1; 40]);
+        ring.publish(40);
+        ring.consume(40);
+        let record: Vec<u8> = (0..64).collect();
+        ring.put(40, &record);
+        ring.publish(104);
+        let mut received = Vec::new();
+        ring.get(40, 104, &mut received);
+        assert_eq!(received, record);
+    }
+
+    #[test]
+    fn counters_are_in_the_shared_header() {
+        let (mapping, ring) = ring(64);
+        ring.publish(7);
+        ring.consume(3);
+        assert_eq!(mapping[WRITE_OFFSET / 8], 7);
+        assert_eq!(mapping[READ_OFFSET / 8], 3);
+    }
+}